@@ -11,37 +11,207 @@
 *              input 32 bytes at a time. During each iteration, the block is encrypted with the expanded key, the block is wrote to the output
 *              file, and the key is roated to accommodate for the next block.
 *
+*              The program also has a key search mode for recovering the 4 byte key of a ciphertext whose plaintext prefix is known.
+*              It brute forces all 2^32 keys across every core. Each thread expands 256 candidate keys at once (one per SIMD lane)
+*              and compares the first block's keystream against the ciphertext XOR the known plaintext. The expanded key only depends
+*              on its first byte and the step between bytes, so 2^32 keys make just 2^16 distinct keys and every match comes with
+*              131072 equivalent keys that encrypt identically. Matches are reported one per equivalence class, with the class size,
+*              along with the time taken.
+*
+*              The directory mode encrypts every file below an input directory into a mirrored output directory. Files are cut into
+*              ranges and the ranges are scheduled on a work stealing thread pool, so one large file is spread over every thread.
+*              A range starts with the key state of its first block, computed by jumping ahead in the rotation schedule.
+*
+*              Full blocks go through kernels templated on the block size, which the compiler fully unrolls. Only the last partial
+*              block uses the runtime size functions. The block size defaults to 32 bytes, 16 and 64 byte blocks are available as
+*              cipher variants (their ciphertext differs), and the benchmark mode compares the kernels with the runtime path.
+*
+*              With --offset and --length only that byte range of the input is processed and written to the output. The key for the
+*              block holding the offset is found by jumping ahead in the rotation schedule and the range is read with pread, so reading
+*              a slice of a large encrypted file costs the size of the slice rather than the size of the file.
+*
+*              The cipher functions live in cipher.h so other programs, such as the UDP server's encrypted capture, share them.
+*
 * Help:        While writting this file, I followed along the material provided in Module 9. I also followed the key expansion 
 *              and rotation algorithms provided in the assignment instructions.
 *
-* Compilation: g++ -c cipher.cpp
-*              g++ -o cipher cipher.o
+* Compilation: g++ -O3 -march=native -c cipher.cpp
+*              g++ -pthread -o cipher cipher.o
 *
-* Usage:       ./cipher <input file> <output file> <key>
+* Usage:       ./cipher <input file> <output file> <key> [--block 16|32|64] [--offset <byte> --length <bytes>]
+*              ./cipher --search <ciphertext file> <known plaintext file> [threads]
+*              ./cipher --dir <input directory> <output directory> <key> [threads]
+*              ./cipher --bench [megabytes]
 */
 
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <cctype>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <deque>
+#include <filesystem>
+#include <limits>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cipher.h"
 
 
 using namespace std;
 
 
+/* Key Search */
+const int SEARCH_LANES = 256;           // candidate keys expanded per batch, the low key byte selects the lane
+const uint64_t SEARCH_CHUNK = 1 << 24;  // keys handed to a thread at a time
+const size_t SEARCH_REPORT = 16;        // maximum equivalence classes printed
+const int SEARCH_CLASSES = 1 << 16;     // equivalence classes of keys, one per first key byte and step
+
+struct searchState
+{
+    uint8_t keystream[32];              // ciphertext XOR known plaintext for the first block
+    int length;                         // number of keystream bytes to match
+    atomic<uint64_t> next;              // next unclaimed key
+    atomic<uint64_t> found;             // number of matching keys
+    mutex lock;                         // guards classSize and classKey
+    vector<uint64_t> classSize;         // matching keys per equivalence class
+    vector<uint32_t> classKey;          // lowest matching key of every class, the one reported
+};
+
+
+/* Directory Mode */
+const off_t RANGE_BYTES = 8 << 20;      // bytes of a file encrypted by one task, a multiple of the block size
+const size_t IO_BYTES = 1 << 16;        // bytes read and written per system call, a multiple of the block size
+
+struct rangeTask
+{
+    int file;                           // index into the file list
+    off_t offset;                       // first byte of the range
+    off_t length;                       // number of bytes in the range
+};
+
+struct workerQueue
+{
+    mutex lock;                         // guards tasks
+    deque<rangeTask> tasks;             // owner pops the front, thieves take the back
+};
+
+struct directoryJob
+{
+    uint32_t kv;                        // key value
+    vector<string> inputs;              // input file paths
+    vector<string> outputs;             // mirrored output file paths
+    vector<workerQueue> queues;         // one queue per worker
+    atomic<bool> failed;                // set when any range could not be encrypted
+};
+
+
 /* Function Parameters */
-bool stringToHex(string, uint32_t &);
-void expandKey(uint8_t*, int, uint32_t);
-void encrypt(uint8_t*, uint8_t*, int);
-void rotateKey(uint8_t*, int);
+void expandKeyLanes(uint8_t*, int, uint32_t);
+template<int N> void cipherStream(ifstream&, ofstream&, uint32_t);
+template<int N> bool cipherRange(int, int, uint32_t, off_t, off_t);
+template<int N> bool cipherSlice(int, int, uint32_t, off_t, off_t);
+int cipherSlice(char*, char*, uint32_t, int, off_t, off_t);
+void usage(char*);
+template<int N> double benchKernel(vector<uint8_t>&, uint32_t);
+double benchRuntime(vector<uint8_t>&, uint32_t, int);
+int benchmark(int);
+int searchKeys(char*, char*, int);
+void searchWorker(searchState*);
+int keyClass(uint32_t);
+int encryptDirectory(char*, char*, uint32_t, int);
+void directoryWorker(directoryJob*, int);
+bool nextTask(directoryJob*, int, rangeTask&);
 
 
 int main(int argc, char* argv[])
 {
+    // key search mode
+    if(argc >= 4 && argc <= 5 && !strcmp(argv[1], "--search"))
+    {
+        int threads = argc == 5 ? atoi(argv[4]) : thread::hardware_concurrency();
+        return searchKeys(argv[2], argv[3], max(threads, 1));
+    }
+
+    // directory mode
+    if(argc >= 5 && argc <= 6 && !strcmp(argv[1], "--dir"))
+    {
+        uint32_t kv;
+        if(!stringToHex((string)argv[4], kv))
+        {
+            return -1;
+        }
+        int threads = argc == 6 ? atoi(argv[5]) : thread::hardware_concurrency();
+        return encryptDirectory(argv[2], argv[3], kv, max(threads, 1));
+    }
+
+    // benchmark mode
+    if(argc >= 2 && argc <= 3 && !strcmp(argv[1], "--bench"))
+    {
+        int megabytes = argc == 3 ? atoi(argv[2]) : 256;
+        return benchmark(max(megabytes, 1));
+    }
+
     // validate command line arguments
-    if(argc != 4)
+    if(argc < 4 || argc % 2 != 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    // validate options
+    long long blockSize = 32;
+    off_t offset = -1;
+    off_t length = -1;
+    for(int i = 4; i < argc; i += 2)
+    {
+        // the whole value must be a number that fits, an empty value or trailing characters are refused
+        char* end;
+        errno = 0;
+        long long value = strtoll(argv[i+1], &end, 10);
+        if(end == argv[i+1] || *end != '\0' || errno == ERANGE || value < 0)
+        {
+            cout << argv[i+1] << ": must be a non-negative number." << endl;
+            return -1;
+        }
+
+        if(!strcmp(argv[i], "--block"))
+        {
+            blockSize = value;
+        }
+        else if(!strcmp(argv[i], "--offset"))
+        {
+            offset = value;
+        }
+        else if(!strcmp(argv[i], "--length"))
+        {
+            length = value;
+        }
+        else
+        {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    // validate block size
+    if(blockSize != 16 && blockSize != 32 && blockSize != 64)
     {
-        cout << "Usage: " << argv[0] << " <input file> <output file> <key>" << endl;
+        cout << blockSize << ": block size must be 16, 32, or 64." << endl;
+        return -1;
+    }
+
+    // validate range, both ends must be given
+    if((offset < 0) != (length < 0))
+    {
+        cout << "--offset and --length must be used together." << endl;
         return -1;
     }
 
@@ -51,6 +221,12 @@ int main(int argc, char* argv[])
     {
         return -1;
     }
+
+    // range mode
+    if(offset >= 0)
+    {
+        return cipherSlice(argv[1], argv[2], kv, blockSize, offset, length);
+    }
     
     // validate input file
     ifstream inputFile(argv[1]);
@@ -68,24 +244,18 @@ int main(int argc, char* argv[])
         return -1;
     }
 
-    // expand the key to fit the block size
-    int blockSize = 32;
-    uint8_t key[blockSize];
-    expandKey(key, blockSize, kv);
-
-    while(!inputFile.eof())
+    // each block size is its own compiled kernel
+    switch(blockSize)
     {
-        uint8_t block[blockSize];
-
-        inputFile.read((char*)&block, blockSize);
-        size_t bytes = inputFile.gcount();
-        
-        encrypt(block, key, bytes);
-        
-        outputFile.write((char*)&block, bytes);
-        
-        // block size is constant 32 bytes, if we send num bytes read then the key will only rotate valid bytes
-        rotateKey(key, bytes);
+        case 16:
+            cipherStream<16>(inputFile, outputFile, kv);
+            break;
+        case 64:
+            cipherStream<64>(inputFile, outputFile, kv);
+            break;
+        default:
+            cipherStream<32>(inputFile, outputFile, kv);
+            break;
     }
 
     inputFile.close();
@@ -96,76 +266,676 @@ int main(int argc, char* argv[])
 
 
 /*
- * Function: stringToHex
- * Parameters: This function accepts a string text value and a unsigned 4 byte variable as a refence to store the converted hex.
- * Return: This function will return false if it is unable to convert the text to hex.
- * This function attempts to convert a string to a 4 byte hex variable. If it is unable to convert the text, it will return false.
+ * Function: usage
+ * Parameters: This function accepts the program name.
+ * Return: None
+ * This function prints the command line usage of every mode.
+*/
+void usage(char* program)
+{
+    cout << "Usage: " << program << " <input file> <output file> <key> [--block 16|32|64] [--offset <byte> --length <bytes>]" << endl;
+    cout << "       " << program << " --search <ciphertext file> <known plaintext file> [threads]" << endl;
+    cout << "       " << program << " --dir <input directory> <output directory> <key> [threads]" << endl;
+    cout << "       " << program << " --bench [megabytes]" << endl;
+}
+
+
+
+/*
+ * Function: cipherStream
+ * Parameters: This function accepts the input and output file streams and the key value.
+ * Return: None
+ * This function encrypts the input stream into the output stream with N byte blocks. The input is read IO_BYTES at a time,
+ * full blocks use the compile time kernels and the last partial block uses the runtime size functions.
+*/
+template<int N>
+void cipherStream(ifstream& inputFile, ofstream& outputFile, uint32_t kv)
+{
+    // expand the key to fit the block size
+    uint8_t key[N];
+    expandKey(key, N, kv);
+
+    vector<uint8_t> buffer(IO_BYTES);
+    while(!inputFile.eof())
+    {
+        inputFile.read((char*)buffer.data(), buffer.size());
+        size_t bytes = inputFile.gcount();
+
+        // only the end of the file has a partial block
+        cipherBuffer<N>(key, buffer.data(), bytes);
+
+        outputFile.write((char*)buffer.data(), bytes);
+    }
+}
+
+
+
+/*
+ * Function: cipherSlice
+ * Parameters: This function accepts the input and output file names, the key value, the block size, and the offset and length of
+ *             the range to process.
+ * Return: This function returns 0 if the range was written and -1 otherwise.
+ * This function opens the files and hands the range to the kernel for the block size.
 */
-bool stringToHex(string text, uint32_t &hex)
+int cipherSlice(char* inputPath, char* outputPath, uint32_t kv, int blockSize, off_t offset, off_t length)
 {
-    // first check for "0x" substring
-    int pos = text.find("0x");
-    if(pos != string::npos)
+    // validate input file
+    int input = open(inputPath, O_RDONLY);
+    if(input < 0)
     {
-        // set substring
-        text = text.substr(pos + 2);
+        perror(inputPath);
+        return -1;
+    }
+
+    // validate output file
+    int output = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(output < 0)
+    {
+        perror(outputPath);
+        close(input);
+        return -1;
     }
 
-    // check length -> must be 8 bytes .... (2 char = 1 hex byte so 8 char = 4 hex bytes)
-    if(text.length() != 8)
+    bool ok;
+    switch(blockSize)
     {
-        cout << text << ": must be a 4 byte key." << endl;
-        return false;
+        case 16:
+            ok = cipherSlice<16>(input, output, kv, offset, length);
+            break;
+        case 64:
+            ok = cipherSlice<64>(input, output, kv, offset, length);
+            break;
+        default:
+            ok = cipherSlice<32>(input, output, kv, offset, length);
+            break;
     }
+    if(!ok)
+    {
+        perror(inputPath);
+    }
+
+    close(input);
+    close(output);
+    return ok ? 0 : -1;
+}
+
+
+
+/*
+ * Function: cipherSlice
+ * Parameters: This function accepts an input and output file descriptor, the key value, and the offset and length of the range.
+ * Return: This function returns false if the range could not be read or written.
+ * This function processes the bytes [offset, offset + length) of the input and writes them to the start of the output. Reading
+ * starts at the block holding the offset with the key from seekKey, and the bytes of that block before the offset are dropped.
+ * A range running past the end of the input stops at the end of the input, and a range starting past it writes nothing. An end
+ * past the largest file offset is clamped to it rather than overflowing.
+*/
+template<int N>
+bool cipherSlice(int input, int output, uint32_t kv, off_t offset, off_t length)
+{
+    uint8_t key[N];
+    seekKey(key, N, kv, offset / N);
+
+    off_t position = offset - offset % N;   // block aligned read position
+    off_t end = length > numeric_limits<off_t>::max() - offset ? numeric_limits<off_t>::max() : offset + length;
 
-    // iterate text to ensure valid hex digits
-    for(int i = 0; i < text.length(); i++)
+    vector<uint8_t> buffer(IO_BYTES);
+    while(position < end)
     {
-        if(!isxdigit(text[i]))
+        // every read but the last is a whole number of blocks, so position stays block aligned
+        ssize_t bytes = pread(input, buffer.data(), min<off_t>(end - position, IO_BYTES), position);
+        if(bytes < 0)
         {
-            cout << text << ": is not a valid hex key." << endl;
             return false;
         }
+        if(bytes == 0)
+        {
+            break;
+        }
+
+        // an offset past the end of the input but inside its last block reads only bytes before the offset
+        ssize_t skip = max<off_t>(offset - position, 0);
+        if(bytes <= skip)
+        {
+            break;
+        }
+
+        cipherBuffer<N>(key, buffer.data(), bytes);
+
+        ssize_t count = bytes - skip;
+        if(write(output, buffer.data() + skip, count) != count)
+        {
+            return false;
+        }
+
+        position += bytes;
     }
 
-    // valid therefore convert
-    hex = strtoul(text.c_str(), NULL, 16);
-    
     return true;
 }
 
 
 
-void expandKey(uint8_t* key, int size, uint32_t kv)
+/*
+ * Function: cipherRange
+ * Parameters: This function accepts an input and output file descriptor, the key value, and the offset and length of a range that
+ *             starts on a block boundary.
+ * Return: This function returns false if the range could not be read or written.
+ * This function encrypts one range of the input into the same range of the output. The key is positioned with seekKey, so ranges
+ * of the same file can be encrypted in any order and on any thread.
+*/
+template<int N>
+bool cipherRange(int input, int output, uint32_t kv, off_t offset, off_t length)
 {
-    key[0] = (kv >> 24) - (kv >> 16) + (kv >> 8) + kv;
+    uint8_t key[N];
+    seekKey(key, N, kv, offset / N);
 
-    for(int i = 0; i < size; i++)
+    vector<uint8_t> buffer(IO_BYTES);
+    while(length > 0)
     {
-        key[i] = key[i-1] + (kv >> 24) + (kv >> 16) - (kv >> 8) + kv;
+        ssize_t bytes = pread(input, buffer.data(), min<off_t>(length, IO_BYTES), offset);
+        if(bytes <= 0)
+        {
+            return false;
+        }
+
+        cipherBuffer<N>(key, buffer.data(), bytes);
+
+        if(pwrite(output, buffer.data(), bytes, offset) != bytes)
+        {
+            return false;
+        }
+
+        offset += bytes;
+        length -= bytes;
     }
+
+    return true;
 }
 
 
 
-void encrypt(uint8_t* block, uint8_t* key, int size)
+/*
+ * Function: expandKeyLanes
+ * Parameters: This function accepts a buffer of size * SEARCH_LANES bytes, the number of key bytes to expand, and a base key
+ *             whose low byte is zero.
+ * Return: None
+ * This function expands the SEARCH_LANES keys base, base + 1, ... at once. The buffer is stored byte major, so byte i of the key
+ * in lane l is keys[i * SEARCH_LANES + l]. Only the low key byte differs between lanes, which keeps every row a plain uint8_t
+ * loop that the compiler turns into SIMD instructions. The result is identical to calling expandKey for each key.
+*/
+void expandKeyLanes(uint8_t* keys, int size, uint32_t base)
 {
-    for(int i = 0; i < size; i++)
+    uint8_t seed = (base >> 24) - (base >> 16) + (base >> 8);
+    uint8_t step = (base >> 24) + (base >> 16) - (base >> 8);
+
+    for(int l = 0; l < SEARCH_LANES; l++)
     {
-        block[i] = block[i] ^ key[i];
+        keys[l] = seed + l;
+    }
+
+    for(int i = 1; i < size; i++)
+    {
+        uint8_t* row = keys + i * SEARCH_LANES;
+        uint8_t* prev = row - SEARCH_LANES;
+        for(int l = 0; l < SEARCH_LANES; l++)
+        {
+            row[l] = prev[l] + step + l;
+        }
     }
 }
 
 
 
-void rotateKey(uint8_t* key, int size)
+/*
+ * Function: searchKeys
+ * Parameters: This function accepts a ciphertext file, a file holding a known plaintext prefix, and the number of threads to use.
+ * Return: This function returns 0 when the search completed and -1 if the files could not be used.
+ * This function brute forces every 4 byte key against the first block of the ciphertext. The keystream of the first block is
+ * recovered by XORing the ciphertext with the known plaintext, then the key space is shared among the threads. Every key
+ * that expands to that keystream is a candidate. Candidates that expand to the same full key are equivalent, so one key is
+ * printed per equivalence class with the size of the class, along with the time the search took.
+*/
+int searchKeys(char* cipherPath, char* plainPath, int threads)
 {
-    uint8_t t = key[size-1] + 1;
+    const int blockSize = 32;
+    uint8_t cipherBlock[blockSize];
+    uint8_t plainBlock[blockSize];
+
+    // validate ciphertext file
+    ifstream cipherFile(cipherPath, ios::binary);
+    if(!cipherFile)
+    {
+        perror(cipherPath);
+        return -1;
+    }
+    cipherFile.read((char*)cipherBlock, blockSize);
+    int cipherBytes = cipherFile.gcount();
+
+    // validate known plaintext file
+    ifstream plainFile(plainPath, ios::binary);
+    if(!plainFile)
+    {
+        perror(plainPath);
+        return -1;
+    }
+    plainFile.read((char*)plainBlock, blockSize);
+    int plainBytes = plainFile.gcount();
 
-    for(int b = 0; b < size - 2; b++)
+    searchState state;
+    state.length = min(cipherBytes, plainBytes);
+    state.next = 0;
+    state.found = 0;
+    state.classSize.assign(SEARCH_CLASSES, 0);
+    state.classKey.assign(SEARCH_CLASSES, UINT32_MAX);
+    if(state.length == 0)
+    {
+        cout << "The ciphertext and known plaintext must both contain at least one byte." << endl;
+        return -1;
+    }
+    for(int i = 0; i < state.length; i++)
     {
-        key[b+1] = key[b];
+        state.keystream[i] = cipherBlock[i] ^ plainBlock[i];
     }
 
-    key[0] = t;
-}
\ No newline at end of file
+    cout << "Searching 2^32 keys against " << state.length << " known byte(s) with " << threads << " thread(s)..." << endl;
+
+    auto start = chrono::steady_clock::now();
+
+    vector<thread> workers;
+    for(int t = 0; t < threads; t++)
+    {
+        workers.emplace_back(searchWorker, &state);
+    }
+    for(int t = 0; t < threads; t++)
+    {
+        workers[t].join();
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // report one key per equivalence class, in key order
+    vector<pair<uint32_t, uint64_t>> classes;
+    for(int c = 0; c < SEARCH_CLASSES; c++)
+    {
+        if(state.classSize[c] > 0)
+        {
+            classes.push_back({state.classKey[c], state.classSize[c]});
+        }
+    }
+    sort(classes.begin(), classes.end());
+    for(size_t i = 0; i < classes.size() && i < SEARCH_REPORT; i++)
+    {
+        char text[16];
+        snprintf(text, sizeof(text), "0x%08x", classes[i].first);
+        cout << "Candidate: " << text << " and " << classes[i].second - 1 << " equivalent key(s)" << endl;
+    }
+    if(classes.size() > SEARCH_REPORT)
+    {
+        cout << "... " << classes.size() - SEARCH_REPORT << " more equivalence class(es) not shown" << endl;
+    }
+    if(!classes.empty())
+    {
+        cout << "Equivalent keys expand to the same key, any of them decrypts the ciphertext." << endl;
+    }
+
+    cout << state.found << " candidate key(s) in " << classes.size() << " equivalence class(es) found in " << seconds << " seconds (";
+    cout << (uint64_t)(4294967296.0 / seconds / 1000000) << " million keys/sec)." << endl;
+    return 0;
+}
+
+
+
+/*
+ * Function: searchWorker
+ * Parameters: This function accepts a pointer to the shared search state.
+ * Return: None
+ * This function claims chunks of the key space until it is exhausted. Keys are expanded SEARCH_LANES at a time and compared one
+ * keystream byte at a time, a batch is abandoned as soon as no lane matches. Lanes that survive are verified with expandKey and
+ * counted in their equivalence class.
+*/
+void searchWorker(searchState* state)
+{
+    uint8_t keys[32 * SEARCH_LANES];
+    uint8_t alive[SEARCH_LANES];
+    vector<uint64_t> classSize(SEARCH_CLASSES, 0);
+    vector<uint32_t> classKey(SEARCH_CLASSES, UINT32_MAX);
+    uint64_t found = 0;
+
+    for(;;)
+    {
+        uint64_t first = state->next.fetch_add(SEARCH_CHUNK);
+        if(first >= (1ULL << 32))
+        {
+            break;
+        }
+
+        for(uint64_t base = first; base < first + SEARCH_CHUNK; base += SEARCH_LANES)
+        {
+            // the first keystream byte rules out almost every lane, so expand a single row before the rest
+            expandKeyLanes(keys, 1, (uint32_t)base);
+
+            uint8_t any = 0;
+            for(int l = 0; l < SEARCH_LANES; l++)
+            {
+                alive[l] = keys[l] == state->keystream[0];
+                any |= alive[l];
+            }
+            if(!any)
+            {
+                continue;
+            }
+
+            expandKeyLanes(keys, state->length, (uint32_t)base);
+            for(int i = 1; i < state->length && any; i++)
+            {
+                uint8_t* row = keys + i * SEARCH_LANES;
+                any = 0;
+                for(int l = 0; l < SEARCH_LANES; l++)
+                {
+                    alive[l] &= row[l] == state->keystream[i];
+                    any |= alive[l];
+                }
+            }
+
+            for(int l = 0; l < SEARCH_LANES && any; l++)
+            {
+                if(!alive[l])
+                {
+                    continue;
+                }
+
+                // verify with the scalar expansion used by the cipher
+                uint32_t kv = (uint32_t)base + l;
+                uint8_t key[32];
+                expandKey(key, state->length, kv);
+                if(memcmp(key, state->keystream, state->length) == 0)
+                {
+                    found++;
+                    int c = keyClass(kv);
+                    classSize[c]++;
+                    classKey[c] = min(classKey[c], kv);
+                }
+            }
+        }
+    }
+
+    // merge this thread's results
+    state->found += found;
+    lock_guard<mutex> guard(state->lock);
+    for(int c = 0; c < SEARCH_CLASSES; c++)
+    {
+        state->classSize[c] += classSize[c];
+        state->classKey[c] = min(state->classKey[c], classKey[c]);
+    }
+}
+
+
+
+/*
+ * Function: keyClass
+ * Parameters: This function accepts a key value.
+ * Return: This function returns the equivalence class of the key, a number below SEARCH_CLASSES.
+ * expandKey starts from one byte and adds the same step to every following byte, and both are sums of the key bytes modulo
+ * 256. Keys with the same first byte and step expand to the same key, so those two bytes name the class.
+*/
+int keyClass(uint32_t kv)
+{
+    uint8_t key[2];
+    expandKey(key, 2, kv);
+    return key[0] << 8 | (uint8_t)(key[1] - key[0]);
+}
+
+
+
+
+/*
+ * Function: encryptDirectory
+ * Parameters: This function accepts an input directory, an output directory, the key value, and the number of threads to use.
+ * Return: This function returns 0 if every file was encrypted and -1 otherwise.
+ * This function walks the input directory, recreates its layout below the output directory, and sizes every output file. Each
+ * file is cut into RANGE_BYTES ranges and the ranges are dealt to the worker queues largest first. The workers then encrypt
+ * the ranges, stealing from each other when their own queue runs dry. The aggregate throughput is printed at the end.
+*/
+int encryptDirectory(char* inputDir, char* outputDir, uint32_t kv, int threads)
+{
+    namespace fs = std::filesystem;
+
+    error_code ec;
+    if(!fs::is_directory(inputDir, ec))
+    {
+        cout << inputDir << ": is not a directory." << endl;
+        return -1;
+    }
+
+    directoryJob job;
+    job.kv = kv;
+    job.failed = false;
+    job.queues = vector<workerQueue>(threads);
+
+    // mirror the tree and collect the ranges of every file
+    vector<rangeTask> tasks;
+    uint64_t totalBytes = 0;
+    fs::path root(inputDir);
+    fs::create_directories(outputDir, ec);
+    for(fs::recursive_directory_iterator it(root, ec), end; it != end; it.increment(ec))
+    {
+        fs::path target = fs::path(outputDir) / fs::relative(it->path(), root);
+        if(it->is_directory())
+        {
+            fs::create_directories(target, ec);
+            continue;
+        }
+        if(!it->is_regular_file())
+        {
+            continue;
+        }
+
+        off_t size = it->file_size();
+        int output = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(output < 0 || ftruncate(output, size) < 0)
+        {
+            perror(target.c_str());
+            if(output >= 0)
+            {
+                close(output);
+            }
+            return -1;
+        }
+        close(output);
+
+        int file = job.inputs.size();
+        job.inputs.push_back(it->path().string());
+        job.outputs.push_back(target.string());
+        for(off_t offset = 0; offset < size; offset += RANGE_BYTES)
+        {
+            tasks.push_back({file, offset, min(RANGE_BYTES, size - offset)});
+        }
+        totalBytes += size;
+    }
+    if(ec)
+    {
+        cout << inputDir << ": " << ec.message() << endl;
+        return -1;
+    }
+
+    // deal the largest ranges first so small files fill in the gaps at the end
+    stable_sort(tasks.begin(), tasks.end(), [](const rangeTask& a, const rangeTask& b) { return a.length > b.length; });
+    for(size_t i = 0; i < tasks.size(); i++)
+    {
+        job.queues[i % threads].tasks.push_back(tasks[i]);
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    vector<thread> workers;
+    for(int t = 0; t < threads; t++)
+    {
+        workers.emplace_back(directoryWorker, &job, t);
+    }
+    for(int t = 0; t < threads; t++)
+    {
+        workers[t].join();
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << job.inputs.size() << " file(s), " << totalBytes << " byte(s) in " << seconds << " seconds (";
+    cout << totalBytes / 1000000.0 / max(seconds, 1e-9) << " MB/s) with " << threads << " thread(s)." << endl;
+
+    return job.failed ? -1 : 0;
+}
+
+
+
+/*
+ * Function: directoryWorker
+ * Parameters: This function accepts a pointer to the directory job and the index of this worker.
+ * Return: None
+ * This function encrypts ranges until no queue has any work left.
+*/
+void directoryWorker(directoryJob* job, int self)
+{
+    rangeTask task;
+    while(nextTask(job, self, task))
+    {
+        int input = open(job->inputs[task.file].c_str(), O_RDONLY);
+        int output = open(job->outputs[task.file].c_str(), O_WRONLY);
+        if(input < 0 || output < 0 || !cipherRange<32>(input, output, job->kv, task.offset, task.length))
+        {
+            perror(job->inputs[task.file].c_str());
+            job->failed = true;
+        }
+
+        if(input >= 0)
+        {
+            close(input);
+        }
+        if(output >= 0)
+        {
+            close(output);
+        }
+    }
+}
+
+
+
+/*
+ * Function: nextTask
+ * Parameters: This function accepts a pointer to the directory job, the index of the calling worker, and a reference to store the task.
+ * Return: This function returns false when every queue is empty.
+ * This function pops the next task from the worker's own queue. When that queue is empty it steals from the back of the other
+ * queues, starting with the next worker so thieves spread out.
+*/
+bool nextTask(directoryJob* job, int self, rangeTask& task)
+{
+    int count = job->queues.size();
+    for(int i = 0; i < count; i++)
+    {
+        workerQueue& queue = job->queues[(self + i) % count];
+        lock_guard<mutex> guard(queue.lock);
+        if(queue.tasks.empty())
+        {
+            continue;
+        }
+
+        if(i == 0)
+        {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        }
+        else
+        {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        }
+        return true;
+    }
+
+    return false;
+}
+
+
+
+
+/*
+ * Function: benchmark
+ * Parameters: This function accepts the number of megabytes to encrypt per run.
+ * Return: This function returns 0.
+ * This function encrypts an in memory buffer with the runtime size functions and with each compile time kernel, and prints the
+ * throughput of each. The best of three runs is reported.
+*/
+int benchmark(int megabytes)
+{
+    vector<uint8_t> buffer((size_t)megabytes << 20);
+    for(size_t i = 0; i < buffer.size(); i++)
+    {
+        buffer[i] = i * 131;
+    }
+
+    uint32_t kv = 0x1a2b3c4d;
+    double runtime = 1e30, kernel16 = 1e30, kernel32 = 1e30, kernel64 = 1e30;
+    for(int run = 0; run < 3; run++)
+    {
+        runtime = min(runtime, benchRuntime(buffer, kv, 32));
+        kernel16 = min(kernel16, benchKernel<16>(buffer, kv));
+        kernel32 = min(kernel32, benchKernel<32>(buffer, kv));
+        kernel64 = min(kernel64, benchKernel<64>(buffer, kv));
+    }
+
+    double mb = buffer.size() / 1000000.0;
+    cout << "runtime size (32 byte blocks): " << mb / runtime << " MB/s" << endl;
+    cout << "kernel 16 byte blocks:         " << mb / kernel16 << " MB/s" << endl;
+    cout << "kernel 32 byte blocks:         " << mb / kernel32 << " MB/s" << endl;
+    cout << "kernel 64 byte blocks:         " << mb / kernel64 << " MB/s" << endl;
+    return 0;
+}
+
+
+
+/*
+ * Function: benchKernel
+ * Parameters: This function accepts the buffer to encrypt and the key value.
+ * Return: This function returns the seconds taken.
+ * This function encrypts the buffer in place with the N byte kernels.
+*/
+template<int N>
+double benchKernel(vector<uint8_t>& buffer, uint32_t kv)
+{
+    uint8_t key[N];
+    expandKey(key, N, kv);
+
+    auto start = chrono::steady_clock::now();
+    for(size_t b = 0; b + N <= buffer.size(); b += N)
+    {
+        encryptBlock<N>(buffer.data() + b, key);
+        rotateKeyBlock<N>(key);
+    }
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+
+
+/*
+ * Function: benchRuntime
+ * Parameters: This function accepts the buffer to encrypt, the key value, and the block size.
+ * Return: This function returns the seconds taken.
+ * This function encrypts the buffer in place with encrypt and rotateKey, as every block was before the kernels.
+*/
+double benchRuntime(vector<uint8_t>& buffer, uint32_t kv, int blockSize)
+{
+    // hide the block size from the optimizer so the runtime path is measured
+    volatile int size = blockSize;
+    int n = size;
+
+    vector<uint8_t> key(n);
+    expandKey(key.data(), n, kv);
+
+    auto start = chrono::steady_clock::now();
+    for(size_t b = 0; b + n <= buffer.size(); b += n)
+    {
+        encrypt(buffer.data() + b, key.data(), n);
+        rotateKey(key.data(), n);
+    }
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,201 @@
+/*
+* Author:      Robert Blaine Wilson
+*
+* Date:        8/7/2023
+*
+* Synopsis:    This file holds the block cipher used by the Cipher Program. A 4 byte key value is expanded to a block sized key,
+*              each block is XORed with the key, and the key is rotated for the next block. The functions are shared with other
+*              programs that encrypt data with the same cipher, such as the capture files of the UDP server.
+*/
+
+#ifndef CIPHER_H
+#define CIPHER_H
+
+#include <iostream>
+#include <string>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+
+
+
+/*
+ * Function: stringToHex
+ * Parameters: This function accepts a string text value and a unsigned 4 byte variable as a refence to store the converted hex.
+ * Return: This function will return false if it is unable to convert the text to hex.
+ * This function attempts to convert a string to a 4 byte hex variable. If it is unable to convert the text, it will return false.
+*/
+inline bool stringToHex(std::string text, uint32_t &hex)
+{
+    // first check for "0x" substring
+    int pos = text.find("0x");
+    if(pos != std::string::npos)
+    {
+        // set substring
+        text = text.substr(pos + 2);
+    }
+
+    // check length -> must be 8 bytes .... (2 char = 1 hex byte so 8 char = 4 hex bytes)
+    if(text.length() != 8)
+    {
+        std::cout << text << ": must be a 4 byte key." << std::endl;
+        return false;
+    }
+
+    // iterate text to ensure valid hex digits
+    for(int i = 0; i < text.length(); i++)
+    {
+        if(!isxdigit(text[i]))
+        {
+            std::cout << text << ": is not a valid hex key." << std::endl;
+            return false;
+        }
+    }
+
+    // valid therefore convert
+    hex = strtoul(text.c_str(), NULL, 16);
+    
+    return true;
+}
+
+
+
+inline void expandKey(uint8_t* key, int size, uint32_t kv)
+{
+    key[0] = (kv >> 24) - (kv >> 16) + (kv >> 8) + kv;
+
+    // key[0] is the seed, so expansion starts from the second byte
+    for(int i = 1; i < size; i++)
+    {
+        key[i] = key[i-1] + (kv >> 24) + (kv >> 16) - (kv >> 8) + kv;
+    }
+}
+
+
+
+inline void encrypt(uint8_t* block, uint8_t* key, int size)
+{
+    for(int i = 0; i < size; i++)
+    {
+        block[i] = block[i] ^ key[i];
+    }
+}
+
+
+
+inline void rotateKey(uint8_t* key, int size)
+{
+    // nothing was read, so there are no key bytes to rotate
+    if(size <= 0)
+    {
+        return;
+    }
+
+    uint8_t t = key[size-1] + 1;
+
+    for(int b = 0; b < size - 2; b++)
+    {
+        key[b+1] = key[b];
+    }
+
+    key[0] = t;
+}
+
+
+
+/*
+ * Function: encryptBlock
+ * Parameters: This function accepts a full block and the key for that block.
+ * Return: None
+ * This function is encrypt for a block size known at compile time, the constant trip count lets the compiler unroll the loop
+ * into a few vector XORs.
+*/
+template<int N>
+inline void encryptBlock(uint8_t* block, const uint8_t* key)
+{
+    #pragma GCC unroll 64
+    for(int i = 0; i < N; i++)
+    {
+        block[i] = block[i] ^ key[i];
+    }
+}
+
+
+
+/*
+ * Function: rotateKeyBlock
+ * Parameters: This function accepts the key of a full block.
+ * Return: None
+ * This function is rotateKey for a block size known at compile time. The rotateKey loop copies key[0] forward one byte at a
+ * time, which leaves key[0] in every byte between the first and the last, so the copy is written as a fill.
+*/
+template<int N>
+inline void rotateKeyBlock(uint8_t* key)
+{
+    static_assert(N > 2, "rotateKeyBlock expects a block of at least 3 bytes");
+
+    uint8_t t = key[N-1] + 1;
+    uint8_t first = key[0];
+
+    #pragma GCC unroll 64
+    for(int b = 1; b < N - 1; b++)
+    {
+        key[b] = first;
+    }
+
+    key[0] = t;
+}
+
+
+
+/*
+ * Function: seekKey
+ * Parameters: This function accepts a key buffer, the block size, the key value, and the index of a block.
+ * Return: None
+ * This function sets the key buffer to the key used for the given block, as if every earlier block was full. rotateKey copies
+ * key[0] over the middle of the key and never changes the last byte, so after two rotations the key stops changing. The jump
+ * therefore costs at most two rotations no matter how far into the file the block is.
+*/
+inline void seekKey(uint8_t* key, int size, uint32_t kv, uint64_t block)
+{
+    expandKey(key, size, kv);
+
+    // a one byte key is incremented by every rotation and never settles
+    uint64_t rotations = size > 1 ? std::min<uint64_t>(block, 2) : block;
+    for(uint64_t r = 0; r < rotations; r++)
+    {
+        rotateKey(key, size);
+    }
+}
+
+
+
+
+/*
+ * Function: cipherBuffer
+ * Parameters: This function accepts the key for the first block of the buffer, the buffer, and its length.
+ * Return: None
+ * This function encrypts a buffer in place with N byte blocks and leaves the key ready for the block after the buffer. Full
+ * blocks use the compile time kernels. A partial block may only be the last block of a stream, it uses the runtime size
+ * functions.
+*/
+template<int N>
+inline void cipherBuffer(uint8_t* key, uint8_t* data, size_t length)
+{
+    size_t b = 0;
+    for(; b + N <= length; b += N)
+    {
+        encryptBlock<N>(data + b, key);
+        rotateKeyBlock<N>(key);
+    }
+
+    // rotating by the bytes left keeps the key within the valid bytes
+    if(b < length)
+    {
+        encrypt(data + b, key, length - b);
+        rotateKey(key, length - b);
+    }
+}
+
+#endif
@@ -0,0 +1,884 @@
+/*
+ *  Author:      Robert Blaine Wilson
+ *  Date:        6/25/2023
+ *
+ *  Synopsis:    This file is a load generator for the Multi-User program's server. It uses the AF_UNIX address family and takes the socket file
+ *               of a running server as its first command line argument. It opens --clients connections from one process and drives all of them
+ *               from epoll, so thousands of clients cost a few descriptors and no threads each. Every client answers the server's HELLO with
+ *               THANKS like the interactive client does, and once every client has been greeted the clients send --command as 100 byte
+ *               records for --duration seconds.
+ *               Without --rate each client keeps --pipeline commands unanswered and sends the next one as soon as an 'ENTERCMD' comes back,
+ *               which finds the most the server can take. With --rate each client sends that many commands per second on a fixed schedule,
+ *               the clients' schedules spread evenly over the interval, which shows the latency at a given load. A client that already has
+ *               MAX_OUTSTANDING commands unanswered skips its turn, and how far sends fell behind their schedule is reported, so a generator
+ *               that cannot keep up is seen rather than hidden in the latencies.
+ *               The latency of every command is measured from its write until its 'ENTERCMD' reply and kept in a log-linear histogram, which
+ *               has a fixed size and is within 1/16 of every value. At the end the throughput, the latency percentiles and the handshake
+ *               times are printed. Records the server relays in its broadcast mode and KEEPALIVE messages are counted and otherwise ignored.
+ *               With --threads n the clients are spread over n generator threads, each with its own epoll instance, clients and
+ *               histograms, which are added up after the threads finish. Run the server with --quiet, printing every command would be
+ *               measured instead of the server.
+ *
+ *  Compilation: g++ -c mu_loadgen.cpp
+ *               g++ -pthread -o mu_loadgen mu_loadgen.o
+ *
+ *  Usage:       ./mu_loadgen <socket file> [--clients n] [--rate commands per second] [--pipeline n] [--duration seconds] [--threads n]
+ *                                          [--command text]
+*/
+
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+#include <string>
+#include <queue>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <sys/signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+
+const int MAX_EVENTS = 256;         // events taken from epoll_wait() at once
+const int RECORD_SIZE = 100;        // the server reads every message as a 100 byte record
+const int READ_SIZE = 4096;         // bytes read from a client socket at once
+const int MAX_OUTSTANDING = 64;     // unanswered commands a client can have
+const size_t MAX_REPLY = 4096;      // longest reply accepted without its terminating 0
+const int HISTOGRAM_BUCKETS = 1024; // enough for every 64 bit value
+const uint64_t HANDSHAKE_LIMIT = 30000000000ull;    // nanoseconds every client has to connect and be greeted
+const uint64_t DRAIN_LIMIT = 1000000000ull;         // nanoseconds to wait for the last replies after the run
+
+
+/* Globals */
+struct loadOptionsStruct
+{
+    char* socketFile;
+    int clients;                // connections to open
+    double rate;                // commands per second per client, 0 to send as soon as a reply comes back
+    int pipeline;               // commands kept unanswered per client without a rate
+    double duration;            // seconds commands are sent for
+    int threads;                // generator threads
+    string command;             // text of every command
+};
+loadOptionsStruct options;
+char commandRecord[RECORD_SIZE];    // the command and the handshake answer, padded to a record
+char thanksRecord[RECORD_SIZE];
+struct histogramStruct          // log-linear: values below 32 exactly, above that 16 buckets per power of two
+{
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+};
+struct loadClientStruct
+{
+    int socket;                 // -1 once the client failed
+    int index;                  // among every client of every generator
+    bool ready;                 // the handshake is done
+    uint64_t sent[MAX_OUTSTANDING];     // ring of the write times of the unanswered commands
+    int head;                   // oldest unanswered command
+    int count;                  // unanswered commands
+    uint32_t events;            // events the socket is registered for with epoll
+    string input;               // a reply cut in half by a read
+    string output;              // bytes the socket did not take yet
+};
+struct generatorStatsStruct     // written only by its generator, read once it has finished
+{
+    uint64_t connected;         // clients that connected
+    uint64_t greeted;           // clients that finished the handshake
+    uint64_t failed;            // clients closed by the server or an error
+    uint64_t refused;           // clients that failed before they were greeted
+    uint64_t sent;              // commands written
+    uint64_t answered;          // commands answered before the run ended
+    uint64_t unanswered;        // commands still waiting when the generator gave up
+    uint64_t skipped;           // scheduled sends skipped because too many commands were unanswered
+    uint64_t relayed;           // broadcast records received
+    uint64_t keepalives;        // KEEPALIVE messages received
+    uint64_t lagSum;            // nanoseconds sends were behind their schedule
+    uint64_t lagMax;
+    histogramStruct latency;    // nanoseconds from a command's write to its ENTERCMD
+    histogramStruct handshake;  // nanoseconds from THANKS to its ENTERCMD
+};
+typedef pair<uint64_t, uint32_t> sendTimer;     // when a client sends next and the client
+struct generatorStruct
+{
+    int id;
+    int epollFD;
+    vector<loadClientStruct> clients;
+    priority_queue<sendTimer, vector<sendTimer>, greater<sendTimer> > timers;
+    uint64_t now;               // nanoseconds, read once per pass of the event loop
+    bool running;               // commands are being sent
+    generatorStatsStruct stats;
+};
+generatorStruct* generators;
+atomic<int> readyGenerators;    // generators whose clients are all greeted or failed
+atomic<uint64_t> startTime;     // nanoseconds when the clients start sending, 0 until then
+
+
+/* Function Prototypes */
+void runGenerator(generatorStruct*);
+void connectClients(generatorStruct&, int, int);
+void pumpEvents(generatorStruct&, uint64_t);
+void sendScheduled(generatorStruct&);
+bool sendRecord(generatorStruct&, uint32_t, const char*);
+bool flushOutput(generatorStruct&, uint32_t);
+bool updateEvents(generatorStruct&, uint32_t);
+bool readReplies(generatorStruct&, uint32_t);
+bool handleReply(generatorStruct&, uint32_t, const char*, size_t);
+void failClient(generatorStruct&, uint32_t);
+uint64_t countUnanswered(generatorStruct&);
+void recordValue(histogramStruct&, uint64_t);
+void mergeHistogram(histogramStruct&, const histogramStruct&);
+uint64_t percentile(const histogramStruct&, double);
+void printLatencies(const char*, const histogramStruct&);
+void raiseFileLimit();
+uint64_t monotonicNs();
+
+
+
+int main(int argc, char* argv[])
+{
+    // validate command line arguments
+    options.clients = 100;
+    options.rate = 0;
+    options.pipeline = 1;
+    options.duration = 10;
+    options.threads = 1;
+    options.command = "PING";
+    bool valid = argc >= 2;
+    for(int i=2; valid && i < argc; i++)
+    {
+        if(!strcmp(argv[i], "--clients") && i+1 < argc && atoi(argv[i+1]) > 0)
+        {
+            options.clients = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--rate") && i+1 < argc && atof(argv[i+1]) >= 0)
+        {
+            options.rate = atof(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--pipeline") && i+1 < argc && atoi(argv[i+1]) > 0 && atoi(argv[i+1]) <= MAX_OUTSTANDING)
+        {
+            options.pipeline = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--duration") && i+1 < argc && atof(argv[i+1]) > 0)
+        {
+            options.duration = atof(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--threads") && i+1 < argc && atoi(argv[i+1]) > 0)
+        {
+            options.threads = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--command") && i+1 < argc && strlen(argv[i+1]) > 0 && strlen(argv[i+1]) < RECORD_SIZE)
+        {
+            options.command = argv[++i];
+        }
+        else
+        {
+            valid = false;
+        }
+    }
+    if(!valid)
+    {
+        cout << "Usage: " << argv[0] << " <socket file> [--clients n] [--rate commands per second] [--pipeline 1-" << MAX_OUTSTANDING << "]" << endl;
+        cout << "       [--duration seconds] [--threads n] [--command text]" << endl;
+        return -1;
+    }
+    options.socketFile = argv[1];
+    options.threads = min(options.threads, options.clients);
+    memcpy(commandRecord, options.command.c_str(), options.command.size());
+    memcpy(thanksRecord, "THANKS", sizeof("THANKS"));
+    raiseFileLimit();
+
+    // a server that goes away while it is written to must not end the generator
+    signal(SIGPIPE, SIG_IGN);
+
+
+    // connect and greet the clients, every generator takes an even share
+    uint64_t begin = monotonicNs();
+    generators = new generatorStruct[options.threads];
+    vector<thread> threads;
+    for(int i=0; i < options.threads; i++)
+    {
+        generators[i].id = i;
+        threads.push_back(thread(runGenerator, &generators[i]));
+    }
+    while(readyGenerators.load(memory_order_acquire) < options.threads)
+    {
+        usleep(1000);
+    }
+    uint64_t greetedTime = monotonicNs();
+
+
+    // start every generator at once, then wait for them to finish the run
+    startTime.store(greetedTime, memory_order_release);
+    for(size_t i=0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+
+
+    // add up the statistics of every generator
+    generatorStatsStruct total;
+    memset(&total, 0, sizeof(total));
+    for(int i=0; i < options.threads; i++)
+    {
+        generatorStatsStruct &stats = generators[i].stats;
+        total.connected += stats.connected;
+        total.greeted += stats.greeted;
+        total.failed += stats.failed;
+        total.sent += stats.sent;
+        total.answered += stats.answered;
+        total.unanswered += stats.unanswered;
+        total.skipped += stats.skipped;
+        total.relayed += stats.relayed;
+        total.keepalives += stats.keepalives;
+        total.lagSum += stats.lagSum;
+        total.lagMax = max(total.lagMax, stats.lagMax);
+        mergeHistogram(total.latency, stats.latency);
+        mergeHistogram(total.handshake, stats.handshake);
+    }
+
+
+    // report
+    printf("%llu of %d client(s) connected and %llu greeted in %.2f s by %d generator thread(s)\n", (unsigned long long)total.connected,
+           options.clients, (unsigned long long)total.greeted, (greetedTime - begin) / 1e9, options.threads);
+    printLatencies("Handshake", total.handshake);
+    printf("%llu command(s) answered in %.2f s: %.0f commands/s, %.2f MB/s of records\n", (unsigned long long)total.answered, options.duration,
+           total.answered / options.duration, total.answered * (double)RECORD_SIZE / options.duration / 1e6);
+    printLatencies("Latency until ENTERCMD", total.latency);
+    if(options.rate > 0)
+    {
+        printf("Sends were %.1f us behind schedule on average, %.1f us at most, %llu send(s) skipped\n",
+               total.sent > 0 ? total.lagSum / 1e3 / total.sent : 0.0, total.lagMax / 1e3, (unsigned long long)total.skipped);
+    }
+    printf("%llu command(s) unanswered, %llu client(s) failed, %llu relayed record(s) and %llu KEEPALIVE(s) received\n",
+           (unsigned long long)total.unanswered, (unsigned long long)total.failed, (unsigned long long)total.relayed,
+           (unsigned long long)total.keepalives);
+
+    return total.greeted > 0 ? 0 : -1;
+}
+
+
+
+/*
+ *  Function: runGenerator
+ *  Parameters: pointer to the generator
+ *  Return: None
+ *  Description: This function runs one generator thread. It connects its share of the clients and runs the handshakes, reports that it is
+ *               ready and waits for the start, sends commands for the duration, waits a little for the last replies and closes its clients.
+*/
+void runGenerator(generatorStruct* generator)
+{
+    generatorStruct &gen = *generator;
+    memset(&gen.stats, 0, sizeof(gen.stats));
+    gen.running = false;
+    gen.epollFD = epoll_create1(0);
+    if(gen.epollFD < 0)
+    {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    // connect the clients and answer their HELLOs until every one is greeted or failed
+    int first = (int)((long long)options.clients * gen.id / options.threads);
+    int last = (int)((long long)options.clients * (gen.id + 1) / options.threads);
+    connectClients(gen, first, last);
+    gen.now = monotonicNs();
+    uint64_t deadline = gen.now + HANDSHAKE_LIMIT;
+    while(gen.stats.greeted + gen.stats.refused < gen.clients.size() && gen.now < deadline)
+    {
+        pumpEvents(gen, deadline);
+    }
+    if(gen.stats.greeted + gen.stats.refused < gen.clients.size())
+    {
+        cout << "Generator " << gen.id << ": " << gen.clients.size() - gen.stats.greeted - gen.stats.refused << " client(s) were never greeted" << endl;
+    }
+
+    readyGenerators.fetch_add(1, memory_order_release);
+    uint64_t start;
+    while((start = startTime.load(memory_order_acquire)) == 0)
+    {
+        usleep(100);
+    }
+
+
+    // send the first commands, or spread the clients' schedules over one interval
+    gen.now = monotonicNs();
+    gen.running = true;
+    uint64_t interval = options.rate > 0 ? (uint64_t)(1e9 / options.rate) : 0;
+    for(uint32_t i=0; i < gen.clients.size(); i++)
+    {
+        loadClientStruct &client = gen.clients[i];
+        if(client.socket < 0 || !client.ready)
+        {
+            continue;
+        }
+        if(interval > 0)
+        {
+            gen.timers.push(sendTimer(start + interval * client.index / options.clients, i));
+            continue;
+        }
+        for(int j=0; j < options.pipeline && client.socket >= 0; j++)
+        {
+            gen.stats.sent++;
+            if(!sendRecord(gen, i, commandRecord))
+            {
+                failClient(gen, i);
+            }
+        }
+    }
+
+
+    // run for the duration
+    uint64_t stop = start + (uint64_t)(options.duration * 1e9);
+    while(gen.now < stop)
+    {
+        uint64_t wake = stop;
+        if(!gen.timers.empty())
+        {
+            wake = min(wake, gen.timers.top().first);
+        }
+        pumpEvents(gen, wake);
+        sendScheduled(gen);
+    }
+    gen.running = false;
+
+
+    // wait for the replies still on their way, they count for the latency but not the throughput
+    while(countUnanswered(gen) > 0 && gen.now < stop + DRAIN_LIMIT)
+    {
+        pumpEvents(gen, stop + DRAIN_LIMIT);
+    }
+    gen.stats.unanswered += countUnanswered(gen);
+
+    for(size_t i=0; i < gen.clients.size(); i++)
+    {
+        if(gen.clients[i].socket >= 0)
+        {
+            close(gen.clients[i].socket);
+        }
+    }
+    close(gen.epollFD);
+}
+
+
+
+/*
+ *  Function: connectClients
+ *  Parameters: a reference to the generator, the index of its first client, the index after its last client
+ *  Return: None
+ *  Description: This function connects the generator's clients and registers them with epoll. connect() blocks, a listening AF_UNIX socket
+ *               holds a connection until it is accepted, so a full backlog only slows the clients down. The sockets are non-blocking from
+ *               then on.
+*/
+void connectClients(generatorStruct &gen, int first, int last)
+{
+    struct sockaddr_un un;
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strncpy(un.sun_path, options.socketFile, sizeof(un.sun_path) - 1);
+
+    gen.clients.resize(last - first);
+    for(int i=0; i < last - first; i++)
+    {
+        loadClientStruct &client = gen.clients[i];
+        client.index = first + i;
+        client.ready = false;
+        client.head = 0;
+        client.count = 0;
+        client.events = 0;
+
+        client.socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(client.socket < 0 || connect(client.socket, (const struct sockaddr*)&un, sizeof(un)) < 0)
+        {
+            // the same error will most likely hit every later client, report it once per generator
+            if(gen.stats.failed == 0)
+            {
+                perror("connect");
+            }
+            if(client.socket >= 0)
+            {
+                close(client.socket);
+            }
+            client.socket = -1;
+            gen.stats.failed++;
+            gen.stats.refused++;
+            continue;
+        }
+        fcntl(client.socket, F_SETFL, fcntl(client.socket, F_GETFL) | O_NONBLOCK);
+        gen.stats.connected++;
+
+        if(!updateEvents(gen, i))
+        {
+            failClient(gen, i);
+        }
+    }
+}
+
+
+
+/*
+ *  Function: pumpEvents
+ *  Parameters: a reference to the generator, nanoseconds when the wait must end
+ *  Return: None
+ *  Description: This function waits for the clients' sockets until one is ready or the wake up time, and reads the replies and writes the
+ *               output of every ready client. A client that fails is closed.
+*/
+void pumpEvents(generatorStruct &gen, uint64_t wake)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = wake > gen.now ? (int)min<uint64_t>((wake - gen.now + 999999) / 1000000, 1000) : 0;
+
+    int count = epoll_wait(gen.epollFD, events, MAX_EVENTS, timeout);
+    if(count < 0 && errno != EINTR)
+    {
+        perror("epoll_wait");
+        exit(EXIT_FAILURE);
+    }
+    gen.now = monotonicNs();
+
+    for(int i=0; i < count; i++)
+    {
+        uint32_t index = events[i].data.u32;
+        if(gen.clients[index].socket < 0)
+        {
+            continue;
+        }
+        if((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !readReplies(gen, index))
+        {
+            failClient(gen, index);
+            continue;
+        }
+        if((events[i].events & EPOLLOUT) && gen.clients[index].socket >= 0 && !flushOutput(gen, index))
+        {
+            failClient(gen, index);
+        }
+    }
+}
+
+
+
+/*
+ *  Function: sendScheduled
+ *  Parameters: a reference to the generator
+ *  Return: None
+ *  Description: This function sends a command for every client whose turn has come in the rate mode and schedules its next turn one interval
+ *               after the last, so a late send does not move the schedule. A client with MAX_OUTSTANDING commands unanswered skips its turn.
+*/
+void sendScheduled(generatorStruct &gen)
+{
+    uint64_t interval = (uint64_t)(1e9 / options.rate);
+    while(!gen.timers.empty() && gen.timers.top().first <= gen.now)
+    {
+        sendTimer timer = gen.timers.top();
+        gen.timers.pop();
+        loadClientStruct &client = gen.clients[timer.second];
+        if(client.socket < 0)
+        {
+            continue;
+        }
+
+        if(client.count == MAX_OUTSTANDING)
+        {
+            gen.stats.skipped++;
+        }
+        else
+        {
+            gen.stats.sent++;
+            gen.stats.lagSum += gen.now - timer.first;
+            gen.stats.lagMax = max(gen.stats.lagMax, gen.now - timer.first);
+            if(!sendRecord(gen, timer.second, commandRecord))
+            {
+                failClient(gen, timer.second);
+                continue;
+            }
+        }
+        gen.timers.push(sendTimer(timer.first + interval, timer.second));
+    }
+}
+
+
+
+/*
+ *  Function: sendRecord
+ *  Parameters: a reference to the generator, the index of the client, the record to send
+ *  Return: false if writing failed and the client must be closed, true otherwise
+ *  Description: This function remembers when the record was sent and writes it to the client's socket without blocking. Whatever the socket
+ *               does not take waits behind the output already waiting and is written when epoll reports the socket writable.
+*/
+bool sendRecord(generatorStruct &gen, uint32_t index, const char* record)
+{
+    loadClientStruct &client = gen.clients[index];
+    client.sent[(client.head + client.count) % MAX_OUTSTANDING] = gen.now;
+    client.count++;
+
+    size_t written = 0;
+    if(client.output.empty())
+    {
+        ssize_t bytes = write(client.socket, record, RECORD_SIZE);
+        if(bytes == RECORD_SIZE)
+        {
+            return true;
+        }
+        if(bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            return false;
+        }
+        written = bytes < 0 ? 0 : bytes;
+    }
+    client.output.append(record + written, RECORD_SIZE - written);
+    return updateEvents(gen, index);
+}
+
+
+
+/*
+ *  Function: flushOutput
+ *  Parameters: a reference to the generator, the index of a writable client
+ *  Return: false if writing failed and the client must be closed, true otherwise
+ *  Description: This function writes the output waiting for a client until it is written or the socket would block.
+*/
+bool flushOutput(generatorStruct &gen, uint32_t index)
+{
+    loadClientStruct &client = gen.clients[index];
+    while(!client.output.empty())
+    {
+        ssize_t bytes = write(client.socket, client.output.data(), client.output.size());
+        if(bytes < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return false;
+        }
+        client.output.erase(0, bytes);
+    }
+    return updateEvents(gen, index);
+}
+
+
+
+/*
+ *  Function: updateEvents
+ *  Parameters: a reference to the generator, the index of the client
+ *  Return: false if epoll could not be updated, true otherwise
+ *  Description: This function watches the client for replies, and for room to write while output is waiting. epoll is only called when that
+ *               changes, the first call registers the socket.
+*/
+bool updateEvents(generatorStruct &gen, uint32_t index)
+{
+    loadClientStruct &client = gen.clients[index];
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | (client.output.empty() ? 0u : (uint32_t)EPOLLOUT);
+    event.data.u64 = 0;
+    event.data.u32 = index;
+    if(event.events == client.events)
+    {
+        return true;
+    }
+
+    int operation = client.events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    client.events = event.events;
+    if(epoll_ctl(gen.epollFD, operation, client.socket, &event) < 0)
+    {
+        perror("epoll_ctl");
+        return false;
+    }
+    return true;
+}
+
+
+
+/*
+ *  Function: readReplies
+ *  Parameters: a reference to the generator, the index of a readable client
+ *  Return: false if the server closed the connection, sent garbage or reading failed and the client must be closed, true otherwise
+ *  Description: This function reads what the server sent and splits it into replies on their terminating 0. A reply cut in half by the read
+ *               is kept until the rest arrives, whole replies are handled straight from the read buffer.
+*/
+bool readReplies(generatorStruct &gen, uint32_t index)
+{
+    loadClientStruct &client = gen.clients[index];
+    char buffer[READ_SIZE];
+
+    ssize_t bytes = read(client.socket, buffer, sizeof(buffer));
+    if(bytes < 0)
+    {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    if(bytes == 0)
+    {
+        return false;
+    }
+
+    const char* start = buffer;
+    const char* end = buffer + bytes;
+    while(start < end)
+    {
+        const char* terminator = (const char*)memchr(start, '\0', end - start);
+        if(terminator == NULL)
+        {
+            client.input.append(start, end - start);
+            return client.input.size() <= MAX_REPLY;
+        }
+
+        bool handled;
+        if(client.input.empty())
+        {
+            handled = handleReply(gen, index, start, terminator - start);
+        }
+        else
+        {
+            client.input.append(start, terminator - start);
+            handled = handleReply(gen, index, client.input.data(), client.input.size());
+            client.input.clear();
+        }
+        if(!handled)
+        {
+            return false;
+        }
+        start = terminator + 1;
+    }
+    return true;
+}
+
+
+
+/*
+ *  Function: handleReply
+ *  Parameters: a reference to the generator, the index of the client, the reply and its length
+ *  Return: false if writing failed and the client must be closed, true otherwise
+ *  Description: This function answers HELLO with THANKS. ENTERCMD answers the oldest unanswered record: the first one finishes the
+ *               handshake, the others are commands whose latency is recorded, and without a rate the client sends its next command.
+ *               Anything else is a record relayed by the server or a KEEPALIVE and only counted.
+*/
+bool handleReply(generatorStruct &gen, uint32_t index, const char* reply, size_t length)
+{
+    loadClientStruct &client = gen.clients[index];
+    if(length == 5 && !memcmp(reply, "HELLO", 5))
+    {
+        return sendRecord(gen, index, thanksRecord);
+    }
+    if(length == 9 && !memcmp(reply, "KEEPALIVE", 9))
+    {
+        gen.stats.keepalives++;
+        return true;
+    }
+    if(length != 8 || memcmp(reply, "ENTERCMD", 8) || client.count == 0)
+    {
+        gen.stats.relayed++;
+        return true;
+    }
+
+    uint64_t elapsed = gen.now - client.sent[client.head];
+    client.head = (client.head + 1) % MAX_OUTSTANDING;
+    client.count--;
+    if(!client.ready)
+    {
+        client.ready = true;
+        gen.stats.greeted++;
+        recordValue(gen.stats.handshake, elapsed);
+        return true;
+    }
+
+    recordValue(gen.stats.latency, elapsed);
+    if(!gen.running)
+    {
+        return true;
+    }
+    gen.stats.answered++;
+    if(options.rate > 0)
+    {
+        return true;
+    }
+    gen.stats.sent++;
+    return sendRecord(gen, index, commandRecord);
+}
+
+
+
+/*
+ *  Function: failClient
+ *  Parameters: a reference to the generator, the index of the client
+ *  Return: None
+ *  Description: This function closes a client the server closed or that failed. Its unanswered commands are counted as such, and a client
+ *               that never finished the handshake no longer holds up the start.
+*/
+void failClient(generatorStruct &gen, uint32_t index)
+{
+    loadClientStruct &client = gen.clients[index];
+    if(client.socket < 0)
+    {
+        return;
+    }
+
+    close(client.socket);
+    client.socket = -1;
+    gen.stats.failed++;
+    if(client.ready)
+    {
+        gen.stats.unanswered += client.count;
+    }
+    else if(gen.stats.refused++ == 0)
+    {
+        cout << "Generator " << gen.id << ": a client was closed before the handshake, is the server full?" << endl;
+    }
+}
+
+
+
+/*
+ *  Function: countUnanswered
+ *  Parameters: a reference to the generator
+ *  Return: the commands the open clients are still waiting on
+ *  Description: This function adds up the unanswered commands of every open client.
+*/
+uint64_t countUnanswered(generatorStruct &gen)
+{
+    uint64_t unanswered = 0;
+    for(size_t i=0; i < gen.clients.size(); i++)
+    {
+        unanswered += gen.clients[i].socket >= 0 ? gen.clients[i].count : 0;
+    }
+    return unanswered;
+}
+
+
+
+/*
+ *  Function: recordValue
+ *  Parameters: a reference to the histogram, the value
+ *  Return: None
+ *  Description: This function counts a value in its bucket. Values below 32 have a bucket each, every power of two above that is split into
+ *               16 buckets, so a bucket is never wider than 1/16 of its values.
+*/
+void recordValue(histogramStruct &histogram, uint64_t value)
+{
+    int bucket = (int)value;
+    if(value >= 32)
+    {
+        int msb = 63 - __builtin_clzll(value);
+        bucket = (msb - 3) * 16 + (int)((value >> (msb - 4)) & 15);
+    }
+    histogram.counts[bucket]++;
+    histogram.total++;
+    histogram.sum += value;
+    histogram.max = max(histogram.max, value);
+}
+
+
+
+/*
+ *  Function: mergeHistogram
+ *  Parameters: a reference to the histogram to add to, the histogram to add
+ *  Return: None
+ *  Description: This function adds the counts of one histogram to another.
+*/
+void mergeHistogram(histogramStruct &total, const histogramStruct &histogram)
+{
+    for(int i=0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        total.counts[i] += histogram.counts[i];
+    }
+    total.total += histogram.total;
+    total.sum += histogram.sum;
+    total.max = max(total.max, histogram.max);
+}
+
+
+
+/*
+ *  Function: percentile
+ *  Parameters: a reference to the histogram, the fraction of the values, between 0 and 1
+ *  Return: the largest value of the bucket the percentile falls in, never above the largest value recorded
+ *  Description: This function walks the buckets until they hold the given fraction of the values.
+*/
+uint64_t percentile(const histogramStruct &histogram, double fraction)
+{
+    uint64_t rank = (uint64_t)(fraction * histogram.total + 0.5);
+    uint64_t seen = 0;
+    for(int i=0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram.counts[i];
+        if(seen >= rank && seen > 0)
+        {
+            if(i < 32)
+            {
+                return i;
+            }
+            int shift = i / 16 - 1;
+            uint64_t upper = ((uint64_t)(16 + i % 16) << shift) + ((uint64_t)1 << shift) - 1;
+            return min(upper, histogram.max);
+        }
+    }
+    return histogram.max;
+}
+
+
+
+/*
+ *  Function: printLatencies
+ *  Parameters: the name of what was measured, a reference to the histogram in nanoseconds
+ *  Return: None
+ *  Description: This function prints the mean, the percentiles and the largest value of a histogram in microseconds.
+*/
+void printLatencies(const char* name, const histogramStruct &histogram)
+{
+    if(histogram.total == 0)
+    {
+        printf("%s: no samples\n", name);
+        return;
+    }
+    printf("%s: mean %.1f us, p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n", name, histogram.sum / 1e3 / histogram.total,
+           percentile(histogram, 0.5) / 1e3, percentile(histogram, 0.9) / 1e3, percentile(histogram, 0.99) / 1e3,
+           percentile(histogram, 0.999) / 1e3, histogram.max / 1e3);
+}
+
+
+
+/*
+ *  Function: raiseFileLimit
+ *  Parameters: None
+ *  Return: None
+ *  Description: This function raises the soft limit on open files to the hard limit, every client holds one descriptor.
+*/
+void raiseFileLimit()
+{
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+
+
+/*
+ *  Function: monotonicNs
+ *  Parameters: None
+ *  Return: nanoseconds of the monotonic clock
+ *  Description: This function reads the clock every time is measured with, it does not jump when the wall clock is changed.
+*/
+uint64_t monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
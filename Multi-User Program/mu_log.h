@@ -0,0 +1,578 @@
+/*
+ *  Author:      Robert Blaine Wilson
+ *  Date:        6/25/2023
+ *
+ *  Synopsis:    This file holds the asynchronous logger of the Multi-User server. A thread that logs never formats, locks or writes: MU_LOG
+ *               copies the format pointer, a timestamp and the arguments into a fixed size record in the thread's own ring and publishes it.
+ *               Integer arguments are stored as they are and strings are copied into the record, so the record stays valid after the call
+ *               returns. The logger thread drains every ring, formats the records into lines and writes them in large batches to stdout or
+ *               the log file, where a slow terminal or disk only holds up the logger thread.
+ *               Every ring has a single producer, the thread that owns it, and a single consumer, whoever holds the drain lock. The producer
+ *               fills the slot at the tail and then publishes the new tail, the consumer formats the record at the head and then publishes
+ *               the new head. A full ring drops the record and counts it, logging never waits. The logger reports the dropped records.
+ *               The logger thread polls the rings while records keep arriving and sleeps on an eventfd once they have been empty for a
+ *               while. Like the shared memory ring of the Peer-to-Peer programs, it raises its waiting flag and checks the rings once more
+ *               before sleeping, and a producer checks the flag after publishing, with a full fence between the two steps on both sides.
+ *               Only the first record after a quiet spell pays for the write to the eventfd.
+ *               Records above the logger's level are skipped before their arguments are evaluated. With a rate set, every call site of every
+ *               thread may log that many records per second, with bursts of up to one second's worth, and the number of records it held back
+ *               is added to its next line.
+ *               The format takes %d for signed and %u for unsigned integers, %s for strings and %% for a percent sign. Lines of different
+ *               threads are written in the order they are drained, each line carries the time it was logged. The time is read from the
+ *               coarse clock, which costs a fraction of the precise one and is only as fine as the kernel's tick, a few milliseconds.
+*/
+
+#ifndef MU_LOG_H
+#define MU_LOG_H
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <type_traits>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+
+
+const int LOG_RECORD_SIZE = 256;        // bytes of a record, a multiple of the cache line
+const int LOG_MAX_ARGS = 6;             // integer arguments a record holds
+const int LOG_RING_RECORDS = 4096;      // records of a thread's ring, a power of two
+const int LOG_MAX_THREADS = 256;        // threads that can have a ring
+const int LOG_IDLE_PASSES = 10;         // empty passes of the logger thread before it sleeps
+const int LOG_IDLE_NS = 1000000;        // nanoseconds between empty passes
+const size_t LOG_BATCH = 64 * 1024;     // bytes of lines the logger thread writes at once
+
+
+/* The levels of the records, a record is logged if its level is at most the logger's level */
+enum logLevel
+{
+    LEVEL_ERROR,                // a call failed
+    LEVEL_WARN,                 // a client was dropped by the server
+    LEVEL_INFO,                 // clients coming and going
+    LEVEL_DEBUG                 // every command
+};
+
+
+/* One record as the producer leaves it, formatted by the logger thread */
+struct logRecordStruct
+{
+    uint64_t time;              // nanoseconds of the coarse real time clock
+    const char* format;         // a string literal, only the pointer is copied
+    uint32_t suppressed;        // records of the call site held back by the rate limit since its last record
+    uint8_t level;
+    uint8_t argCount;
+    uint16_t textLength;        // bytes of text used, every string ends with a 0
+    int64_t args[LOG_MAX_ARGS];
+    char text[LOG_RECORD_SIZE - 24 - 8 * LOG_MAX_ARGS];
+};
+
+
+/* The ring of one thread */
+struct logRingStruct
+{
+    alignas(64) std::atomic<uint64_t> head;     // records consumed, only the consumer writes it
+    uint64_t reportedDrops;                     // dropped records the consumer has reported
+    alignas(64) std::atomic<uint64_t> tail;     // records produced, only the producer writes it
+    uint64_t cachedHead;                        // the producer's last look at head, so it reads the consumer's line only when the ring looks full
+    std::atomic<uint64_t> dropped;              // records lost to a full ring, only the producer writes it
+    alignas(64) logRecordStruct records[LOG_RING_RECORDS];
+};
+
+
+/* The state of a call site, one per call site and thread */
+struct logLimitStruct
+{
+    uint64_t next;              // nanoseconds when the call site has its full burst again
+    uint32_t suppressed;        // records held back since the last one logged
+};
+
+
+/* The logger */
+struct loggerStruct
+{
+    int fd;                                     // where the lines are written
+    int level;                                  // the most detailed level logged
+    uint64_t interval;                          // nanoseconds per record of a call site, 0 for no limit
+    uint64_t burst;                             // nanoseconds a call site may log ahead of its rate
+    int wakeFD;                                 // eventfd the logger thread sleeps on
+    std::atomic<int> waiting;                   // the logger thread is about to sleep or sleeps
+    std::atomic<int> ringCount;
+    std::atomic<uint64_t> lost;                 // records of threads that got no ring
+    std::mutex ringLock;                        // held while a ring is added
+    std::mutex drainLock;                       // held by whoever drains the rings
+    logRingStruct* rings[LOG_MAX_THREADS];
+    std::string lines;                          // the batch being formatted, only used under drainLock
+    time_t second;                              // the second the cached time of day text belongs to
+    char clock[32];
+};
+
+
+
+/*
+ *  Function: createLogger
+ *  Parameters: None
+ *  Return: a pointer to a logger that logs nothing
+ *  Description: This function allocates the logger. It is never freed, so it outlives the exit handlers while the logger thread still runs.
+*/
+inline loggerStruct* createLogger()
+{
+    loggerStruct* log = new loggerStruct();
+    log->fd = STDOUT_FILENO;
+    log->level = -1;
+    log->wakeFD = -1;
+    return log;
+}
+
+
+
+/*
+ *  Function: logger
+ *  Parameters: None
+ *  Return: a reference to the logger
+ *  Description: This function returns the logger every thread shares. It logs nothing until startLogger() is called.
+*/
+inline loggerStruct& logger()
+{
+    static loggerStruct* instance = createLogger();
+    return *instance;
+}
+
+
+
+/*
+ *  Function: logRing
+ *  Parameters: None
+ *  Return: a pointer to the calling thread's ring, NULL if every ring is taken
+ *  Description: This function gives the calling thread a ring the first time it logs. That is the only time a producer takes a lock, rings
+ *               are never freed since the logger thread may still be draining them.
+*/
+inline logRingStruct* logRing()
+{
+    static thread_local logRingStruct* ring = NULL;
+    static thread_local bool registered = false;
+    if(registered)
+    {
+        return ring;
+    }
+
+    loggerStruct &log = logger();
+    std::lock_guard<std::mutex> lock(log.ringLock);
+    registered = true;
+    int count = log.ringCount.load(std::memory_order_relaxed);
+    if(count < LOG_MAX_THREADS)
+    {
+        ring = new logRingStruct();
+        ring->head.store(0, std::memory_order_relaxed);
+        ring->tail.store(0, std::memory_order_relaxed);
+        ring->dropped.store(0, std::memory_order_relaxed);
+        ring->cachedHead = 0;
+        ring->reportedDrops = 0;
+        log.rings[count] = ring;
+        log.ringCount.store(count + 1, std::memory_order_release);
+    }
+    return ring;
+}
+
+
+
+/*
+ *  Function: logArg
+ *  Parameters: a reference to the record, a string argument
+ *  Return: None
+ *  Description: This function copies a string into the text of the record. A string that does not fit is cut short.
+*/
+inline void logArg(logRecordStruct &record, const char* text)
+{
+    size_t room = sizeof(record.text) - record.textLength;
+    if(room == 0)
+    {
+        return;
+    }
+    size_t length = text == NULL ? 0 : strnlen(text, room - 1);
+    if(length > 0)
+    {
+        memcpy(record.text + record.textLength, text, length);
+    }
+    record.text[record.textLength + length] = '\0';
+    record.textLength += length + 1;
+}
+
+
+
+/*
+ *  Function: logArg
+ *  Parameters: a reference to the record, a string argument
+ *  Return: None
+ *  Description: This function copies a string into the text of the record.
+*/
+inline void logArg(logRecordStruct &record, const std::string &text)
+{
+    logArg(record, text.c_str());
+}
+
+
+
+/*
+ *  Function: logArg
+ *  Parameters: a reference to the record, an integer argument
+ *  Return: None
+ *  Description: This function stores an integer in the record. Arguments past LOG_MAX_ARGS are left out.
+*/
+template<typename T>
+inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type logArg(logRecordStruct &record, T value)
+{
+    if(record.argCount < LOG_MAX_ARGS)
+    {
+        record.args[record.argCount++] = (int64_t)value;
+    }
+}
+
+
+
+/*
+ *  Function: logWrite
+ *  Parameters: the level, a reference to the call site's state, the format, the arguments
+ *  Return: None
+ *  Description: This function applies the rate limit of the call site and fills a record in the calling thread's ring. It never blocks, a full
+ *               ring drops the record. The logger thread is only woken if it sleeps.
+*/
+template<typename... Args>
+void logWrite(int level, logLimitStruct &limit, const char* format, Args... args)
+{
+    loggerStruct &log = logger();
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+    // every record moves the call site's schedule on by one interval, it may run up to one burst ahead of the clock
+    if(log.interval > 0)
+    {
+        if(limit.next > now + log.burst)
+        {
+            limit.suppressed++;
+            return;
+        }
+        limit.next = std::max(limit.next, now) + log.interval;
+    }
+
+    logRingStruct* ring = logRing();
+    if(ring == NULL)
+    {
+        log.lost.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    if(tail - ring->cachedHead == LOG_RING_RECORDS)
+    {
+        ring->cachedHead = ring->head.load(std::memory_order_acquire);
+        if(tail - ring->cachedHead == LOG_RING_RECORDS)
+        {
+            ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    // fill the record in place and publish it
+    logRecordStruct &record = ring->records[tail & (LOG_RING_RECORDS - 1)];
+    record.time = now;
+    record.format = format;
+    record.suppressed = limit.suppressed;
+    record.level = level;
+    record.argCount = 0;
+    record.textLength = 0;
+    int expand[] = {0, (logArg(record, args), 0)...};
+    (void)expand;
+    limit.suppressed = 0;
+    ring->tail.store(tail + 1, std::memory_order_release);
+
+    // wake the logger thread if it went to sleep before it could see the record
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(log.waiting.load(std::memory_order_relaxed) && log.waiting.exchange(0) == 1)
+    {
+        uint64_t one = 1;
+        ssize_t written = write(log.wakeFD, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+
+/* Logs a record if its level is enabled, the arguments are not evaluated otherwise */
+#define MU_LOG(severity, ...) \
+    do \
+    { \
+        if((severity) <= logger().level) \
+        { \
+            static thread_local logLimitStruct logLimit; \
+            logWrite((severity), logLimit, __VA_ARGS__); \
+        } \
+    } while(0)
+
+
+
+/*
+ *  Function: formatRecord
+ *  Parameters: a reference to the logger, a reference to the record
+ *  Return: None
+ *  Description: This function appends the line of a record to the batch: the time of day, the level and the formatted message, followed by
+ *               the number of records the call site held back, if any.
+*/
+inline void formatRecord(loggerStruct &log, const logRecordStruct &record)
+{
+    static const char* const levels[] = {"ERROR", "WARN ", "INFO ", "DEBUG"};
+    char number[32];
+
+    // the time of day only changes once a second
+    time_t second = record.time / 1000000000;
+    if(second != log.second)
+    {
+        struct tm local;
+        localtime_r(&second, &local);
+        strftime(log.clock, sizeof(log.clock), "%Y-%m-%d %H:%M:%S", &local);
+        log.second = second;
+    }
+    snprintf(number, sizeof(number), ".%03d ", (int)(record.time / 1000000 % 1000));
+    log.lines += log.clock;
+    log.lines += number;
+    log.lines += levels[std::min<int>(record.level, LEVEL_DEBUG)];
+    log.lines += ' ';
+
+    int arg = 0;
+    size_t text = 0;
+    for(const char* c = record.format; *c != '\0'; c++)
+    {
+        if(*c != '%' || c[1] == '\0')
+        {
+            log.lines += *c;
+            continue;
+        }
+
+        c++;
+        if((*c == 'd' || *c == 'u') && arg < record.argCount)
+        {
+            if(*c == 'd')
+            {
+                snprintf(number, sizeof(number), "%lld", (long long)record.args[arg++]);
+            }
+            else
+            {
+                snprintf(number, sizeof(number), "%llu", (unsigned long long)record.args[arg++]);
+            }
+            log.lines += number;
+        }
+        else if(*c == 's' && text < record.textLength)
+        {
+            log.lines += record.text + text;
+            text += strlen(record.text + text) + 1;
+        }
+        else if(*c == '%')
+        {
+            log.lines += '%';
+        }
+    }
+
+    if(record.suppressed > 0)
+    {
+        snprintf(number, sizeof(number), "%u", record.suppressed);
+        log.lines += " (";
+        log.lines += number;
+        log.lines += " more held back by the rate limit)";
+    }
+    log.lines += '\n';
+}
+
+
+
+/*
+ *  Function: writeLines
+ *  Parameters: a reference to the logger
+ *  Return: None
+ *  Description: This function writes the batch and empties it. A write that fails loses the batch, there is nowhere left to report it.
+*/
+inline void writeLines(loggerStruct &log)
+{
+    size_t offset = 0;
+    while(offset < log.lines.size())
+    {
+        ssize_t bytes = write(log.fd, log.lines.data() + offset, log.lines.size() - offset);
+        if(bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(bytes <= 0)
+        {
+            break;
+        }
+        offset += bytes;
+    }
+    log.lines.clear();
+}
+
+
+
+/*
+ *  Function: drainLogs
+ *  Parameters: None
+ *  Return: the number of records drained
+ *  Description: This function formats and writes the records waiting in every ring and reports the records the rings dropped. Only one
+ *               thread drains at a time.
+*/
+inline size_t drainLogs()
+{
+    loggerStruct &log = logger();
+    std::lock_guard<std::mutex> lock(log.drainLock);
+    size_t drained = 0;
+
+    int count = log.ringCount.load(std::memory_order_acquire);
+    for(int i=0; i < count; i++)
+    {
+        logRingStruct* ring = log.rings[i];
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        uint64_t tail = ring->tail.load(std::memory_order_acquire);
+        for(; head != tail; head++)
+        {
+            formatRecord(log, ring->records[head & (LOG_RING_RECORDS - 1)]);
+            if(log.lines.size() >= LOG_BATCH)
+            {
+                ring->head.store(head + 1, std::memory_order_release);
+                writeLines(log);
+            }
+            drained++;
+        }
+        ring->head.store(head, std::memory_order_release);
+
+        uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+        if(dropped != ring->reportedDrops)
+        {
+            char line[96];
+            snprintf(line, sizeof(line), "%llu log record(s) dropped, the logger could not keep up\n", (unsigned long long)(dropped - ring->reportedDrops));
+            log.lines += line;
+            ring->reportedDrops = dropped;
+        }
+    }
+
+    writeLines(log);
+    return drained;
+}
+
+
+
+/*
+ *  Function: logPending
+ *  Parameters: None
+ *  Return: true if a ring holds a record
+ *  Description: This function is called by the logger thread before it sleeps.
+*/
+inline bool logPending()
+{
+    loggerStruct &log = logger();
+    int count = log.ringCount.load(std::memory_order_acquire);
+    for(int i=0; i < count; i++)
+    {
+        if(log.rings[i]->tail.load(std::memory_order_acquire) != log.rings[i]->head.load(std::memory_order_relaxed))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+
+/*
+ *  Function: runLogger
+ *  Parameters: None
+ *  Return: None
+ *  Description: This function is the logger thread. It drains the rings as long as records come in, checks them every LOG_IDLE_NS for
+ *               LOG_IDLE_PASSES passes after they ran empty, and then sleeps on the eventfd until a producer wakes it.
+*/
+inline void runLogger()
+{
+    loggerStruct &log = logger();
+    int idle = 0;
+    for(;;)
+    {
+        if(drainLogs() > 0)
+        {
+            idle = 0;
+            continue;
+        }
+        if(idle++ < LOG_IDLE_PASSES)
+        {
+            struct timespec pause = {0, LOG_IDLE_NS};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        // announce the sleep, then look once more so a record published meanwhile is not missed
+        log.waiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(!logPending())
+        {
+            struct pollfd wake = {log.wakeFD, POLLIN, 0};
+            poll(&wake, 1, -1);
+            uint64_t value;
+            ssize_t bytes = read(log.wakeFD, &value, sizeof(value));
+            (void)bytes;
+        }
+        log.waiting.store(0, std::memory_order_relaxed);
+        idle = 0;
+    }
+}
+
+
+
+/*
+ *  Function: startLogger
+ *  Parameters: the descriptor the lines are written to, the most detailed level to log, records per second of a call site, 0 for no limit
+ *  Return: 0 on success, -1 if the eventfd could not be created
+ *  Description: This function sets the logger up and starts the logger thread, which ignores every signal so that signals reach the threads
+ *               that handle them. It must be called before the threads that log are started.
+*/
+inline int startLogger(int fd, int level, uint64_t rate)
+{
+    loggerStruct &log = logger();
+    log.wakeFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(log.wakeFD < 0)
+    {
+        return -1;
+    }
+    log.fd = fd;
+    log.interval = rate > 0 ? 1000000000 / rate : 0;
+    log.burst = rate > 0 ? 1000000000 - log.interval : 0;
+    log.lines.reserve(LOG_BATCH + LOG_RECORD_SIZE * 2);
+
+    sigset_t signals, previous;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    std::thread(runLogger).detach();
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    log.level = level;
+    return 0;
+}
+
+
+
+/*
+ *  Function: flushLogger
+ *  Parameters: None
+ *  Return: None
+ *  Description: This function writes every record logged so far, it is called before the process exits.
+*/
+inline void flushLogger()
+{
+    if(logger().wakeFD >= 0)
+    {
+        drainLogs();
+    }
+}
+
+#endif
@@ -1,21 +1,60 @@
 /*
  *  Author:      Robert Blaine Wilson
  *  Date:        6/25/2023
- *  
+ *
  *  Synopsis:    This file is the server for the Multi-User program. It uses the AF_UNIX address family and takes one command line argument which is
- *               the socket file to create. It takes an asynchronous approach to handling multiple clients by storing client sockets in a vector 
- *               and making the server socket non-blocking when there are clients connected. This file takes advantage of the select() function 
- *               to see whenever data is waiting to be read on socket file descriptors. After a handshake with each client, the server reads commands
- *               sent from the client until the command 'quit' has been sent. After this, the server closes the client socket and removes the socket 
- *               from the client vector data structure. If there are no clients, the server socket is set to block.
- *  
+ *               the socket file to create. It takes an asynchronous approach to handling multiple clients by storing client sockets in a client table
+ *               and registering the server socket and every client socket with epoll. The server blocks in epoll_wait() until a socket is ready,
+ *               so it uses no CPU while idle and answers a command as soon as it arrives, however many clients are connected. After a handshake
+ *               with each client, the server reads commands sent from the client until the command 'quit' has been sent. After this, the server
+ *               closes the client socket and removes the socket from the client table.
+ *               The client table is a slab of client structures that only grows when every slot is taken, freed slots are reused, so clients
+ *               are added and removed in constant time without allocating. A client is known to epoll by a handle holding its slot and the
+ *               generation of the slot, which changes whenever the slot is freed. An event for a client that is already gone therefore never
+ *               reaches the client that reuses its slot. The slots in use are also packed in a second array for iterating over every client.
+ *               The sockets are watched level-triggered by default. With --edge they are watched edge-triggered, and every ready socket is
+ *               read and accepted from until it would block. The open file limit is raised to its hard limit so the server can hold as
+ *               many clients as the system allows.
+ *               With --threads n the clients are spread over n reactor threads. Each reactor has its own epoll instance and client table and
+ *               never shares a client with another thread. The main thread only accepts connections and hands every new socket to the next
+ *               reactor in turn through the reactor's pipe, which also wakes the reactor up. Each reactor counts what it handled in its own
+ *               statistics, which are added up without locking when the server exits.
+ *               Replies never block the event loop. A reply is written straight to the socket while nothing is queued for the client, what the
+ *               socket does not take is queued in the client's bounded output queue and written when epoll reports the socket writable. Queued
+ *               messages are shared and reference counted in a ring that doubles when it runs out of room, so the queue is bounded by bytes
+ *               alone. Once a client has more than the high watermark (--high-water, 64 KB by default) queued, the --slow policy applies:
+ *               'pause' stops reading from the client until its queue drains below half the watermark and keeps queueing what is sent to
+ *               it, 'drop' discards the replies that do not fit, and 'disconnect' closes the client. A paused client that lets PAUSED_LIMIT
+ *               watermarks pile up is not reading at all and is closed too.
+ *               With --broadcast the server relays what clients say. Every client starts in the lobby, 'join <room>' moves it to a named
+ *               room and 'leave' back to the lobby. Anything else a client sends goes to every other client in its room, 'all <text>' goes
+ *               to every other client in every room. The relayed text is built once into a shared, reference counted record that is queued
+ *               by reference for every recipient and written with the rest of their queue, so no recipient gets a copy of its own. Clients
+ *               of other reactors are reached by posting the record once to each reactor's mailbox pipe.
+ *               Every reactor keeps a hierarchical timer wheel for its clients: four levels of 64 buckets with a 10 ms tick, each level
+ *               covering 64 times the span of the one below. A timer is linked into one bucket by slot index, so scheduling and cancelling
+ *               are constant time, and timers of a higher level move down a level when the level below wraps around. The wait in
+ *               epoll_wait() ends at the next tick that has a timer, so no timerfd is needed. Each client has one timer for its next deadline:
+ *               a client that has not answered the handshake within --handshake-timeout seconds (10 by default) is closed, a client silent
+ *               for --idle-timeout seconds is closed, and a client silent for --keepalive seconds is sent 'KEEPALIVE', which also finds peers
+ *               that are gone. A 0 turns a timer off, the idle timeout and keepalive are off by default. Activity only records the time, the
+ *               timer checks it when it fires and moves itself to the new deadline.
+ *               The event loops never print, they log through the asynchronous logger of mu_log.h: a log call copies its arguments into a
+ *               record in the thread's own ring and returns, and the logger thread formats the records and writes them in batches to stdout
+ *               or --log-file. --log-level picks the most detailed level logged: 'error' for failed calls, 'warn' for clients the server
+ *               dropped, 'info' for clients coming and going and 'debug' (the default) for every command and room change. --quiet is short
+ *               for --log-level info. Every log statement of every thread may log --log-rate records per second (1000 by default, 0 for no
+ *               limit) and counts what it held back.
+ *
  *  Help:        While writting this file, I followed along with the material provided in module 3. I also asked a question in piazza regarding how to handle
  *               abrupt client socket disconnects.
- * 
+ *
  *  Compilation: g++ -c mu_server.cpp
- *               g++ -o mu_server mu_server.o
- * 
- *  Usage:       ./mu_server <socket file>
+ *               g++ -pthread -o mu_server mu_server.o
+ *
+ *  Usage:       ./mu_server <socket file> [--edge] [--threads n] [--quiet] [--high-water bytes] [--slow pause|drop|disconnect] [--broadcast]
+ *                                         [--handshake-timeout seconds] [--idle-timeout seconds] [--keepalive seconds]
+ *                                         [--log-level error|warn|info|debug] [--log-file path] [--log-rate records per second]
 */
 
 #include <iostream>
@@ -23,42 +62,295 @@
 #include <sys/un.h>
 #include <unistd.h>
 #include <vector>
+#include <string>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <atomic>
 #include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
 #include <sys/signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include "mu_log.h"
 
 using namespace std;
 
 
+const int MAX_EVENTS = 256;     // events taken from epoll_wait() at once
+const int RECORD_SIZE = 100;    // the client writes every message as a 100 byte record
+const size_t INITIAL_SLOTS = 1024;              // client slots allocated up front
+const uint64_t SERVER_HANDLE = UINT64_MAX;      // epoll handle of the server socket
+const uint64_t HANDOFF_HANDLE = UINT64_MAX - 1; // epoll handle of a reactor's hand-off pipe
+const uint64_t MAILBOX_HANDLE = UINT64_MAX - 2; // epoll handle of a reactor's mailbox pipe
+const int OUTPUT_SEGMENTS = 8;                  // messages a client's ring has room for before it first doubles, a power of two
+const int WRITE_SEGMENTS = 64;                  // queued messages gathered into one writev()
+const size_t PAUSED_LIMIT = 16;                 // high watermarks a paused client may have queued before it is closed
+const size_t DEFAULT_HIGH_WATER = 64 * 1024;    // queued bytes before the slow client policy applies
+const int TICK_MS = 10;                         // resolution of the timer wheel
+const int WHEEL_BITS = 6;                       // every level has 1 << WHEEL_BITS buckets
+const int WHEEL_SIZE = 1 << WHEEL_BITS;
+const int WHEEL_LEVELS = 4;                     // the wheel spans 64^4 ticks, about 3 days
+const uint32_t NO_SLOT = UINT32_MAX;            // end of a timer list
+const int SHED_BACKOFF_MS = 10;                 // pause of the acceptor when no descriptor can be freed to turn a client away
+
+
 /* Globals */
 int serverSocket;
 char* socketFile;
+int reserveFile = -1;           // descriptor given up to turn a client away when the server is out of descriptors
+enum slowPolicy
+{
+    POLICY_PAUSE,               // stop reading from the client until its queue drains
+    POLICY_DROP,                // discard replies that do not fit
+    POLICY_DISCONNECT           // close the client
+};
+struct serverOptionsStruct
+{
+    bool edge;                  // watch sockets edge-triggered
+    int logLevel;               // the most detailed level logged
+    char* logFile;              // where the log goes, NULL for stdout
+    uint64_t logRate;           // records per second of a log statement, 0 for no limit
+    int threads;                // reactor threads
+    size_t highWater;           // queued bytes before the slow client policy applies
+    slowPolicy policy;          // what to do with a client past the high watermark
+    bool broadcast;             // relay what clients say to their room
+    uint64_t handshakeTimeout;  // milliseconds to answer HELLO, 0 for no limit
+    uint64_t idleTimeout;       // milliseconds of silence before a client is closed, 0 for no limit
+    uint64_t keepalive;         // milliseconds of silence before a client is sent KEEPALIVE, 0 for never
+};
+serverOptionsStruct options;
+typedef shared_ptr<const string> sharedMessage;
+sharedMessage helloMessage;     // the replies every client gets, shared by all queues
+sharedMessage enterMessage;
+sharedMessage keepaliveMessage;
+struct outputQueueStruct        // a ring of messages waiting to be written
+{
+    vector<sharedMessage> segments; // a power of two long, empty until the first message is queued
+    int head;                   // oldest message
+    int count;                  // messages queued
+    size_t offset;              // bytes of the oldest message already written
+    size_t bytes;               // bytes queued and not yet written
+};
+atomic<int> clientCount;        // history of the number of clients handled by the application
 struct clientSocketStruct
 {
     int id;
+    int socket;                 // -1 while the slot is free
+    struct sockaddr_un un;
+    socklen_t size;
+    uint32_t generation;        // changes every time the slot is freed
+    uint32_t position;          // index in the packed array of slots in use
+    uint32_t events;            // events the socket is registered for with epoll
+    bool paused;                // reading stopped until the output queue drains
+    bool slow;                  // past the high watermark and counted, until the output queue drains
+    outputQueueStruct output;
+    string room;                // the lobby is the room with no name
+    uint32_t roomPosition;      // index in the room's members
+    bool greeted;               // the client answered the handshake
+    uint64_t connected;         // milliseconds when the client connected
+    uint64_t lastActivity;      // milliseconds when the client last sent something
+    uint64_t lastKeepalive;     // milliseconds when the client was last sent KEEPALIVE
+    uint64_t expires;           // tick the client's timer fires at
+    uint32_t timerNext;         // slots linked in the same bucket of the timer wheel
+    uint32_t timerPrev;
+    uint16_t timerBucket;       // level * WHEEL_SIZE + index of the bucket, while the timer is armed
+    bool timerArmed;
+};
+struct roomStruct
+{
+    vector<uint32_t> members;   // slots of the clients in the room
+};
+struct clientTableStruct
+{
+    vector<clientSocketStruct> slots;   // every slot, in use or free
+    vector<uint32_t> freeSlots;         // free slots, the most recently freed last
+    vector<uint32_t> used;              // slots in use, packed for iteration
+};
+struct acceptedSocketStruct             // a socket handed from the acceptor to a reactor
+{
     int socket;
     struct sockaddr_un un;
     socklen_t size;
 };
-vector<clientSocketStruct*> clientSockets;
+struct broadcastStruct                  // a record posted to the mailboxes of the other reactors
+{
+    sharedMessage message;
+    string room;
+    bool everyone;                      // every room, not only the sender's
+    int sender;                         // id of the client that said it
+    atomic<int> pending;                // reactors that have not delivered it yet
+};
+struct timerWheelStruct
+{
+    uint64_t now;                                   // the last tick processed
+    uint32_t buckets[WHEEL_LEVELS][WHEEL_SIZE];     // first slot of each bucket's list
+    size_t count;                                   // timers armed
+};
+struct reactorStatsStruct               // written only by its reactor, read by anyone
+{
+    atomic<uint64_t> clients;
+    atomic<uint64_t> commands;
+    atomic<uint64_t> bytes;
+    atomic<uint64_t> dropped;           // replies discarded by the drop policy
+    atomic<uint64_t> slow;              // times a client fell past the high watermark, once until its queue drains
+    atomic<uint64_t> delivered;         // relayed records queued for recipients
+    atomic<uint64_t> expired;           // clients closed by a timeout
+};
+struct reactorStruct
+{
+    int id;
+    int epollFD;
+    int handoff[2];                     // pipe carrying accepted sockets to the reactor
+    int mailbox[2];                     // pipe carrying broadcasts from the other reactors
+    clientTableStruct clientTable;
+    unordered_map<string, roomStruct> rooms;
+    timerWheelStruct timers;
+    uint64_t now;                       // milliseconds, read once per pass of the event loop
+    alignas(64) reactorStatsStruct stats;
+    char padding[64];                   // keeps the next reactor's statistics off this cache line
+};
+reactorStruct* reactors;
 
 
 /* Function Prototypes */
 void cleanup();
 void signalHandler(int);
-int prepareFDReadSet(fd_set&);
 void closeSocket(clientSocketStruct*);
+int initReactor(reactorStruct&);
+void runReactor(reactorStruct*);
+void acceptLoop();
+void acceptClients(reactorStruct&);
+void receiveClients(reactorStruct&);
+bool registerClient(reactorStruct&, const acceptedSocketStruct&);
+bool readClient(reactorStruct&, uint64_t, clientSocketStruct*);
+bool queueMessage(reactorStruct&, uint64_t, clientSocketStruct*, const sharedMessage&);
+bool flushClient(reactorStruct&, uint64_t, clientSocketStruct*);
+bool updateEvents(reactorStruct&, uint64_t, clientSocketStruct*);
+void joinRoom(reactorStruct&, uint32_t, const string&);
+void leaveRoom(reactorStruct&, uint32_t);
+void broadcastMessage(reactorStruct&, clientSocketStruct*, const char*, bool);
+void deliverBroadcast(reactorStruct&, const sharedMessage&, const string&, bool, int);
+void receiveBroadcasts(reactorStruct&);
+uint64_t addClient(clientTableStruct&);
+clientSocketStruct* findClient(clientTableStruct&, uint64_t);
+void removeClient(reactorStruct&, uint64_t);
+void raiseFileLimit();
+bool shedClient();
+void bumpStat(atomic<uint64_t>&, uint64_t);
+void markSlow(reactorStruct&, clientSocketStruct*);
+void growQueue(outputQueueStruct&);
+uint64_t monotonicMs();
+void scheduleTimer(reactorStruct&, uint32_t, uint64_t);
+void cancelTimer(reactorStruct&, uint32_t);
+void cascadeTimers(reactorStruct&, int);
+void advanceTimers(reactorStruct&);
+int nextTimeout(reactorStruct&);
+void scheduleClient(reactorStruct&, uint32_t);
+void expireClient(reactorStruct&, uint32_t);
 
 
 
 int main(int argc, char* argv[])
 {
     // validate command line arguments
-    if(argc != 2)
+    options.edge = false;
+    options.logLevel = LEVEL_DEBUG;
+    options.logFile = NULL;
+    options.logRate = 1000;
+    options.threads = 1;
+    options.highWater = DEFAULT_HIGH_WATER;
+    options.policy = POLICY_PAUSE;
+    options.broadcast = false;
+    options.handshakeTimeout = 10000;
+    options.idleTimeout = 0;
+    options.keepalive = 0;
+    bool valid = argc >= 2;
+    for(int i=2; valid && i < argc; i++)
+    {
+        if(!strcmp(argv[i], "--edge"))
+        {
+            options.edge = true;
+        }
+        else if(!strcmp(argv[i], "--quiet"))
+        {
+            options.logLevel = LEVEL_INFO;
+        }
+        else if(!strcmp(argv[i], "--log-level") && i+1 < argc && (!strcmp(argv[i+1], "error") || !strcmp(argv[i+1], "warn") || !strcmp(argv[i+1], "info") || !strcmp(argv[i+1], "debug")))
+        {
+            i++;
+            options.logLevel = !strcmp(argv[i], "error") ? LEVEL_ERROR : !strcmp(argv[i], "warn") ? LEVEL_WARN : !strcmp(argv[i], "info") ? LEVEL_INFO : LEVEL_DEBUG;
+        }
+        else if(!strcmp(argv[i], "--log-file") && i+1 < argc)
+        {
+            options.logFile = argv[++i];
+        }
+        else if(!strcmp(argv[i], "--log-rate") && i+1 < argc && atol(argv[i+1]) >= 0)
+        {
+            options.logRate = atol(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--broadcast"))
+        {
+            options.broadcast = true;
+        }
+        else if(!strcmp(argv[i], "--handshake-timeout") && i+1 < argc && atol(argv[i+1]) >= 0)
+        {
+            options.handshakeTimeout = atol(argv[++i]) * 1000;
+        }
+        else if(!strcmp(argv[i], "--idle-timeout") && i+1 < argc && atol(argv[i+1]) >= 0)
+        {
+            options.idleTimeout = atol(argv[++i]) * 1000;
+        }
+        else if(!strcmp(argv[i], "--keepalive") && i+1 < argc && atol(argv[i+1]) >= 0)
+        {
+            options.keepalive = atol(argv[++i]) * 1000;
+        }
+        else if(!strcmp(argv[i], "--threads") && i+1 < argc && atoi(argv[i+1]) > 0)
+        {
+            options.threads = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--high-water") && i+1 < argc && atol(argv[i+1]) > 0)
+        {
+            options.highWater = atol(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--slow") && i+1 < argc && (!strcmp(argv[i+1], "pause") || !strcmp(argv[i+1], "drop") || !strcmp(argv[i+1], "disconnect")))
+        {
+            i++;
+            options.policy = !strcmp(argv[i], "pause") ? POLICY_PAUSE : !strcmp(argv[i], "drop") ? POLICY_DROP : POLICY_DISCONNECT;
+        }
+        else
+        {
+            valid = false;
+        }
+    }
+    if(!valid)
     {
-        cout << "Usage: " << argv[0] << " <socket file>" << endl;
+        cout << "Usage: " << argv[0] << " <socket file> [--edge] [--threads n] [--quiet] [--high-water bytes] [--slow pause|drop|disconnect] [--broadcast]" << endl;
+        cout << "       [--handshake-timeout seconds] [--idle-timeout seconds] [--keepalive seconds]" << endl;
+        cout << "       [--log-level error|warn|info|debug] [--log-file path] [--log-rate records per second]" << endl;
         return -1;
     }
     socketFile = argv[1];
+    raiseFileLimit();
+    reserveFile = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    helloMessage = make_shared<const string>("HELLO", sizeof("HELLO"));
+    enterMessage = make_shared<const string>("ENTERCMD", sizeof("ENTERCMD"));
+    keepaliveMessage = make_shared<const string>("KEEPALIVE", sizeof("KEEPALIVE"));
+
+
+    // start the logger before any thread logs
+    int logFD = options.logFile == NULL ? STDOUT_FILENO : open(options.logFile, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(logFD < 0 || startLogger(logFD, options.logLevel, options.logRate) < 0)
+    {
+        perror("log");
+        return -1;
+    }
 
 
     // create server socket
@@ -82,11 +374,11 @@ int main(int argc, char* argv[])
     {
         perror("bind");
         return -1;
-    } 
+    }
 
 
     // listen for connections on server socket
-    result = listen(serverSocket, 10);
+    result = listen(serverSocket, SOMAXCONN);
     if(result < 0)
     {
         perror("listen");
@@ -98,129 +390,61 @@ int main(int argc, char* argv[])
     atexit(cleanup);
 
 
-    // register interrupt handler function
+    // register interrupt handler function, a client that goes away while it is written to must not end the server
     signal(SIGINT, signalHandler);
-    
-
-
-    /* Asynchronous Client Socket Handling*/
-
-    fd_set readset;             // read set for file descriptors
-    
-    struct timeval timeout;     // interval that select() block waiting for data on a file decriptor
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
+    signal(SIGPIPE, SIG_IGN);
 
-    struct timespec ts;         // interval used for nanosleep()
 
-    int count = 0;              // history of the number of clients handled by the application
-    int maxFD;                  // the largest file descriptor size
 
-    char buffer[100];           // read buffer
-    ssize_t bytes;
+    /* Asynchronous Client Socket Handling*/
 
-    for(;;)
+    // create the reactors
+    reactors = new reactorStruct[options.threads];
+    for(int i=0; i < options.threads; i++)
     {
-        if(clientSockets.size() == 0)
+        reactors[i].id = i;
+        if(initReactor(reactors[i]) < 0)
         {
-            cout << "No clients, blocking on server socket..." << endl;
-            // set server socket to block
-            fcntl(serverSocket, F_SETFL, fcntl(serverSocket, F_GETFL) & ~O_NONBLOCK);
+            return -1;
+        }
+    }
 
-            // prepare for first client socket
-            struct clientSocketStruct* clientSocket = new clientSocketStruct;
-            clientSocket->socket = accept(serverSocket, (struct sockaddr*)&clientSocket->un, &clientSocket->size);
-            clientSocket->id = ++count;
 
-            // inform client of connection (handshake protocol)
-            write(clientSocket->socket, "HELLO", sizeof("HELLO"));
-            
-            // save client socket
-            clientSockets.push_back(clientSocket);
-        }
-        else
-        {
-            // change server socket to non-blocking
-            fcntl(serverSocket, F_SETFL, fcntl(serverSocket, F_GETFL) | O_NONBLOCK);
+    // a single reactor runs on the main thread and accepts connections itself
+    if(options.threads == 1)
+    {
+        fcntl(serverSocket, F_SETFL, fcntl(serverSocket, F_GETFL) | O_NONBLOCK);
 
-            // prepare file descriptor read set
-            maxFD = prepareFDReadSet(readset);
+        struct epoll_event event;
+        event.events = EPOLLIN | (options.edge ? (uint32_t)EPOLLET : 0u);
+        event.data.u64 = SERVER_HANDLE;
+        if(epoll_ctl(reactors[0].epollFD, EPOLL_CTL_ADD, serverSocket, &event) < 0)
+        {
+            perror("epoll_ctl");
+            return -1;
+        }
 
-            // check data on file descriptors in prepared read set
-            if(0 == (select(maxFD+1, &readset, NULL, NULL, &timeout)))
-            {
-                ts.tv_sec = 0;
-                ts.tv_nsec = 1000000;
-                nanosleep(&ts, NULL);
-            }
-            else
-            {
-                // check server socket for new connection
-                if(FD_ISSET(serverSocket, &readset))
-                {
-                    // prepare for new client socket
-                    struct clientSocketStruct* clientSocket = new clientSocketStruct;
-                    clientSocket->socket = accept(serverSocket, (struct sockaddr*)&clientSocket->un, &clientSocket->size);
-                    clientSocket->id = ++count;
+        MU_LOG(LEVEL_INFO, "No clients, blocking on server socket...");
+        runReactor(&reactors[0]);
+        return -1;
+    }
 
-                    // inform client of connection (handshake protocol)
-                    write(clientSocket->socket, "HELLO", sizeof("HELLO"));
 
-                    // save client socket
-                    clientSockets.push_back(clientSocket);
-                }
-                // check saved client sockets for data
-                for(int i=0; i < clientSockets.size(); i++)
-                {
-                    if(FD_ISSET(clientSockets.at(i)->socket, &readset))
-                    {
-                        bytes = read(clientSockets.at(i)->socket, buffer, sizeof(buffer));
-                        if(bytes < 0)
-                        {
-                            perror("client socket " + clientSockets.at(i)->id);
-
-                            // error reading -> close socket
-                            closeSocket(clientSockets.at(i));
-
-                            // remove saved client from vector
-                            clientSockets.erase(clientSockets.begin() + i);
-                        }
-                        else if(bytes == 0)
-                        {
-                            cout << "client " << clientSockets.at(i)->id << " has closed the connection." << endl;
-
-                            // client closed -> close socket
-                            closeSocket(clientSockets.at(i));
-
-                            // remove saved client from vector
-                            clientSockets.erase(clientSockets.begin() + i);
-                        }
-                        else
-                        {
-                            buffer[bytes] = '\0';
-                            cout << "Client " << clientSockets.at(i)->id << " says '" << buffer << "'" << endl;
-                            if(!strcmp(buffer, "quit\0"))
-                            {
-                                cout << "Client " << clientSockets.at(i)->id << " quit, see ya." << endl;
-
-                                // client quit -> close socket
-                                closeSocket(clientSockets.at(i));
-
-                                // remove saved client from vector
-                                clientSockets.erase(clientSockets.begin() + i);
-                            }
-                            else
-                            {
-                                write(clientSockets.at(i)->socket, "ENTERCMD", sizeof("ENTERCMD"));
-                            }
-                        }
-                    }
-                }
-            }
-        }
+    // otherwise every reactor gets a thread and the main thread accepts for them, SIGINT is left to the main thread
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    for(int i=0; i < options.threads; i++)
+    {
+        thread(runReactor, &reactors[i]).detach();
     }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
 
-    return 0;
+    MU_LOG(LEVEL_INFO, "Accepting clients for %d reactor threads...", options.threads);
+    acceptLoop();
+
+    return -1;
 }
 
 
@@ -229,21 +453,42 @@ int main(int argc, char* argv[])
  *  Function: cleanup
  *  Parameters: None
  *  Return: None
- *  Description: This function cleans up the application before termination. It closes sockets and unlinks the socket file.
+ *  Description: This function cleans up the application before termination. It closes the server socket, unlinks the socket file and prints
+ *               the statistics of every reactor and their total. Client sockets are closed by the operating system when the process exits,
+ *               reactor threads may still be using their client tables.
 */
 void cleanup()
 {
+    // write what was logged before the statistics
+    flushLogger();
+
     // close server socket
     close(serverSocket);
 
-    // cleanup saved client sockets
-    for(int i=0; i < clientSockets.size(); i++)
-    {
-        closeSocket(clientSockets.at(i));
-    }
-
     // unlink socket file
     unlink(socketFile);
+
+    // merge the statistics, each counter has a single writer so a relaxed read is enough
+    uint64_t clients = 0, commands = 0, bytes = 0, dropped = 0, slow = 0, delivered = 0, expired = 0;
+    for(int i=0; reactors != NULL && i < options.threads; i++)
+    {
+        reactorStatsStruct &stats = reactors[i].stats;
+        clients += stats.clients.load(memory_order_relaxed);
+        commands += stats.commands.load(memory_order_relaxed);
+        bytes += stats.bytes.load(memory_order_relaxed);
+        dropped += stats.dropped.load(memory_order_relaxed);
+        slow += stats.slow.load(memory_order_relaxed);
+        delivered += stats.delivered.load(memory_order_relaxed);
+        expired += stats.expired.load(memory_order_relaxed);
+        if(options.threads > 1)
+        {
+            cout << "Reactor " << i << ": " << stats.clients.load(memory_order_relaxed) << " client(s), ";
+            cout << stats.commands.load(memory_order_relaxed) << " command(s)" << endl;
+        }
+    }
+    cout << clients << " client(s), " << commands << " command(s), " << bytes << " byte(s) handled by " << options.threads << " reactor(s)" << endl;
+    cout << slow << " slow client(s), " << dropped << " repl(ies) dropped, " << delivered << " broadcast record(s) delivered, ";
+    cout << expired << " client(s) timed out" << endl;
 }
 
 
@@ -266,49 +511,1201 @@ void signalHandler(int signal)
 
 
 /*
- *  Function: prepareFDReadSet
- *  Parameters: a reference to a file descriptor set
- *  Return: The largest file descriptor to be used by the select() function;
- *  Description: This function prepares the filde descriptor readset to be used by the select function. It will add the server socket file descriptor and saved 
- *               client socket file descriptors to the readset.
+ *  Function: closeSocket
+ *  Parameters: pointer to a client in a client table
+ *  Return: None
+ *  Description: This function closes the client socket and marks the socket as closed. The slot itself is freed by removeClient().
+*/
+void closeSocket(clientSocketStruct* clientSocket)
+{
+    // close the client socket
+    close(clientSocket->socket);
+    clientSocket->socket = -1;
+}
+
+
+
+/*
+ *  Function: initReactor
+ *  Parameters: a reference to the reactor
+ *  Return: 0 on success, -1 on error
+ *  Description: This function creates the reactor's epoll instance, hand-off pipe and mailbox pipe, registers the read ends of the pipes, and
+ *               reserves the client table. The write end of the mailbox never blocks, a reactor that falls too far behind loses broadcasts
+ *               instead of stalling the others.
+*/
+int initReactor(reactorStruct &reactor)
+{
+    reactor.epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if(reactor.epollFD < 0 || pipe2(reactor.handoff, O_CLOEXEC) < 0 || pipe2(reactor.mailbox, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+        perror("reactor");
+        return -1;
+    }
+    fcntl(reactor.handoff[0], F_SETFL, fcntl(reactor.handoff[0], F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event event;
+    event.events = EPOLLIN | (options.edge ? (uint32_t)EPOLLET : 0u);
+    event.data.u64 = HANDOFF_HANDLE;
+    if(epoll_ctl(reactor.epollFD, EPOLL_CTL_ADD, reactor.handoff[0], &event) < 0)
+    {
+        perror("epoll_ctl");
+        return -1;
+    }
+    event.data.u64 = MAILBOX_HANDLE;
+    if(epoll_ctl(reactor.epollFD, EPOLL_CTL_ADD, reactor.mailbox[0], &event) < 0)
+    {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    reactor.clientTable.slots.reserve(INITIAL_SLOTS);
+    reactor.clientTable.freeSlots.reserve(INITIAL_SLOTS);
+    reactor.clientTable.used.reserve(INITIAL_SLOTS);
+    reactor.stats.clients.store(0, memory_order_relaxed);
+    reactor.stats.commands.store(0, memory_order_relaxed);
+    reactor.stats.bytes.store(0, memory_order_relaxed);
+    reactor.stats.dropped.store(0, memory_order_relaxed);
+    reactor.stats.slow.store(0, memory_order_relaxed);
+    reactor.stats.delivered.store(0, memory_order_relaxed);
+    reactor.stats.expired.store(0, memory_order_relaxed);
+
+    reactor.now = monotonicMs();
+    reactor.timers.now = reactor.now / TICK_MS;
+    reactor.timers.count = 0;
+    for(int level=0; level < WHEEL_LEVELS; level++)
+    {
+        for(int index=0; index < WHEEL_SIZE; index++)
+        {
+            reactor.timers.buckets[level][index] = NO_SLOT;
+        }
+    }
+    return 0;
+}
+
+
+
+/*
+ *  Function: runReactor
+ *  Parameters: pointer to the reactor
+ *  Return: None, it only returns if epoll_wait() fails
+ *  Description: This function is the event loop of a reactor. It blocks until at least one of its sockets is ready or its next timer is due,
+ *               runs the timers that are due, then accepts new clients,
+ *               takes the clients handed over by the acceptor and the broadcasts posted by other reactors, writes the queued replies of writable
+ *               clients, and reads the commands of ready clients. A paused client that hangs up is removed without reading.
 */
-int prepareFDReadSet(fd_set &readset)
+void runReactor(reactorStruct* reactor)
 {
-    int maxFD = 0;
+    struct epoll_event events[MAX_EVENTS];     // ready sockets returned by epoll_wait()
 
-    // clear readset
-    FD_ZERO(&readset);
-    
-    // add serverSocket
-    FD_SET(serverSocket, &readset);
-    
-    // add saved client sockets
-    for(int i=0; i < clientSockets.size(); i++)
+    for(;;)
     {
-        //cout << "Adding " << clientSockets.at(i)->id << " ";
-        FD_SET(clientSockets.at(i)->socket, &readset);
-        if(clientSockets.at(i)->socket > maxFD)
+        // block until at least one socket is ready or the next timer is due
+        int ready = epoll_wait(reactor->epollFD, events, MAX_EVENTS, nextTimeout(*reactor));
+        if(ready < 0 && errno != EINTR)
+        {
+            MU_LOG(LEVEL_ERROR, "epoll_wait: %s", strerror(errno));
+            return;
+        }
+        reactor->now = monotonicMs();
+        advanceTimers(*reactor);
+
+        for(int i=0; i < ready; i++)
         {
-            maxFD = clientSockets.at(i)->socket;
+            uint64_t handle = events[i].data.u64;
+            clientSocketStruct* clientSocket = findClient(reactor->clientTable, handle);
+            if(handle == SERVER_HANDLE)
+            {
+                acceptClients(*reactor);
+            }
+            else if(handle == HANDOFF_HANDLE)
+            {
+                receiveClients(*reactor);
+            }
+            else if(handle == MAILBOX_HANDLE)
+            {
+                receiveBroadcasts(*reactor);
+            }
+            else if(clientSocket != NULL)
+            {
+                bool alive = true;
+                if(events[i].events & EPOLLOUT)
+                {
+                    alive = flushClient(*reactor, handle, clientSocket);
+                }
+                if(alive && clientSocket->paused && (events[i].events & (EPOLLHUP | EPOLLERR)))
+                {
+                    MU_LOG(LEVEL_INFO, "client %d has closed the connection.", clientSocket->id);
+                    alive = false;
+                }
+                else if(alive && !clientSocket->paused && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                {
+                    alive = readClient(*reactor, handle, clientSocket);
+                }
+
+                if(!alive)
+                {
+                    removeClient(*reactor, handle);
+                    if(reactor->clientTable.used.size() == 0 && options.threads == 1)
+                    {
+                        MU_LOG(LEVEL_INFO, "No clients, blocking on server socket...");
+                    }
+                }
+            }
         }
     }
+}
+
+
+
+/*
+ *  Function: acceptLoop
+ *  Parameters: None
+ *  Return: None, it only returns if accepting fails
+ *  Description: This function runs on the main thread when there are reactor threads. It blocks in accept() and writes every new socket to the
+ *               hand-off pipe of the next reactor in turn. A write this small is atomic on a pipe, so no lock is needed.
+ *               A blocking accept() runs out of descriptors before it waits, so out of descriptors the loop first waits for a pending
+ *               client. If accept() still fails once the client is there, the client is turned away with shedClient.
+*/
+void acceptLoop()
+{
+    bool waited = false;        // a client is pending and accept() is retried once before it is turned away
+    for(int next=0;; next = (next + 1) % options.threads)
+    {
+        acceptedSocketStruct accepted;
+        accepted.size = sizeof(accepted.un);
+        accepted.socket = accept4(serverSocket, (struct sockaddr*)&accepted.un, &accepted.size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(accepted.socket < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if(errno == EMFILE || errno == ENFILE)
+            {
+                struct pollfd pending = {serverSocket, POLLIN, 0};
+                if(!waited)
+                {
+                    waited = poll(&pending, 1, -1) > 0;
+                }
+                else
+                {
+                    waited = false;
+                    if(!shedClient())
+                    {
+                        MU_LOG(LEVEL_WARN, "accept: %s", strerror(errno));
+                        usleep(SHED_BACKOFF_MS * 1000);
+                    }
+                }
+                continue;
+            }
+            MU_LOG(LEVEL_ERROR, "accept: %s", strerror(errno));
+            return;
+        }
+        waited = false;
 
-    return maxFD;
+        if(write(reactors[next].handoff[1], &accepted, sizeof(accepted)) != sizeof(accepted))
+        {
+            MU_LOG(LEVEL_ERROR, "hand-off: %s", strerror(errno));
+            close(accepted.socket);
+        }
+    }
 }
 
 
 
 /*
- *  Function: closeSocket
- *  Parameters: pointer to a dynamically allocated clientSocketStruct structure
+ *  Function: acceptClients
+ *  Parameters: a reference to the reactor
  *  Return: None
- *  Description: This function closes the client socket and frees the dymanically allocated memory of the clientSocketStruct structure
+ *  Description: This function accepts every pending connection until the server socket would block and registers each client with the reactor.
+ *               Out of descriptors, the pending clients are turned away by shedClient: a level-triggered listener would otherwise report
+ *               them again at once, and an edge-triggered one never again.
 */
-void closeSocket(clientSocketStruct* clientSocket)
+void acceptClients(reactorStruct &reactor)
 {
-    // close the client socket
-    close(clientSocket->socket);
+    for(;;)
+    {
+        acceptedSocketStruct accepted;
+        accepted.size = sizeof(accepted.un);
+        accepted.socket = accept4(serverSocket, (struct sockaddr*)&accepted.un, &accepted.size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(accepted.socket < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+
+            if((errno == EMFILE || errno == ENFILE) && shedClient())
+            {
+                continue;
+            }
+
+            // nothing left to accept, or no descriptor could be freed to turn the client away
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                MU_LOG(LEVEL_ERROR, "accept: %s", strerror(errno));
+            }
+            return;
+        }
+        registerClient(reactor, accepted);
+    }
+}
+
+
+
+/*
+ *  Function: receiveClients
+ *  Parameters: a reference to the reactor
+ *  Return: None
+ *  Description: This function takes the sockets the acceptor wrote to the reactor's hand-off pipe, until the pipe is empty, and registers
+ *               each client with the reactor.
+*/
+void receiveClients(reactorStruct &reactor)
+{
+    acceptedSocketStruct accepted;
+    while(read(reactor.handoff[0], &accepted, sizeof(accepted)) == sizeof(accepted))
+    {
+        registerClient(reactor, accepted);
+    }
+}
+
+
+
+/*
+ *  Function: registerClient
+ *  Parameters: a reference to the reactor, a reference to the accepted socket
+ *  Return: true if the client was saved, false if its socket was closed again
+ *  Description: This function saves a new client in the reactor's client table, registers its socket with the reactor's epoll instance and
+ *               greets it with the handshake.
+*/
+bool registerClient(reactorStruct &reactor, const acceptedSocketStruct &accepted)
+{
+    // save the client socket in a free slot
+    uint64_t handle = addClient(reactor.clientTable);
+    clientSocketStruct* clientSocket = findClient(reactor.clientTable, handle);
+    clientSocket->socket = accepted.socket;
+    clientSocket->un = accepted.un;
+    clientSocket->size = accepted.size;
+    clientSocket->id = ++clientCount;
+    clientSocket->paused = false;
+    clientSocket->slow = false;
+    clientSocket->greeted = false;
+    clientSocket->connected = reactor.now;
+    clientSocket->lastActivity = reactor.now;
+    clientSocket->lastKeepalive = reactor.now;
+    clientSocket->timerArmed = false;
+    joinRoom(reactor, (uint32_t)handle, "");
+    scheduleClient(reactor, (uint32_t)handle);
+
+    // watch the client socket for commands
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | (options.edge ? (uint32_t)EPOLLET : 0u);
+    event.data.u64 = handle;
+    clientSocket->events = event.events;
+    if(epoll_ctl(reactor.epollFD, EPOLL_CTL_ADD, clientSocket->socket, &event) < 0)
+    {
+        MU_LOG(LEVEL_ERROR, "epoll_ctl: %s", strerror(errno));
+        removeClient(reactor, handle);
+        return false;
+    }
+    bumpStat(reactor.stats.clients, 1);
+
+    // inform client of connection (handshake protocol)
+    if(!queueMessage(reactor, handle, clientSocket, helloMessage))
+    {
+        removeClient(reactor, handle);
+        return false;
+    }
+    return true;
+}
+
+
+
+/*
+ *  Function: readClient
+ *  Parameters: a reference to the reactor, the handle of the client, pointer to a ready client
+ *  Return: false if the client quit, closed the connection or failed and must be removed, true otherwise
+ *  Description: This function reads the commands waiting on a client socket and answers each one with 'ENTERCMD'. In the broadcast mode the
+ *               room commands are carried out and anything else but the answer to the handshake is relayed first. Level-triggered sockets are read once per event, edge-triggered sockets are read until they would block because epoll reports them only once, or until
+ *               the client is paused.
+*/
+bool readClient(reactorStruct &reactor, uint64_t handle, clientSocketStruct* clientSocket)
+{
+    char buffer[RECORD_SIZE + 1];   // read buffer
+    ssize_t bytes;
+
+    for(;;)
+    {
+        bytes = read(clientSocket->socket, buffer, RECORD_SIZE);
+        if(bytes < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return true;
+            }
+            if(errno == EINTR)
+            {
+                continue;
+            }
 
-    // free allocated memory
-    delete clientSocket;
-}
\ No newline at end of file
+            // error reading -> close socket
+            MU_LOG(LEVEL_ERROR, "client %d: %s", clientSocket->id, strerror(errno));
+            return false;
+        }
+        else if(bytes == 0)
+        {
+            // client closed -> close socket
+            MU_LOG(LEVEL_INFO, "client %d has closed the connection.", clientSocket->id);
+            return false;
+        }
+
+        buffer[bytes] = '\0';
+        bool handshake = !clientSocket->greeted;   // the first record answers HELLO, it is acknowledged but never relayed
+        clientSocket->greeted = true;
+        clientSocket->lastActivity = reactor.now;
+        bumpStat(reactor.stats.commands, 1);
+        bumpStat(reactor.stats.bytes, bytes);
+        MU_LOG(LEVEL_DEBUG, "Client %d says '%s'", clientSocket->id, buffer);
+        if(!strcmp(buffer, "quit"))
+        {
+            // client quit -> close socket
+            MU_LOG(LEVEL_INFO, "Client %d quit, see ya.", clientSocket->id);
+            return false;
+        }
+        if(options.broadcast && !handshake)
+        {
+            if(!strncmp(buffer, "join ", 5))
+            {
+                joinRoom(reactor, (uint32_t)handle, buffer + 5);
+            }
+            else if(!strcmp(buffer, "leave"))
+            {
+                joinRoom(reactor, (uint32_t)handle, "");
+            }
+            else
+            {
+                bool everyone = !strncmp(buffer, "all ", 4);
+                broadcastMessage(reactor, clientSocket, everyone ? buffer + 4 : buffer, everyone);
+            }
+        }
+        if(!queueMessage(reactor, handle, clientSocket, enterMessage))
+        {
+            return false;
+        }
+
+        if(!options.edge || clientSocket->paused)
+        {
+            return true;
+        }
+    }
+}
+
+
+
+/*
+ *  Function: queueMessage
+ *  Parameters: a reference to the reactor, the handle of the client, pointer to the client, the message
+ *  Return: false if the client failed or is disconnected by the slow client policy and must be removed, true otherwise
+ *  Description: This function sends a message to a client without blocking. While nothing is queued the message is written straight to the
+ *               socket, whatever the socket does not take is queued behind the messages already waiting. A queue past the high watermark
+ *               gets the slow client policy. A message that was partly written is always queued, dropping the rest would cut a record in
+ *               half.
+*/
+bool queueMessage(reactorStruct &reactor, uint64_t handle, clientSocketStruct* clientSocket, const sharedMessage &message)
+{
+    outputQueueStruct &output = clientSocket->output;
+    size_t written = 0;
+
+    // write straight to the socket while nothing is waiting ahead of the message
+    if(output.count == 0)
+    {
+        ssize_t bytes = write(clientSocket->socket, message->data(), message->size());
+        if(bytes == (ssize_t)message->size())
+        {
+            return true;
+        }
+        if(bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            MU_LOG(LEVEL_ERROR, "client %d: %s", clientSocket->id, strerror(errno));
+            return false;
+        }
+        written = bytes < 0 ? 0 : bytes;
+    }
+
+    // apply the slow client policy to a queue past the high watermark
+    size_t queued = output.bytes + message->size() - written;
+    bool slow = queued > options.highWater;
+    if(slow)
+    {
+        markSlow(reactor, clientSocket);
+    }
+    if(slow && options.policy == POLICY_DISCONNECT)
+    {
+        MU_LOG(LEVEL_WARN, "client %d is too slow, disconnecting.", clientSocket->id);
+        return false;
+    }
+    if(options.policy == POLICY_PAUSE && queued > options.highWater * PAUSED_LIMIT)
+    {
+        MU_LOG(LEVEL_WARN, "client %d stopped reading, disconnecting.", clientSocket->id);
+        return false;
+    }
+    if(written == 0 && slow && options.policy == POLICY_DROP)
+    {
+        bumpStat(reactor.stats.dropped, 1);
+        return true;
+    }
+
+    // queue the rest of the message
+    if(output.count == (int)output.segments.size())
+    {
+        growQueue(output);
+    }
+    output.segments[(output.head + output.count) & (output.segments.size() - 1)] = message;
+    if(output.count++ == 0)
+    {
+        output.offset = written;
+    }
+    output.bytes = queued;
+
+    // a paused client stops sending commands, its queue only grows by replies it has already asked for and by what others relay to it
+    if(options.policy == POLICY_PAUSE && !clientSocket->paused && slow)
+    {
+        clientSocket->paused = true;
+        markSlow(reactor, clientSocket);
+    }
+    return updateEvents(reactor, handle, clientSocket);
+}
+
+
+
+/*
+ *  Function: flushClient
+ *  Parameters: a reference to the reactor, the handle of the client, pointer to a writable client
+ *  Return: false if writing failed and the client must be removed, true otherwise
+ *  Description: This function writes the queued messages with writev() until the queue is empty or the socket would block, and releases every
+ *               message that was written completely. Once the queue is below half the high watermark a paused client is read from again and
+ *               a slow client can be counted as slow again.
+*/
+bool flushClient(reactorStruct &reactor, uint64_t handle, clientSocketStruct* clientSocket)
+{
+    outputQueueStruct &output = clientSocket->output;
+    struct iovec iov[WRITE_SEGMENTS];
+    size_t mask = output.segments.size() - 1;
+
+    while(output.count > 0)
+    {
+        // gather the oldest queued messages, the oldest one starts where the last write stopped
+        int gathered = min(output.count, WRITE_SEGMENTS);
+        for(int i=0; i < gathered; i++)
+        {
+            const string &segment = *output.segments[(output.head + i) & mask];
+            iov[i].iov_base = (void*)(segment.data() + (i == 0 ? output.offset : 0));
+            iov[i].iov_len = segment.size() - (i == 0 ? output.offset : 0);
+        }
+
+        ssize_t bytes = writev(clientSocket->socket, iov, gathered);
+        if(bytes < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            MU_LOG(LEVEL_ERROR, "client %d: %s", clientSocket->id, strerror(errno));
+            return false;
+        }
+
+        // release the messages that were written completely
+        output.bytes -= bytes;
+        output.offset += bytes;
+        while(output.count > 0 && output.offset >= output.segments[output.head]->size())
+        {
+            output.offset -= output.segments[output.head]->size();
+            output.segments[output.head].reset();
+            output.head = (output.head + 1) & mask;
+            output.count--;
+        }
+    }
+
+    if(output.bytes < options.highWater / 2)
+    {
+        clientSocket->paused = false;
+        clientSocket->slow = false;
+    }
+    return updateEvents(reactor, handle, clientSocket);
+}
+
+
+
+/*
+ *  Function: updateEvents
+ *  Parameters: a reference to the reactor, the handle of the client, pointer to the client
+ *  Return: false if epoll could not be updated, true otherwise
+ *  Description: This function watches the client for commands unless it is paused, and for room to write while messages are queued. epoll is
+ *               only called when that changes. Re-arming an edge-triggered socket reports data that arrived while it was paused.
+*/
+bool updateEvents(reactorStruct &reactor, uint64_t handle, clientSocketStruct* clientSocket)
+{
+    struct epoll_event event;
+    event.events = (clientSocket->paused ? 0 : EPOLLIN | EPOLLRDHUP) | (clientSocket->output.count > 0 ? (uint32_t)EPOLLOUT : 0u) | (options.edge ? (uint32_t)EPOLLET : 0u);
+    event.data.u64 = handle;
+    if(event.events == clientSocket->events)
+    {
+        return true;
+    }
+
+    clientSocket->events = event.events;
+    if(epoll_ctl(reactor.epollFD, EPOLL_CTL_MOD, clientSocket->socket, &event) < 0)
+    {
+        MU_LOG(LEVEL_ERROR, "epoll_ctl: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+
+
+/*
+ *  Function: joinRoom
+ *  Parameters: a reference to the reactor, the slot of the client, the name of the room, empty for the lobby
+ *  Return: None
+ *  Description: This function moves a client from its room to another one, creating the room in this reactor when it is first joined.
+*/
+void joinRoom(reactorStruct &reactor, uint32_t slot, const string &room)
+{
+    leaveRoom(reactor, slot);
+
+    clientSocketStruct &clientSocket = reactor.clientTable.slots[slot];
+    roomStruct &members = reactor.rooms[room];
+    clientSocket.room = room;
+    clientSocket.roomPosition = members.members.size();
+    members.members.push_back(slot);
+
+    if(options.broadcast && room.empty())
+    {
+        MU_LOG(LEVEL_DEBUG, "Client %d joined the lobby", clientSocket.id);
+    }
+    else if(options.broadcast)
+    {
+        MU_LOG(LEVEL_DEBUG, "Client %d joined room '%s'", clientSocket.id, room);
+    }
+}
+
+
+
+/*
+ *  Function: leaveRoom
+ *  Parameters: a reference to the reactor, the slot of the client
+ *  Return: None
+ *  Description: This function takes a client out of its room in constant time, the last member takes its place. A named room is deleted
+ *               with its last member. A slot that is not a member of its room is left alone.
+*/
+void leaveRoom(reactorStruct &reactor, uint32_t slot)
+{
+    clientSocketStruct &clientSocket = reactor.clientTable.slots[slot];
+    unordered_map<string, roomStruct>::iterator room = reactor.rooms.find(clientSocket.room);
+    if(room == reactor.rooms.end())
+    {
+        return;
+    }
+
+    vector<uint32_t> &members = room->second.members;
+    if(clientSocket.roomPosition >= members.size() || members[clientSocket.roomPosition] != slot)
+    {
+        return;
+    }
+    uint32_t last = members.back();
+    members[clientSocket.roomPosition] = last;
+    reactor.clientTable.slots[last].roomPosition = clientSocket.roomPosition;
+    members.pop_back();
+
+    if(members.empty() && !clientSocket.room.empty())
+    {
+        reactor.rooms.erase(room);
+    }
+}
+
+
+
+/*
+ *  Function: broadcastMessage
+ *  Parameters: a reference to the reactor, pointer to the client that said it, the text, true to reach every room
+ *  Return: None
+ *  Description: This function builds the record 'Client <id>: <text>' once and hands it to every other client of the sender's room, or of every
+ *               room, in this reactor and in the others. The other reactors each get one pointer to the record through their mailbox.
+*/
+void broadcastMessage(reactorStruct &reactor, clientSocketStruct* sender, const char* text, bool everyone)
+{
+    // build the record once, recipients only take a reference, it ends in a null character like every other reply
+    char record[RECORD_SIZE];
+    int length = snprintf(record, sizeof(record), "Client %d: %s", sender->id, text);
+    sharedMessage message = make_shared<const string>(record, min<size_t>(length, sizeof(record) - 1) + 1);
+
+    // post it to the other reactors before the local clients are served
+    if(options.threads > 1)
+    {
+        broadcastStruct* broadcast = new broadcastStruct();
+        broadcast->message = message;
+        broadcast->room = sender->room;
+        broadcast->everyone = everyone;
+        broadcast->sender = sender->id;
+        broadcast->pending.store(options.threads - 1, memory_order_relaxed);
+
+        for(int i=0; i < options.threads; i++)
+        {
+            if(&reactors[i] != &reactor && write(reactors[i].mailbox[1], &broadcast, sizeof(broadcast)) != sizeof(broadcast))
+            {
+                // the reactor is too far behind, it misses this broadcast
+                bumpStat(reactor.stats.dropped, 1);
+                if(broadcast->pending.fetch_sub(1, memory_order_acq_rel) == 1)
+                {
+                    delete broadcast;
+                }
+            }
+        }
+    }
+
+    deliverBroadcast(reactor, message, sender->room, everyone, sender->id);
+}
+
+
+
+/*
+ *  Function: deliverBroadcast
+ *  Parameters: a reference to the reactor, the record, the room, true to reach every room, id of the client that said it
+ *  Return: None
+ *  Description: This function queues the record for every client of the room, or every client of the reactor, except the sender. Clients that
+ *               fail or are disconnected by the slow client policy are removed after the loop, so the members are not moved while they are
+ *               walked.
+*/
+void deliverBroadcast(reactorStruct &reactor, const sharedMessage &message, const string &room, bool everyone, int sender)
+{
+    clientTableStruct &clientTable = reactor.clientTable;
+    const vector<uint32_t>* recipients = &clientTable.used;
+    if(!everyone)
+    {
+        unordered_map<string, roomStruct>::iterator found = reactor.rooms.find(room);
+        if(found == reactor.rooms.end())
+        {
+            return;
+        }
+        recipients = &found->second.members;
+    }
+
+    vector<uint64_t> failed;
+    uint64_t delivered = 0;
+    for(size_t i=0; i < recipients->size(); i++)
+    {
+        uint32_t slot = (*recipients)[i];
+        clientSocketStruct* clientSocket = &clientTable.slots[slot];
+        uint64_t handle = (uint64_t)clientSocket->generation << 32 | slot;
+        if(clientSocket->id == sender)
+        {
+            continue;
+        }
+        if(!queueMessage(reactor, handle, clientSocket, message))
+        {
+            failed.push_back(handle);
+            continue;
+        }
+        delivered++;
+    }
+    bumpStat(reactor.stats.delivered, delivered);
+
+    for(size_t i=0; i < failed.size(); i++)
+    {
+        removeClient(reactor, failed[i]);
+    }
+}
+
+
+
+/*
+ *  Function: receiveBroadcasts
+ *  Parameters: a reference to the reactor
+ *  Return: None
+ *  Description: This function delivers the broadcasts other reactors posted to this reactor's mailbox, until the mailbox is empty. The last
+ *               reactor to deliver a broadcast frees it, the record itself lives on in the queues that still hold it.
+*/
+void receiveBroadcasts(reactorStruct &reactor)
+{
+    broadcastStruct* broadcast;
+    while(read(reactor.mailbox[0], &broadcast, sizeof(broadcast)) == sizeof(broadcast))
+    {
+        deliverBroadcast(reactor, broadcast->message, broadcast->room, broadcast->everyone, broadcast->sender);
+        if(broadcast->pending.fetch_sub(1, memory_order_acq_rel) == 1)
+        {
+            delete broadcast;
+        }
+    }
+}
+
+
+
+/*
+ *  Function: addClient
+ *  Parameters: a reference to a client table
+ *  Return: the handle of a new client slot
+ *  Description: This function takes the most recently freed slot, or appends a slot when every slot is in use, and adds it to the packed array of
+ *               slots in use. Slots are only allocated when the table grows past its size, never once per client. The handle holds the generation
+ *               in its upper 32 bits and the slot in its lower 32 bits.
+*/
+uint64_t addClient(clientTableStruct &clientTable)
+{
+    uint32_t slot;
+    if(clientTable.freeSlots.empty())
+    {
+        slot = clientTable.slots.size();
+        clientTable.slots.push_back(clientSocketStruct());
+        clientTable.slots[slot].generation = 0;
+    }
+    else
+    {
+        slot = clientTable.freeSlots.back();
+        clientTable.freeSlots.pop_back();
+    }
+
+    clientSocketStruct &clientSocket = clientTable.slots[slot];
+    clientSocket.socket = -1;
+    clientSocket.position = clientTable.used.size();
+    clientTable.used.push_back(slot);
+    return (uint64_t)clientSocket.generation << 32 | slot;
+}
+
+
+
+/*
+ *  Function: findClient
+ *  Parameters: a reference to a client table, the handle of a client
+ *  Return: pointer to the client, NULL if the handle is not a client or its slot has been freed since
+ *  Description: This function looks up a client by its handle in constant time. The pointer is valid until the next client is added.
+*/
+clientSocketStruct* findClient(clientTableStruct &clientTable, uint64_t handle)
+{
+    uint32_t slot = (uint32_t)handle;
+    if(slot >= clientTable.slots.size() || clientTable.slots[slot].generation != (uint32_t)(handle >> 32))
+    {
+        return NULL;
+    }
+    return &clientTable.slots[slot];
+}
+
+
+
+/*
+ *  Function: removeClient
+ *  Parameters: a reference to the reactor, the handle of a client
+ *  Return: None
+ *  Description: This function closes the client socket, which also removes it from epoll, takes it out of its room, cancels its timer, and
+ *               frees its slot in constant time. The last slot in the packed array takes the place of the removed one, and the generation of
+ *               the freed slot changes so the old handle stops matching.
+*/
+void removeClient(reactorStruct &reactor, uint64_t handle)
+{
+    clientTableStruct &clientTable = reactor.clientTable;
+    clientSocketStruct* clientSocket = findClient(clientTable, handle);
+    if(clientSocket == NULL)
+    {
+        return;
+    }
+    leaveRoom(reactor, (uint32_t)handle);
+    cancelTimer(reactor, (uint32_t)handle);
+    if(clientSocket->socket >= 0)
+    {
+        closeSocket(clientSocket);
+    }
+
+    // release the queued messages
+    outputQueueStruct &output = clientSocket->output;
+    for(; output.count > 0; output.count--)
+    {
+        output.segments[output.head].reset();
+        output.head = (output.head + 1) & (output.segments.size() - 1);
+    }
+    if(output.segments.size() > (size_t)OUTPUT_SEGMENTS)
+    {
+        // give back what a slow client grew the ring to, the next client of the slot starts small
+        vector<sharedMessage>().swap(output.segments);
+    }
+    output.head = 0;
+    output.offset = 0;
+    output.bytes = 0;
+
+    uint32_t slot = (uint32_t)handle;
+    uint32_t last = clientTable.used.back();
+    clientTable.used[clientSocket->position] = last;
+    clientTable.slots[last].position = clientSocket->position;
+    clientTable.used.pop_back();
+
+    clientSocket->generation++;
+    clientTable.freeSlots.push_back(slot);
+}
+
+
+
+/*
+ *  Function: raiseFileLimit
+ *  Parameters: None
+ *  Return: None
+ *  Description: This function raises the soft limit on open files to the hard limit, every client holds one descriptor.
+*/
+void raiseFileLimit()
+{
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+
+
+/*
+ *  Function: shedClient
+ *  Parameters: None
+ *  Return: true if a pending client was accepted and closed, false if no descriptor could be freed for it
+ *  Description: This function turns away the next pending client when the server is out of descriptors. The reserve descriptor is closed to
+ *               make room for the accept, the client is closed at once, and the reserve is opened again. The client sees its connection
+ *               closed instead of waiting in the backlog for a server that cannot take it.
+*/
+bool shedClient()
+{
+    if(reserveFile < 0)
+    {
+        return false;
+    }
+    close(reserveFile);
+
+    int socket = accept4(serverSocket, NULL, NULL, SOCK_CLOEXEC);
+    int error = errno;
+    if(socket >= 0)
+    {
+        close(socket);
+        MU_LOG(LEVEL_WARN, "out of file descriptors, a client was turned away.");
+    }
+
+    reserveFile = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    errno = error;
+    return socket >= 0;
+}
+
+
+
+/*
+ *  Function: bumpStat
+ *  Parameters: a reference to a reactor's counter, the amount to add
+ *  Return: None
+ *  Description: This function adds to a counter that only its own reactor writes. A plain load and store is enough and avoids a locked
+ *               instruction, other threads still read a whole value.
+*/
+void bumpStat(atomic<uint64_t> &counter, uint64_t amount)
+{
+    counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+
+
+/*
+ *  Function: markSlow
+ *  Parameters: a reference to the reactor, pointer to the client
+ *  Return: None
+ *  Description: This function counts a client that fell past the high watermark, whatever the slow client policy does about it. The client
+ *               is counted once until flushClient sees its queue drain.
+*/
+void markSlow(reactorStruct &reactor, clientSocketStruct* clientSocket)
+{
+    if(!clientSocket->slow)
+    {
+        clientSocket->slow = true;
+        bumpStat(reactor.stats.slow, 1);
+    }
+}
+
+
+
+/*
+ *  Function: growQueue
+ *  Parameters: a reference to a full output queue
+ *  Return: None
+ *  Description: This function doubles the ring of an output queue, or gives an empty one its first OUTPUT_SEGMENTS, and moves the queued
+ *               messages to its start in order. The messages are shared pointers, so only the pointers move.
+*/
+void growQueue(outputQueueStruct &output)
+{
+    vector<sharedMessage> segments(max<size_t>(OUTPUT_SEGMENTS, output.segments.size() * 2));
+    for(int i=0; i < output.count; i++)
+    {
+        segments[i] = move(output.segments[(output.head + i) & (output.segments.size() - 1)]);
+    }
+    output.segments.swap(segments);
+    output.head = 0;
+}
+
+
+
+/*
+ *  Function: monotonicMs
+ *  Parameters: None
+ *  Return: milliseconds of the monotonic clock
+ *  Description: This function reads the clock the timers run on, it does not jump when the wall clock is changed.
+*/
+uint64_t monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+
+/*
+ *  Function: scheduleTimer
+ *  Parameters: a reference to the reactor, the slot of the client, the tick the timer fires at
+ *  Return: None
+ *  Description: This function links the client's timer into the lowest level whose span covers the time left, in the bucket the tick maps to
+ *               on that level. A tick that has passed fires on the next tick, one beyond the wheel fires at its end.
+*/
+void scheduleTimer(reactorStruct &reactor, uint32_t slot, uint64_t expires)
+{
+    timerWheelStruct &timers = reactor.timers;
+    clientSocketStruct &clientSocket = reactor.clientTable.slots[slot];
+
+    expires = max(expires, timers.now + 1);
+    expires = min(expires, timers.now + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1);
+    int level = 0;
+    while((expires - timers.now) >> (WHEEL_BITS * (level + 1)))
+    {
+        level++;
+    }
+    int index = (expires >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+
+    uint32_t &head = timers.buckets[level][index];
+    clientSocket.expires = expires;
+    clientSocket.timerBucket = level * WHEEL_SIZE + index;
+    clientSocket.timerPrev = NO_SLOT;
+    clientSocket.timerNext = head;
+    if(head != NO_SLOT)
+    {
+        reactor.clientTable.slots[head].timerPrev = slot;
+    }
+    head = slot;
+    clientSocket.timerArmed = true;
+    timers.count++;
+}
+
+
+
+/*
+ *  Function: cancelTimer
+ *  Parameters: a reference to the reactor, the slot of the client
+ *  Return: None
+ *  Description: This function unlinks the client's timer from its bucket, if it is armed.
+*/
+void cancelTimer(reactorStruct &reactor, uint32_t slot)
+{
+    vector<clientSocketStruct> &slots = reactor.clientTable.slots;
+    clientSocketStruct &clientSocket = slots[slot];
+    if(!clientSocket.timerArmed)
+    {
+        return;
+    }
+
+    if(clientSocket.timerPrev != NO_SLOT)
+    {
+        slots[clientSocket.timerPrev].timerNext = clientSocket.timerNext;
+    }
+    else
+    {
+        reactor.timers.buckets[clientSocket.timerBucket / WHEEL_SIZE][clientSocket.timerBucket % WHEEL_SIZE] = clientSocket.timerNext;
+    }
+    if(clientSocket.timerNext != NO_SLOT)
+    {
+        slots[clientSocket.timerNext].timerPrev = clientSocket.timerPrev;
+    }
+    clientSocket.timerArmed = false;
+    reactor.timers.count--;
+}
+
+
+
+/*
+ *  Function: cascadeTimers
+ *  Parameters: a reference to the reactor, the level to cascade
+ *  Return: None
+ *  Description: This function empties the bucket of a level that the current tick has reached and schedules its timers again, which moves each
+ *               of them down to the level that now covers it.
+*/
+void cascadeTimers(reactorStruct &reactor, int level)
+{
+    timerWheelStruct &timers = reactor.timers;
+    uint32_t &head = timers.buckets[level][(timers.now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+    uint32_t slot = head;
+    head = NO_SLOT;
+
+    while(slot != NO_SLOT)
+    {
+        clientSocketStruct &clientSocket = reactor.clientTable.slots[slot];
+        uint32_t next = clientSocket.timerNext;
+        timers.count--;
+        scheduleTimer(reactor, slot, clientSocket.expires);
+        slot = next;
+    }
+}
+
+
+
+/*
+ *  Function: advanceTimers
+ *  Parameters: a reference to the reactor
+ *  Return: None
+ *  Description: This function moves the wheel tick by tick up to the reactor's clock. Whenever a level wraps around, the next level up
+ *               cascades, and the timers in the bucket of every tick passed fire. The bucket is detached before the timers fire, so a timer
+ *               can schedule itself again or remove its client.
+*/
+void advanceTimers(reactorStruct &reactor)
+{
+    timerWheelStruct &timers = reactor.timers;
+    uint64_t target = reactor.now / TICK_MS;
+
+    while(timers.now < target)
+    {
+        // with nothing armed there is nothing to pass on the way
+        if(timers.count == 0)
+        {
+            timers.now = target;
+            return;
+        }
+
+        timers.now++;
+        for(int level=1; level < WHEEL_LEVELS && (timers.now >> (WHEEL_BITS * (level - 1))) % WHEEL_SIZE == 0; level++)
+        {
+            cascadeTimers(reactor, level);
+        }
+
+        uint32_t &head = timers.buckets[0][timers.now & (WHEEL_SIZE - 1)];
+        uint32_t slot = head;
+        head = NO_SLOT;
+        while(slot != NO_SLOT)
+        {
+            clientSocketStruct &clientSocket = reactor.clientTable.slots[slot];
+            uint32_t next = clientSocket.timerNext;
+            clientSocket.timerArmed = false;
+            timers.count--;
+            expireClient(reactor, slot);
+            slot = next;
+        }
+    }
+}
+
+
+
+/*
+ *  Function: nextTimeout
+ *  Parameters: a reference to the reactor
+ *  Return: milliseconds epoll_wait() may block, -1 if no timer is armed
+ *  Description: This function finds the next tick of the lowest level that has a timer. When the lowest level is empty the wait ends when it
+ *               wraps around, where the next level cascades.
+*/
+int nextTimeout(reactorStruct &reactor)
+{
+    timerWheelStruct &timers = reactor.timers;
+    if(timers.count == 0)
+    {
+        return -1;
+    }
+
+    uint64_t ticks = WHEEL_SIZE - (timers.now & (WHEEL_SIZE - 1));
+    for(uint64_t i=1; i < ticks; i++)
+    {
+        if(timers.buckets[0][(timers.now + i) & (WHEEL_SIZE - 1)] != NO_SLOT)
+        {
+            ticks = i;
+            break;
+        }
+    }
+
+    uint64_t due = (timers.now + ticks) * TICK_MS;
+    uint64_t now = monotonicMs();
+    return due > now ? due - now : 0;
+}
+
+
+
+/*
+ *  Function: scheduleClient
+ *  Parameters: a reference to the reactor, the slot of the client
+ *  Return: None
+ *  Description: This function arms the client's timer for the earliest of its handshake deadline, idle timeout and next keepalive. A client
+ *               with none of them left has no timer.
+*/
+void scheduleClient(reactorStruct &reactor, uint32_t slot)
+{
+    clientSocketStruct &clientSocket = reactor.clientTable.slots[slot];
+    uint64_t deadline = UINT64_MAX;
+
+    if(!clientSocket.greeted && options.handshakeTimeout > 0)
+    {
+        deadline = min(deadline, clientSocket.connected + options.handshakeTimeout);
+    }
+    if(options.idleTimeout > 0)
+    {
+        deadline = min(deadline, clientSocket.lastActivity + options.idleTimeout);
+    }
+    if(options.keepalive > 0)
+    {
+        deadline = min(deadline, max(clientSocket.lastActivity, clientSocket.lastKeepalive) + options.keepalive);
+    }
+
+    cancelTimer(reactor, slot);
+    if(deadline != UINT64_MAX)
+    {
+        scheduleTimer(reactor, slot, (deadline + TICK_MS - 1) / TICK_MS);
+    }
+}
+
+
+
+/*
+ *  Function: expireClient
+ *  Parameters: a reference to the reactor, the slot of the client whose timer fired
+ *  Return: None
+ *  Description: This function closes a client that missed its handshake deadline or has been idle too long, or sends KEEPALIVE to a client
+ *               that has been silent for the keepalive interval. Activity since the timer was armed only moves the deadline, the timer is
+ *               armed again for it.
+*/
+void expireClient(reactorStruct &reactor, uint32_t slot)
+{
+    clientSocketStruct* clientSocket = &reactor.clientTable.slots[slot];
+    uint64_t handle = (uint64_t)clientSocket->generation << 32 | slot;
+    uint64_t now = reactor.now;
+
+    if(!clientSocket->greeted && options.handshakeTimeout > 0 && now >= clientSocket->connected + options.handshakeTimeout)
+    {
+        MU_LOG(LEVEL_WARN, "client %d did not answer the handshake, disconnecting.", clientSocket->id);
+        bumpStat(reactor.stats.expired, 1);
+        removeClient(reactor, handle);
+        return;
+    }
+    if(options.idleTimeout > 0 && now >= clientSocket->lastActivity + options.idleTimeout)
+    {
+        MU_LOG(LEVEL_WARN, "client %d has been idle too long, disconnecting.", clientSocket->id);
+        bumpStat(reactor.stats.expired, 1);
+        removeClient(reactor, handle);
+        return;
+    }
+    if(options.keepalive > 0 && now >= max(clientSocket->lastActivity, clientSocket->lastKeepalive) + options.keepalive)
+    {
+        clientSocket->lastKeepalive = now;
+        if(!queueMessage(reactor, handle, clientSocket, keepaliveMessage))
+        {
+            removeClient(reactor, handle);
+            return;
+        }
+    }
+
+    scheduleClient(reactor, slot);
+}
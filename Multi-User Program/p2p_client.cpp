@@ -6,6 +6,9 @@
 *           to the server listening on the socket file. After a handshake with the server, the socket sends commands
 *           to the server until the command 'quit' is entered. After the client sends the 'quit' command, the client 
 *           closes the socket and ends the program.
+*           Records from the server end in a null character and a read can hold several of them, so reads are split into records.
+*           Anything but ENTERCMD, such as what other clients say in the server's broadcast mode, is printed as it arrives, KEEPALIVE
+*           is ignored, and the next command is sent once ENTERCMD has answered the last one.
 * Help: While writting this file, I followed along the material provided in Module 2.
 * Compilation: g++ -c p2p_client.cpp
 *              g++ -o p2p_client p2p_client.o
@@ -15,6 +18,16 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
+#include <poll.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <algorithm>
+
+
+/* Function Prototypes */
+ssize_t receiveBytes(int, std::string&);
+bool takeRecord(std::string&, std::string&);
 
 
 int main(int argc, char* argv[])
@@ -55,38 +68,40 @@ int main(int argc, char* argv[])
 
 
     /* HANDSHAKE PROTOCOL */
-    char writeBuffer[100];      // write buffer to be used
-    char readBuffer[100];       // read buffer to be used
+    char writeBuffer[100];      // write buffer to be used, every command is sent as one 100 byte record
+    std::string received;       // bytes read from the server that do not yet end a record
+    std::string console;        // text typed on the console that does not yet end a line
+    std::string record;
     ssize_t bytes;
 
     // read initial response from the server, and see if the connection was successful
     // -- 0 bytes returned indicates the server has closed the connection.
     // -- negative bytes returned indicates there was an error reading data from the server
-    bytes = read(clientSock, readBuffer, sizeof(readBuffer));
-    if(bytes == 0)
-    {
-        std::cout << "The socket has been closed by the server..." << std::endl;
-        close(clientSock);
-        return 0;
-    }
-    else if(bytes < 0)
-    {
-        std::cout << "There was en error reading from the socket..." << std::endl;
-        close(clientSock);
-        return -1;
-    }
-    else
+    while(!takeRecord(received, record))
     {
-        readBuffer[bytes] = '\0';
-        std::cout << "Server says '";
-        std::cout << readBuffer;
-        std::cout << "'" << std::endl;
+        bytes = receiveBytes(clientSock, received);
+        if(bytes == 0)
+        {
+            std::cout << "The socket has been closed by the server..." << std::endl;
+            close(clientSock);
+            return 0;
+        }
+        else if(bytes < 0)
+        {
+            std::cout << "There was en error reading from the socket..." << std::endl;
+            close(clientSock);
+            return -1;
+        }
     }
+    std::cout << "Server says '";
+    std::cout << record;
+    std::cout << "'" << std::endl;
 
 
     // write handshake response to the server.
     // -- 0 bytes returned indicates the server has closed the connection.
     // -- negative bytes returned indicates there was an error sending data to the server
+    memset(writeBuffer, 0, sizeof(writeBuffer));
     strcpy(writeBuffer, "THANKS");
     bytes = write(clientSock, writeBuffer, sizeof(writeBuffer));
     if(bytes == 0)
@@ -101,57 +116,158 @@ int main(int argc, char* argv[])
         close(clientSock);
         return -1;
     }
-    
+
 
     // handshake protocol is now validated. Loop to send commands from server can now be started.
+    // The server answers every command with ENTERCMD, and in between it may relay what other clients say or send KEEPALIVE. The
+    // socket and the console are watched together, so relayed records are printed as they arrive, and the next command is only
+    // taken once the last one has been answered.
+    bool answered = false;      // the last command sent (the handshake at first) has its ENTERCMD
     while(true)
     {
-        // read command text from the server
-        bytes = read(clientSock, readBuffer, sizeof(readBuffer));
-        if(bytes == 0)
+        // print every whole record received, ENTERCMD asks for the next command
+        while(takeRecord(received, record))
         {
-            std::cout << "The socket was closed by the server..." << std::endl;
-            break;
-        }
-        else if(bytes < 0)
-        {
-            std::cout << "There was an error reading from the socket..." << std::endl;
-            break;
+            if(record == "ENTERCMD")
+            {
+                answered = true;
+                std::cout << record << ": " << std::flush;
+            }
+            else if(record != "KEEPALIVE")
+            {
+                std::cout << std::endl << record << std::endl;
+                if(answered)
+                {
+                    std::cout << "ENTERCMD: " << std::flush;
+                }
+            }
         }
-        else
+
+        // send the next typed command once the last one was answered
+        size_t newline = console.find('\n');
+        if(answered && newline != std::string::npos)
         {
-            readBuffer[bytes] = '\0';
-            std::cout << readBuffer << ": ";
-        }
+            memset(writeBuffer, 0, sizeof(writeBuffer));
+            console.copy(writeBuffer, std::min(newline, sizeof(writeBuffer) - 1));
+            console.erase(0, newline + 1);
 
-        // get command text from console
-        std::cin.getline(writeBuffer, sizeof(writeBuffer));
+            // write command to the server
+            bytes = write(clientSock, writeBuffer, sizeof(writeBuffer));
+            if(bytes == 0)
+            {
+                std::cout << "The socket was closed by the server..." << std::endl;
+                break;
+            }
+            else if(bytes < 0)
+            {
+                std::cout << "There was an error writting to the socket..." << std::endl;
+                break;
+            }
 
-        // write command to the server
-        bytes = write(clientSock, writeBuffer, sizeof(writeBuffer));
-        if(bytes == 0)
-        {
-            std::cout << "The socket was closed by the server..." << std::endl;
-            break;
+            // If the command 'quit' has been sent, then exit the client.
+            if(strcmp(writeBuffer, "quit") == 0)
+            {
+                std::cout << "Quitting!" << std::endl;
+                break;
+            }
+            answered = false;
+            continue;
         }
-        else if(bytes < 0)
+
+        // wait for the server, and for the console while a command can be sent
+        struct pollfd pfd[2];
+        pfd[0].fd = clientSock;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = answered ? STDIN_FILENO : -1;
+        pfd[1].events = POLLIN;
+        if(poll(pfd, 2, -1) < 0)
         {
-            std::cout << "There was an error writting to the socket..." << std::endl;
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            std::cout << "There was an error waiting for the server..." << std::endl;
             break;
         }
-        else
+
+        // read command text from the server
+        if(pfd[0].revents != 0)
         {
-            // If the command 'quit' has been sent, then exit the client.
-            if(strcmp(writeBuffer, "quit") == 0)
+            bytes = receiveBytes(clientSock, received);
+            if(bytes == 0)
             {
-                std::cout << "Quitting!" << std::endl;
+                std::cout << "The socket was closed by the server..." << std::endl;
+                break;
+            }
+            else if(bytes < 0)
+            {
+                std::cout << "There was an error reading from the socket..." << std::endl;
                 break;
             }
         }
+
+        // get command text from console, the end of the input quits
+        if(pfd[1].revents != 0 && receiveBytes(STDIN_FILENO, console) <= 0)
+        {
+            console += "quit\n";
+        }
     }
 
     // close the client socket
     close(clientSock);
 
     return 0;
-}
\ No newline at end of file
+}
+
+
+
+/*
+ * Function: receiveBytes
+ * Parameters: a descriptor to read from, a reference to the string that collects what was read
+ * Return: the number of bytes read, 0 at the end of the input, -1 on error
+ * Description: This function reads what is waiting on the descriptor once and appends it to the string.
+*/
+ssize_t receiveBytes(int fd, std::string& collected)
+{
+    char buffer[4096];
+    ssize_t bytes;
+    do
+    {
+        bytes = read(fd, buffer, sizeof(buffer));
+    }
+    while(bytes < 0 && errno == EINTR);
+
+    if(bytes > 0)
+    {
+        collected.append(buffer, bytes);
+    }
+    return bytes;
+}
+
+
+
+/*
+ * Function: takeRecord
+ * Parameters: a reference to the bytes received, a reference to a string to store the record
+ * Return: true if a whole record was taken, false if the bytes do not hold one yet
+ * Description: The server ends every record with a null character, and several records can arrive in one read. A 100 byte command
+ *              record carries padding after its null character, which is skipped here as empty records.
+*/
+bool takeRecord(std::string& received, std::string& record)
+{
+    for(;;)
+    {
+        size_t end = received.find('\0');
+        if(end == std::string::npos)
+        {
+            return false;
+        }
+
+        record.assign(received, 0, end);
+        received.erase(0, end + 1);
+        if(!record.empty())
+        {
+            return true;
+        }
+    }
+}
@@ -5,31 +5,187 @@
 *           command line argument, which is the socket file to use. The client initializes a socket and connects 
 *           to the server listening on the socket file. After a handshake with the server, the socket sends commands
 *           to the server until the command 'quit' is entered. After the client sends the 'quit' command, the client 
-*           closes the socket and ends the program.
+*           closes the socket and ends the program. The end of standard input is treated as 'quit'.
+*           The console and the socket are watched together with poll, so server messages are printed the moment they arrive
+*           and typed commands are queued and written without waiting for the server. A piped script is read in large chunks
+*           and its commands are written many at a time, which makes the client a fast scripted driver as well.
+*           The server can also be reached by an abstract socket name ('@name') or over TCP ('tcp:host:port'), the benchmarks print
+*           the transport so the three can be compared.
+*           Messages are framed with a length prefix (see p2p_protocol.h), so commands can be any length up to the maximum
+*           message size and partial or coalesced reads are reassembled into whole messages.
+*           With --pipeline n the client asks the server for pipelined mode during the handshake. Commands are then sent back to
+*           back without waiting for ENTERCMD, and the server acknowledges them cumulatively with 'ACK <count>' every n commands
+*           or when the client pauses. --bench-commands n sends n commands as fast as the chosen mode allows and prints the
+*           number of commands per second.
+*           In the classic mode 'send <path>' uploads a file to the server's working directory and 'get <name>' downloads a file
+*           of the server's working directory into the client's working directory. The file follows its header as raw bytes, sent with sendfile
+*           and received by splicing into a preallocated file, and the throughput is printed when it is done.
+*           'fds <path> [<path> ...]' opens up to 253 files and passes the open descriptors to the server in one message
+*           (SCM_RIGHTS). The server reads the files through the descriptors, so no file data crosses the connection.
+*           --bench-fds <file> compares copying the file through the connection with passing its descriptor, and measures the
+*           cost per descriptor when passing one or many descriptors per message.
+*           --bench-latency n sends n timestamped 'echo' commands one at a time. The server sends each one straight back and the
+*           round trip times are printed as percentiles. --busy-poll spins on reads instead of blocking and --cpu n pins the client
+*           to one CPU, start the server with the same options to measure both ends the same way.
+*           --seqpacket connects with SOCK_SEQPACKET instead of SOCK_STREAM (the server must use it too). Every message is then one
+*           record without a length prefix, up to 64 KB. 'send', 'get' and --bench-fds need the stream transport. The benchmarks
+*           print the transport they ran over, so both can be compared.
+*           --bench-throughput <MB> streams messages from 16 bytes to 1 MB to the server as fast as possible, about MB megabytes
+*           per size (at most 100000 messages). Every size is run with several send buffer sizes, and with one write per message
+*           or P2P_BATCH messages per gathering sendmsg. MB/s and messages/sec are printed for every configuration.
+*           --shm <bytes> offers the server a shared memory ring of that size in the handshake (AF_UNIX only). Once the server
+*           agrees, messages go through the ring and the socket only carries file bytes and notices a server that goes away.
+*           Descriptors cannot be passed while the ring is in use.
+*           --binary makes --bench-commands and --bench-latency send their commands in the binary format of p2p_command.h instead
+*           of text, to compare what parsing costs the server.
 * Help: While writting this file, I followed along the material provided in Module 2.
 * Compilation: g++ -c p2p_client.cpp
 *              g++ -o p2p_client p2p_client.o
+* Usage: ./p2p_client <socket file> [--max-message bytes] [--pipeline n] [--bench-commands n] [--bench-fds file]
+*                                    [--bench-latency n] [--busy-poll] [--cpu n] [--seqpacket] [--bench-throughput MB]
+*                                    [--shm bytes] [--binary]
 */
 
 #include <iostream>
+#include <string>
+#include <chrono>
+#include <sstream>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
+#include "p2p_protocol.h"
+#include "p2p_command.h"
+
+
+/* Commands typed or piped in, waiting to be written to the server */
+struct sendQueue
+{
+    std::deque<std::string> messages;   // framed messages in the order they were entered
+    size_t offset;                      // bytes of the first message already written
+};
+
+
+/* Function Prototypes */
+int commandLoop(P2PConnection&, bool);
+int readServer(P2PConnection&, bool, int&, uint64_t&);
+int flushQueue(P2PConnection&, sendQueue&);
+int runTransfer(P2PConnection&, sendQueue&, int&, const std::string&);
+int waitEvents(P2PConnection&, const sendQueue&, int, bool&, bool&);
+int benchCommands(P2PConnection&, bool, size_t, bool);
+int readAcks(P2PConnection&, uint64_t&, int);
+int uploadFile(P2PConnection&, const std::string&);
+int downloadFile(P2PConnection&, const std::string&);
+int passFiles(P2PConnection&, const std::string&);
+int transferFile(P2PConnection&, const std::string&);
+bool isTransfer(const std::string&);
+int benchDescriptors(P2PConnection&, const char*);
+int benchLatency(P2PConnection&, size_t, bool);
+int benchThroughput(P2PConnection&, size_t);
+double timeStream(P2PConnection&, const char*, size_t, size_t, bool);
+double timeCommand(P2PConnection&, const std::string&, const int*, int, int);
 
 
 int main(int argc, char* argv[])
 {
     // Validate the socket file command line argument to ensure the client will have a file to attempt to connect to.
-    if(argc != 2)
+    if(argc < 2)
     {
         std::cout << "Expecting a single command line argument, which is the socket file to use." << std::endl;
-        std::cout << "i.e: ./p2p_client socketFile.sock" << std::endl;
+        std::cout << "i.e: ./p2p_client socketFile.sock [--max-message bytes] [--pipeline n] [--bench-commands n] [--bench-fds file]" << std::endl;
+        std::cout << "                                  [--bench-latency n] [--busy-poll] [--cpu n] [--seqpacket] [--bench-throughput MB]" << std::endl;
+        std::cout << "                                  [--shm bytes] [--binary]" << std::endl;
+        return -1;
+    }
+
+
+    // Validate the options, the numbers must be positive.
+    size_t maxMessage = P2P_DEFAULT_MAX_MESSAGE;
+    size_t pipeline = 0;        // commands per acknowledgement, 0 keeps the classic ENTERCMD mode
+    size_t benchCount = 0;      // commands to send in benchmark mode
+    char* benchFile = NULL;     // file used by the descriptor passing benchmark
+    size_t latencyCount = 0;    // round trips to time in the latency benchmark
+    size_t throughputMB = 0;    // megabytes per message size in the throughput benchmark
+    size_t sharedSize = 0;      // shared memory to offer for the rings, 0 keeps messages on the socket
+    bool busyPoll = false;      // spin on reads instead of blocking
+    bool binary = false;        // benchmark commands use the binary format
+    int type = SOCK_STREAM;     // socket type, SOCK_SEQPACKET keeps message boundaries
+    for(int i = 2; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--max-message") == 0 && i + 1 < argc && parseSize(argv[i+1]) > 0)
+        {
+            maxMessage = parseSize(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc && parseSize(argv[i+1]) > 0)
+        {
+            pipeline = parseSize(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--bench-commands") == 0 && i + 1 < argc && parseSize(argv[i+1]) > 0)
+        {
+            benchCount = parseSize(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--bench-fds") == 0 && i + 1 < argc)
+        {
+            benchFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--bench-latency") == 0 && i + 1 < argc && parseSize(argv[i+1]) > 0)
+        {
+            latencyCount = parseSize(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--bench-throughput") == 0 && i + 1 < argc && parseSize(argv[i+1]) > 0)
+        {
+            throughputMB = parseSize(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--shm") == 0 && i + 1 < argc && parseSize(argv[i+1]) >= P2P_MIN_SHARED)
+        {
+            sharedSize = parseSize(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--busy-poll") == 0)
+        {
+            busyPoll = true;
+        }
+        else if(strcmp(argv[i], "--seqpacket") == 0)
+        {
+            type = SOCK_SEQPACKET;
+        }
+        else if(strcmp(argv[i], "--binary") == 0)
+        {
+            binary = true;
+        }
+        else if(strcmp(argv[i], "--cpu") == 0 && i + 1 < argc)
+        {
+            if(pinCpu(argv[++i]) < 0)
+            {
+                std::cout << "Could not pin the client to CPU " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else
+        {
+            std::cout << "Unknown or incomplete option " << argv[i] << std::endl;
+            return -1;
+        }
+    }
+
+
+    if(benchFile != NULL && type == SOCK_SEQPACKET)
+    {
+        std::cout << "--bench-fds copies the file as raw bytes, which needs the stream transport." << std::endl;
+        return -1;
+    }
+
+
+    // Initialize the address structure from the socket file, abstract name, or TCP address.
+    P2PAddress address;
+    if(resolveAddress(argv[1], type, address) < 0)
+    {
+        std::cout << "Invalid address " << argv[1] << ", TCP addresses are tcp:host:port and carry SOCK_STREAM only..." << std::endl;
         return -1;
     }
 
 
     // Initialize a new socket to be used by the client, if the return value is negative then there are errors.
-    int clientSock = socket(AF_UNIX, SOCK_STREAM, 0);
+    int clientSock = openSocket(address, type);
     if(clientSock < 0)
     {
         std::cout << "Could not initialize socket..." << std::endl;
@@ -37,14 +193,8 @@ int main(int argc, char* argv[])
     }
 
 
-    // Initialize the un sockaddress structure. This decorates the AF_UNIX socket to be later bound by the OS. 
-    struct sockaddr_un un;
-    un.sun_family = AF_UNIX;
-    strncpy(un.sun_path, argv[1], sizeof(un.sun_path) - 1);
-
-
     // Attempt to connect to the server, if the return value is negative then there are errors.
-    int result = connect(clientSock, (const struct sockaddr*)&un, sizeof(un));
+    int result = connect(clientSock, (const struct sockaddr*)&address.storage, address.length);
     if(result < 0)
     {
         std::cout << "Error connecting the socket..." << std::endl;
@@ -54,14 +204,17 @@ int main(int argc, char* argv[])
 
 
     /* HANDSHAKE PROTOCOL */
-    char writeBuffer[100];      // write buffer to be used
-    char readBuffer[100];       // read buffer to be used
+    P2PConnection conn;         // framed connection to the server
+    std::string writeBuffer;    // message to send
+    std::string readBuffer;     // message received
     ssize_t bytes;
+    initConnection(conn, clientSock, maxMessage);
+    conn.busyPoll = busyPoll;
 
     // read initial response from the server, and see if the connection was successful
     // -- 0 bytes returned indicates the server has closed the connection.
     // -- negative bytes returned indicates there was an error reading data from the server
-    bytes = read(clientSock, readBuffer, sizeof(readBuffer));
+    bytes = recvMessage(conn, readBuffer);
     if(bytes == 0)
     {
         std::cout << "The socket has been closed by the server..." << std::endl;
@@ -76,18 +229,37 @@ int main(int argc, char* argv[])
     }
     else
     {
-        readBuffer[bytes] = '\0';
         std::cout << "Server says '";
         std::cout << readBuffer;
         std::cout << "'" << std::endl;
     }
 
 
-    // write handshake response to the server.
+    // write handshake response to the server, asking for the pipelined mode if it was chosen, and offering the shared ring
+    // with its memory and eventfds attached.
     // -- 0 bytes returned indicates the server has closed the connection.
     // -- negative bytes returned indicates there was an error sending data to the server
-    strcpy(writeBuffer, "THANKS");
-    bytes = write(clientSock, writeBuffer, sizeof(writeBuffer));
+    writeBuffer = "THANKS";
+    if(pipeline > 0)
+    {
+        writeBuffer += " PIPELINE " + std::to_string(pipeline);
+    }
+    int sharedFds[3];
+    int sharedCount = 0;
+    if(sharedSize > 0 && (conn.tcp || openShared(conn, sharedSize, sharedFds) < 0))
+    {
+        std::cout << "Could not create the shared memory ring, messages stay on the socket." << std::endl;
+    }
+    else if(sharedSize > 0)
+    {
+        writeBuffer += " SHM " + std::to_string(sharedSize);
+        sharedCount = 3;
+    }
+    bytes = sendMessage(conn, writeBuffer, sharedFds, sharedCount);
+    if(sharedCount > 0)
+    {
+        close(sharedFds[0]);
+    }
     if(bytes == 0)
     {
         std::cout << "The socket has been closed by the server..." << std::endl;
@@ -100,57 +272,1023 @@ int main(int argc, char* argv[])
         close(clientSock);
         return -1;
     }
+
+    // the server answers the offer over the socket
+    if(sharedCount > 0)
+    {
+        if(recvMessage(conn, readBuffer) <= 0)
+        {
+            std::cout << "The socket has been closed by the server..." << std::endl;
+            close(clientSock);
+            return -1;
+        }
+        if(readBuffer == "SHM")
+        {
+            startShared(conn, true);
+        }
+        else
+        {
+            std::cout << "The server declined the shared memory ring, messages stay on the socket." << std::endl;
+            closeShared(conn);
+        }
+    }
     
 
-    // handshake protocol is now validated. Loop to send commands from server can now be started.
-    while(true)
+    // handshake protocol is now validated. Commands can now be sent in the negotiated mode.
+    int status;
+    if(throughputMB > 0 && pipeline == 0)
     {
-        // read command text from the server
-        bytes = read(clientSock, readBuffer, sizeof(readBuffer));
-        if(bytes == 0)
+        status = benchThroughput(conn, throughputMB);
+    }
+    else if(latencyCount > 0 && pipeline == 0)
+    {
+        status = benchLatency(conn, latencyCount, binary);
+    }
+    else if(benchFile != NULL && pipeline == 0)
+    {
+        status = benchDescriptors(conn, benchFile);
+    }
+    else if(benchCount > 0)
+    {
+        status = benchCommands(conn, pipeline > 0, benchCount, binary);
+    }
+    else if(pipeline > 0)
+    {
+        status = commandLoop(conn, true);
+    }
+    else
+    {
+        status = commandLoop(conn, false);
+    }
+
+    // close the client socket
+    close(clientSock);
+
+    return status;
+}
+
+
+
+/*
+ * Function: commandLoop
+ * Parameters: a reference to the connection, true for the pipelined mode
+ * Return: 0 when the client quit or the server closed the socket, -1 on error
+ * Description: This function waits on the console and the socket at the same time with poll. Console input is split into lines,
+ *              every line is queued as a message and the queue is written with as few system calls as possible, while server
+ *              messages are printed as soon as they arrive. In the classic mode every server message is printed as a prompt, in
+ *              the pipelined mode acknowledgements are counted. The console is not read while MAX_QUEUED commands are waiting, so a
+ *              fast script is held back by the server instead of filling memory. 'quit' (or the end of input) is the last command,
+ *              the loop ends once the server has answered every command before it, so the server never writes to a closed socket.
+*/
+int commandLoop(P2PConnection& conn, bool pipelined)
+{
+    const size_t MAX_QUEUED = 1024;     // commands waiting to be written before the console is left alone
+
+    sendQueue queue;            // commands to write
+    queue.offset = 0;
+    std::string input;          // console bytes not yet split into lines
+    std::vector<char> chunk(P2P_READ_SIZE);
+    int pending = pipelined ? 0 : 1;    // classic mode: messages the server still owes, starting with the first ENTERCMD, 'quit' is not answered
+    uint64_t sent = 0;          // commands queued
+    uint64_t acked = 0;         // commands acknowledged by the server
+    bool quitting = false;      // 'quit' was queued
+    bool busyPoll = conn.busyPoll;
+
+    // the socket is only read when it has something to read
+    conn.busyPoll = false;
+    setBlocking(conn, false);
+
+    int status = 1;
+    while(status == 1)
+    {
+        bool server;
+        bool console;
+        status = waitEvents(conn, queue, quitting || queue.messages.size() >= MAX_QUEUED ? -1 : STDIN_FILENO, server, console);
+        if(status < 0)
         {
-            std::cout << "The socket was closed by the server..." << std::endl;
             break;
         }
-        else if(bytes < 0)
+
+        // print or count what the server sent
+        if(server)
         {
-            std::cout << "There was an error reading from the socket..." << std::endl;
+            int result = readServer(conn, pipelined, pending, acked);
+            if(result == 0 && !(quitting && queue.messages.empty() && (pipelined ? acked >= sent : pending <= 0)))
+            {
+                std::cout << "The socket was closed by the server..." << std::endl;
+                status = pipelined ? -1 : 0;
+                break;
+            }
+            else if(result < 0)
+            {
+                std::cout << "There was an error reading from the socket: " << strerror(errno) << std::endl;
+                status = -1;
+                break;
+            }
+        }
+
+        // split the console input into commands, the end of input quits
+        if(console)
+        {
+            ssize_t bytes = read(STDIN_FILENO, chunk.data(), chunk.size());
+            if(bytes < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(bytes > 0)
+            {
+                input.append(chunk.data(), bytes);
+            }
+            else
+            {
+                input += input.empty() ? "quit\n" : "\nquit\n";
+            }
+
+            size_t start = 0;
+            size_t newline;
+            while(status == 1 && !quitting && (newline = input.find('\n', start)) != std::string::npos)
+            {
+                std::string command = input.substr(start, newline - start);
+                start = newline + 1;
+
+                // file transfers are not queued, they run once the server is waiting for a command
+                if(isTransfer(command))
+                {
+                    status = pipelined ? 1 : runTransfer(conn, queue, pending, command);
+                    if(pipelined)
+                    {
+                        std::cout << "File transfers are only available in the classic mode." << std::endl;
+                    }
+                    continue;
+                }
+
+                queue.messages.push_back(frameMessage(conn, command));
+                sent++;
+                quitting = command == "quit";
+                pending += pipelined || quitting ? 0 : 1;
+            }
+            input.erase(0, start);
+            if(status < 1)
+            {
+                std::cout << "There was an error transferring a file over the socket..." << std::endl;
+                break;
+            }
+        }
+
+        // write as much of the queue as the socket takes
+        if(!queue.messages.empty() && flushQueue(conn, queue) < 0)
+        {
+            std::cout << "There was an error writting to the socket..." << std::endl;
+            status = -1;
             break;
         }
+
+        // the quit was written and every command before it answered, or in the pipelined mode acknowledged
+        if(quitting && queue.messages.empty() && (pipelined ? acked >= sent : pending <= 0))
+        {
+            std::cout << "Quitting!";
+            if(pipelined)
+            {
+                std::cout << " " << acked << " command(s) acknowledged.";
+            }
+            std::cout << std::endl;
+            status = 0;
+        }
+    }
+
+    setBlocking(conn, true);
+    conn.busyPoll = busyPoll;
+    return status;
+}
+
+
+
+/*
+ * Function: readServer
+ * Parameters: a reference to the non-blocking connection, true for the pipelined mode, a reference to the number of messages the
+ *             server owes in the classic mode, a reference to the acknowledged count
+ * Return: 1 when every available message was handled, 0 if the server closed the socket, -1 on error
+ * Description: This function handles the server messages that arrived. In the classic mode every message is printed as a prompt and
+ *              settles one command. In the pipelined mode 'ACK <count>' updates the acknowledged count and anything else is printed.
+*/
+int readServer(P2PConnection& conn, bool pipelined, int& pending, uint64_t& acked)
+{
+    std::string readBuffer;
+
+    for(;;)
+    {
+        ssize_t bytes = recvMessage(conn, readBuffer);
+        if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return 1;
+        }
+        if(bytes <= 0)
+        {
+            return bytes;
+        }
+
+        if(!pipelined)
+        {
+            pending--;
+            std::cout << readBuffer << ": " << std::flush;
+        }
+        else if(readBuffer.compare(0, 4, "ACK ") == 0)
+        {
+            acked = strtoull(readBuffer.c_str() + 4, NULL, 10);
+        }
         else
         {
-            readBuffer[bytes] = '\0';
-            std::cout << readBuffer << ": ";
+            std::cout << "Server says '" << readBuffer << "'" << std::endl;
         }
+    }
+}
+
 
-        // get command text from console
-        std::cin.getline(writeBuffer, sizeof(writeBuffer));
 
-        // write command to the server
-        bytes = write(clientSock, writeBuffer, sizeof(writeBuffer));
+/*
+ * Function: flushQueue
+ * Parameters: a reference to the non-blocking connection, a reference to the queue
+ * Return: 1 when the queue is empty, 0 if the socket is full, -1 on error
+ * Description: This function writes up to P2P_BATCH queued messages per system call, a gathering write like writev that does not
+ *              raise SIGPIPE. Written messages are removed and a partly written one is remembered by its offset. On a SOCK_SEQPACKET
+ *              socket every message is its own record and is written alone.
+*/
+int flushQueue(P2PConnection& conn, sendQueue& queue)
+{
+    // the ring takes what fits, the peer is woken once
+    if(conn.sendRing != NULL)
+    {
+        bool pushed = false;
+        while(!queue.messages.empty() && ringPush(conn.sendRing, conn.ringCapacity, queue.messages.front().data(), queue.messages.front().size()))
+        {
+            queue.messages.pop_front();
+            pushed = true;
+        }
+        if(pushed)
+        {
+            ringSignal(conn);
+        }
+        if(!queue.messages.empty() && queue.messages.front().size() + P2P_HEADER_SIZE > conn.ringCapacity)
+        {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        return queue.messages.empty() ? 1 : 0;
+    }
+
+    while(!queue.messages.empty())
+    {
+        struct iovec iov[P2P_BATCH];
+        int count = 0;
+        for(auto it = queue.messages.begin(); it != queue.messages.end() && count < (conn.seqpacket ? 1 : P2P_BATCH); ++it, ++count)
+        {
+            iov[count].iov_base = (void*)it->data();
+            iov[count].iov_len = it->size();
+        }
+        iov[0].iov_base = (char*)iov[0].iov_base + queue.offset;
+        iov[0].iov_len -= queue.offset;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t bytes = sendmsg(conn.sock, &msg, MSG_NOSIGNAL);
+        if(bytes < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        // drop the messages that were written completely
+        size_t written = queue.offset + bytes;
+        while(!queue.messages.empty() && written >= queue.messages.front().size())
+        {
+            written -= queue.messages.front().size();
+            queue.messages.pop_front();
+        }
+        queue.offset = written;
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Function: runTransfer
+ * Parameters: a reference to the non-blocking connection, a reference to the queue, a reference to the number of messages the server
+ *             owes, the file transfer command
+ * Return: 1 when the transfer is done or could not start, 0 if the server closed the socket, -1 on error
+ * Description: This function writes the queued commands and waits for their replies, so the server is waiting for a command and the
+ *              transfer's own messages are not mixed up with earlier ones. The transfer runs on the blocking socket.
+*/
+int runTransfer(P2PConnection& conn, sendQueue& queue, int& pending, const std::string& command)
+{
+    uint64_t acked = 0;
+    while(!queue.messages.empty() || pending > 0)
+    {
+        bool server;
+        bool console;
+        if(waitEvents(conn, queue, -1, server, console) < 0 || flushQueue(conn, queue) < 0)
+        {
+            return -1;
+        }
+        int result = readServer(conn, false, pending, acked);
+        if(result <= 0)
+        {
+            return result;
+        }
+    }
+
+    setBlocking(conn, true);
+    int result = transferFile(conn, command);
+    setBlocking(conn, false);
+    if(result < 0)
+    {
+        return -1;
+    }
+
+    // a transfer that started is answered with ENTERCMD
+    pending = result;
+    return 1;
+}
+
+
+
+/*
+ * Function: waitEvents
+ * Parameters: a reference to the non-blocking connection, a reference to the queue, the console to watch (-1 for none), references
+ *             to flags telling whether the server and the console have something to read
+ * Return: 1 when something happened, -1 on error
+ * Description: This function sleeps until the server sent something, the console has input, or the socket takes more of the queue.
+ *              With a shared ring the server wakes us through the eventfd, and a full ring is retried every millisecond since
+ *              the server does not signal free space. A message already read into the connection's buffer does not wait at all,
+ *              the socket will not report it again.
+*/
+int waitEvents(P2PConnection& conn, const sendQueue& queue, int console, bool& server, bool& input)
+{
+    struct pollfd pfd[3];
+    pfd[0].fd = conn.sock;
+    pfd[0].events = POLLIN | (conn.sendRing == NULL && !queue.messages.empty() ? POLLOUT : 0);
+    pfd[1].fd = console;
+    pfd[1].events = POLLIN;
+    pfd[2].fd = conn.recvRing != NULL ? conn.recvEvent : -1;
+    pfd[2].events = POLLIN;
+
+    bool buffered = conn.recvRing == NULL && messageBuffered(conn);
+    int timeout = buffered ? 0 : conn.sendRing != NULL && !queue.messages.empty() ? 1 : -1;
+    if(conn.recvRing != NULL && !ringArm(conn))
+    {
+        timeout = 0;
+    }
+    int result = poll(pfd, 3, timeout);
+    if(conn.recvRing != NULL)
+    {
+        ringDisarm(conn);
+    }
+    if(result < 0 && errno != EINTR)
+    {
+        return -1;
+    }
+
+    server = buffered || (result > 0 && (pfd[0].revents != 0 || pfd[2].revents != 0));
+    server = server || (conn.recvRing != NULL && !ringEmpty(conn.recvRing));
+    input = result > 0 && pfd[1].revents != 0;
+    return 1;
+}
+
+
+
+/*
+ * Function: readAcks
+ * Parameters: a reference to the connection, a reference to the acknowledged count, the milliseconds to wait for the first message
+ * Return: 0 on success, 1 if the server closed the socket, -1 on error
+ * Description: This function reads the server messages that are available and records the count of the latest 'ACK <count>'. The
+ *              server closes the socket right after acknowledging a quit, so a close is left for the caller to judge.
+*/
+int readAcks(P2PConnection& conn, uint64_t& acked, int timeout)
+{
+    std::string readBuffer;
+
+    while(waitMessage(conn, timeout) > 0)
+    {
+        ssize_t bytes = recvMessage(conn, readBuffer);
         if(bytes == 0)
         {
-            std::cout << "The socket was closed by the server..." << std::endl;
-            break;
+            return 1;
         }
         else if(bytes < 0)
         {
-            std::cout << "There was an error writting to the socket..." << std::endl;
-            break;
+            std::cout << "There was an error reading from the socket: " << strerror(errno) << std::endl;
+            return -1;
+        }
+
+        if(readBuffer.compare(0, 4, "ACK ") == 0)
+        {
+            acked = strtoull(readBuffer.c_str() + 4, NULL, 10);
         }
         else
         {
-            // If the command 'quit' has been sent, then exit the client.
-            if(strcmp(writeBuffer, "quit") == 0)
+            std::cout << "Server says '" << readBuffer << "'" << std::endl;
+        }
+
+        // only wait for the first message
+        timeout = 0;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Function: benchCommands
+ * Parameters: a reference to the connection, true for the pipelined mode, the number of commands to send, true for binary commands
+ * Return: 0 on success, -1 on error
+ * Description: This function sends the given number of commands as fast as the mode allows and prints the commands per second. In
+ *              the classic mode every command waits for ENTERCMD, one round trip each. In the pipelined mode the commands are streamed
+ *              and the time ends when the last one is acknowledged. The benchmark ends by sending 'quit'.
+*/
+int benchCommands(P2PConnection& conn, bool pipelined, size_t count, bool binary)
+{
+    std::string command = "bench";
+    if(binary)
+    {
+        P2PField text = {"bench", 5};
+        encodeCommand(command, P2P_OP_SAY, &text, 1);
+    }
+    std::string readBuffer;
+    uint64_t acked = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < count; i++)
+    {
+        if(!pipelined && recvMessage(conn, readBuffer) <= 0)
+        {
+            std::cout << "There was an error reading from the socket..." << std::endl;
+            return -1;
+        }
+        if(sendMessage(conn, command) <= 0)
+        {
+            std::cout << "There was an error writting to the socket..." << std::endl;
+            return -1;
+        }
+        if(pipelined && readAcks(conn, acked, 0) != 0)
+        {
+            return -1;
+        }
+    }
+
+    // the last command is done when it is acknowledged, or when the server asks for the next one
+    if(pipelined)
+    {
+        while(acked < count)
+        {
+            if(readAcks(conn, acked, -1) != 0)
             {
-                std::cout << "Quitting!" << std::endl;
-                break;
+                return -1;
             }
         }
     }
+    else if(recvMessage(conn, readBuffer) <= 0)
+    {
+        std::cout << "There was an error reading from the socket..." << std::endl;
+        return -1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    // close the client socket
-    close(clientSock);
+    std::cout << count << " command(s) in " << seconds << " seconds (" << count / seconds << " commands/sec) using the ";
+    std::cout << (pipelined ? "pipelined" : "classic") << " mode with " << (binary ? "binary" : "text") << " commands over ";
+    std::cout << transportName(conn) << "." << std::endl;
+
+    // tell the server the benchmark is over
+    command = "quit";
+    if(sendMessage(conn, command) <= 0)
+    {
+        return -1;
+    }
+    while(pipelined && acked < count + 1)
+    {
+        if(readAcks(conn, acked, -1) != 0 && acked < count + 1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+
+/*
+ * Function: isTransfer
+ * Parameters: a command typed by the user
+ * Return: true for a 'send <path>', 'get <path>', or 'fds <paths>' command
+ * Description: This function recognizes the file transfer commands.
+*/
+bool isTransfer(const std::string& command)
+{
+    return (command.compare(0, 5, "send ") == 0 && command.size() > 5) ||
+           (command.compare(0, 4, "get ") == 0 && command.size() > 4) ||
+           (command.compare(0, 4, "fds ") == 0 && command.size() > 4);
+}
+
+
+
+/*
+ * Function: transferFile
+ * Parameters: a reference to the connection, a file transfer command
+ * Return: the result of the function handling the command
+ * Description: This function hands a file transfer command to the function that performs it.
+*/
+int transferFile(P2PConnection& conn, const std::string& command)
+{
+    if(conn.seqpacket && command.compare(0, 4, "fds ") != 0)
+    {
+        std::cout << "File transfers need the stream transport." << std::endl;
+        return 0;
+    }
+    if((conn.tcp || conn.sendRing != NULL) && command.compare(0, 4, "fds ") == 0)
+    {
+        std::cout << "Descriptors can only be passed over an AF_UNIX socket without a shared ring." << std::endl;
+        return 0;
+    }
+    if(command.compare(0, 5, "send ") == 0)
+    {
+        return uploadFile(conn, command.substr(5));
+    }
+    if(command.compare(0, 4, "get ") == 0)
+    {
+        return downloadFile(conn, command.substr(4));
+    }
+    return passFiles(conn, command.substr(4));
+}
+
+
+
+/*
+ * Function: uploadFile
+ * Parameters: a reference to the connection, the path of the file to send
+ * Return: 1 when the file was sent, 0 if the file could not be opened (nothing was sent), -1 on a socket error
+ * Description: This function sends 'send <size> <name>' followed by the raw bytes of the file. The server stores the file under its
+ *              name in its working directory.
+*/
+int uploadFile(P2PConnection& conn, const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) < 0 || !S_ISREG(info.st_mode))
+    {
+        std::cout << path << ": cannot be sent" << (fd < 0 ? std::string(", ") + strerror(errno) : "") << std::endl;
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        return 0;
+    }
+
+    std::string name = baseName(path);
+    std::string header = "send " + std::to_string(info.st_size) + " " + name;
+
+    auto start = std::chrono::steady_clock::now();
+    ssize_t bytes = sendMessage(conn, header);
+    if(bytes > 0)
+    {
+        bytes = sendFile(conn, fd, info.st_size);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    close(fd);
+
+    if(bytes <= 0)
+    {
+        std::cout << "There was an error sending " << path << ": " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    printTransfer("Sent", name, info.st_size, seconds);
+    return 1;
+}
+
+
+
+/*
+ * Function: downloadFile
+ * Parameters: a reference to the connection, the path of the file on the server
+ * Return: 1 when the request was answered, -1 on a socket error
+ * Description: This function sends 'get <path>'. The server answers 'FILE <size>' followed by the raw bytes, which are stored under
+ *              the file's name in the working directory, or 'ERROR <reason>'.
+*/
+int downloadFile(P2PConnection& conn, const std::string& path)
+{
+    std::string request = "get " + path;
+    std::string reply;
+
+    auto start = std::chrono::steady_clock::now();
+    if(sendMessage(conn, request) <= 0 || recvMessage(conn, reply) <= 0)
+    {
+        std::cout << "There was an error requesting " << path << std::endl;
+        return -1;
+    }
+    if(reply.compare(0, 5, "FILE ") != 0)
+    {
+        std::cout << "Server says '" << reply << "'" << std::endl;
+        return 1;
+    }
+
+    off_t size = strtoll(reply.c_str() + 5, NULL, 10);
+    std::string name = baseName(path);
+    int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ssize_t bytes;
+    if(fd < 0)
+    {
+        std::cout << name << ": cannot be created, " << strerror(errno) << std::endl;
+        bytes = skipBytes(conn, size);
+    }
+    else
+    {
+        bytes = recvFile(conn, fd, size);
+        close(fd);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if(bytes <= 0)
+    {
+        std::cout << "There was an error receiving " << path << std::endl;
+        return -1;
+    }
+
+    if(fd >= 0)
+    {
+        printTransfer("Received", name, size, seconds);
+    }
+    return 1;
+}
+
+
+
+/*
+ * Function: passFiles
+ * Parameters: a reference to the connection, a space separated list of paths
+ * Return: 1 when the descriptors were passed, 0 if a file could not be opened (nothing was sent), -1 on a socket error
+ * Description: This function opens every file and sends 'fds <count> read' with the open descriptors attached. The server reads the
+ *              files through its copies of the descriptors. The client's copies are closed once the message is sent.
+*/
+int passFiles(P2PConnection& conn, const std::string& paths)
+{
+    std::istringstream list(paths);
+    std::string path;
+    std::vector<int> fds;
+
+    while(list >> path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0 || (int)fds.size() == P2P_MAX_FDS)
+        {
+            std::cout << path << ": cannot be passed, " << (fd < 0 ? strerror(errno) : "too many descriptors") << std::endl;
+            if(fd >= 0)
+            {
+                close(fd);
+            }
+            for(size_t i = 0; i < fds.size(); i++)
+            {
+                close(fds[i]);
+            }
+            return 0;
+        }
+        fds.push_back(fd);
+    }
+
+    std::string message = "fds " + std::to_string(fds.size()) + " read";
+    ssize_t bytes = sendMessage(conn, message, fds.data(), fds.size());
+    for(size_t i = 0; i < fds.size(); i++)
+    {
+        close(fds[i]);
+    }
+
+    if(bytes <= 0)
+    {
+        std::cout << "There was an error passing descriptors over the socket..." << std::endl;
+        return -1;
+    }
+
+    std::cout << "Passed " << fds.size() << " descriptor(s)" << std::endl;
+    return 1;
+}
+
+
+
+/*
+ * Function: benchDescriptors
+ * Parameters: a reference to the connection, the file to use
+ * Return: 0 on success, -1 on error
+ * Description: This function compares two ways of getting a file to the server, each repeated BENCH_ROUNDS times: copying the
+ *              contents through the connection (a binary sink command, sent with sendfile and drained by the server) and passing the descriptor
+ *              ('fds 1 read', the server reads the file itself). It then measures the cost of passing descriptors alone, one per
+ *              message and P2P_MAX_FDS per message. Every round ends when the server asks for the next command.
+*/
+int benchDescriptors(P2PConnection& conn, const char* path)
+{
+    const int BENCH_ROUNDS = 20;
+    const int FD_ROUNDS = 1000;
+    if(conn.tcp || conn.sendRing != NULL)
+    {
+        std::cout << "Descriptors can only be passed over an AF_UNIX socket without a shared ring." << std::endl;
+        return -1;
+    }
 
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) < 0 || !S_ISREG(info.st_mode))
+    {
+        std::cout << path << ": cannot be used for the benchmark" << std::endl;
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    // wait for the first ENTERCMD
+    std::string readBuffer;
+    if(recvMessage(conn, readBuffer) <= 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    std::vector<int> batch(P2P_MAX_FDS, fd);
+    std::string sink;
+    char varint[P2P_MAX_VARINT];
+    P2PField size = numberField(varint, info.st_size);
+    encodeCommand(sink, P2P_OP_SINK, &size, 1);
+    double copy = 0, pass = 0, single = 0, many = 0;
+    bool ok = true;
+
+    for(int i = 0; i < BENCH_ROUNDS && ok; i++)
+    {
+        double seconds = timeCommand(conn, sink, NULL, 0, fd);
+        double passed = timeCommand(conn, "fds 1 read", &fd, 1, -1);
+        ok = seconds >= 0 && passed >= 0;
+        copy += seconds;
+        pass += passed;
+    }
+    for(int i = 0; i < FD_ROUNDS && ok; i++)
+    {
+        double seconds = timeCommand(conn, "fds 1", &fd, 1, -1);
+        double batched = timeCommand(conn, "fds " + std::to_string(P2P_MAX_FDS), batch.data(), batch.size(), -1);
+        ok = seconds >= 0 && batched >= 0;
+        single += seconds;
+        many += batched;
+    }
+    close(fd);
+
+    if(!ok)
+    {
+        std::cout << "There was an error during the benchmark..." << std::endl;
+        return -1;
+    }
+
+    double mb = info.st_size / 1000000.0 * BENCH_ROUNDS;
+    std::cout << "File of " << info.st_size << " byte(s), " << BENCH_ROUNDS << " round(s):" << std::endl;
+    std::cout << "  copy contents:     " << copy / BENCH_ROUNDS * 1000 << " ms per round (" << mb / copy << " MB/s)" << std::endl;
+    std::cout << "  pass descriptor:   " << pass / BENCH_ROUNDS * 1000 << " ms per round (" << mb / pass << " MB/s)" << std::endl;
+    std::cout << "Descriptor passing alone, " << FD_ROUNDS << " message(s) each:" << std::endl;
+    std::cout << "  1 per message:     " << single / FD_ROUNDS * 1e6 << " us per descriptor" << std::endl;
+    std::cout << "  " << P2P_MAX_FDS << " per message:   " << many / FD_ROUNDS / P2P_MAX_FDS * 1e6 << " us per descriptor" << std::endl;
+
+    // tell the server the benchmark is over
+    sendMessage(conn, std::string("quit"));
     return 0;
-}
\ No newline at end of file
+}
+
+
+
+/*
+ * Function: timeCommand
+ * Parameters: a reference to the connection, the command, descriptors to attach, the number of descriptors, a file to send after
+ *             the command (-1 for none)
+ * Return: the seconds until the server asked for the next command, -1 on error
+ * Description: This function sends one benchmark command in the classic mode and waits for the following ENTERCMD.
+*/
+double timeCommand(P2PConnection& conn, const std::string& command, const int* fds, int count, int file)
+{
+    std::string readBuffer;
+    struct stat info;
+
+    auto start = std::chrono::steady_clock::now();
+    if(sendMessage(conn, command, fds, count) <= 0)
+    {
+        return -1;
+    }
+    if(file >= 0 && (fstat(file, &info) < 0 || sendFile(conn, file, info.st_size) <= 0))
+    {
+        return -1;
+    }
+    if(recvMessage(conn, readBuffer) <= 0)
+    {
+        return -1;
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+
+/*
+ * Function: benchLatency
+ * Parameters: a reference to the connection, the number of round trips, true for binary commands
+ * Return: 0 on success, -1 on error
+ * Description: This function sends 'echo <timestamp>' and waits for the server to send it back, one command at a time. The round trip
+ *              is the time between the timestamp and the arrival of the echo. A tenth of the round trips (at most 10000) are run
+ *              first to warm up the caches and are not counted. The percentiles are printed when it is done. A binary echo carries
+ *              the timestamp as a varint field.
+*/
+int benchLatency(P2PConnection& conn, size_t count, bool binary)
+{
+    std::string writeBuffer;    // message to send
+    std::string readBuffer;     // message received
+    size_t warmup = std::min<size_t>(count / 10, 10000);
+    std::vector<double> rtt;    // round trips in microseconds
+    rtt.reserve(count);
+
+    // wait for the first ENTERCMD
+    if(recvMessage(conn, readBuffer) <= 0)
+    {
+        std::cout << "There was an error reading from the socket..." << std::endl;
+        return -1;
+    }
+
+    for(size_t i = 0; i < warmup + count; i++)
+    {
+        auto sent = std::chrono::steady_clock::now().time_since_epoch();
+        long long stamp = std::chrono::duration_cast<std::chrono::nanoseconds>(sent).count();
+        if(binary)
+        {
+            char varint[P2P_MAX_VARINT];
+            P2PField field = numberField(varint, stamp);
+            encodeCommand(writeBuffer, P2P_OP_ECHO, &field, 1);
+        }
+        else
+        {
+            writeBuffer = "echo " + std::to_string(stamp);
+        }
+        if(sendMessage(conn, writeBuffer) <= 0 || recvMessage(conn, readBuffer) <= 0)
+        {
+            std::cout << "There was an error during the benchmark..." << std::endl;
+            return -1;
+        }
+
+        // read the timestamp back from the echo
+        P2PCommand echo;
+        uint64_t echoed = 0;
+        if(decodeCommand(readBuffer, echo))
+        {
+            fieldNumber(echo, 0, echoed);
+        }
+        else
+        {
+            echoed = strtoll(readBuffer.c_str() + 5, NULL, 10);
+        }
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        long long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() - (long long)echoed;
+        if(i >= warmup)
+        {
+            rtt.push_back(elapsed / 1000.0);
+        }
+    }
+
+    std::sort(rtt.begin(), rtt.end());
+    double total = 0;
+    for(size_t i = 0; i < rtt.size(); i++)
+    {
+        total += rtt[i];
+    }
+
+    std::cout << count << " round trip(s) over " << transportName(conn);
+    std::cout << (conn.busyPoll ? " with busy polling" : "") << (binary ? " with binary commands" : "") << ", in microseconds:" << std::endl;
+    std::cout << "  min " << rtt.front() << "  mean " << total / count << "  p50 " << rtt[count / 2];
+    std::cout << "  p99 " << rtt[count * 99 / 100] << "  p99.9 " << rtt[count * 999 / 1000] << "  max " << rtt.back() << std::endl;
+
+    // tell the server the benchmark is over
+    sendMessage(conn, std::string("quit"));
+    return 0;
+}
+
+
+
+/*
+ * Function: benchThroughput
+ * Parameters: a reference to the connection, the megabytes to send per message size
+ * Return: 0 on success, -1 on error
+ * Description: This function sweeps message sizes from 16 bytes to 1 MB (64 KB over SOCK_SEQPACKET), send buffer sizes, and single
+ *              against batched writes. For every configuration it sends a binary stream command followed by the messages and stops the clock
+ *              when the server asks for the next command. The send buffer limits how much the client can write ahead of the server,
+ *              on an AF_UNIX socket the receive buffer does not.
+*/
+int benchThroughput(P2PConnection& conn, size_t megabytes)
+{
+    const size_t sizes[] = {16, 100, 1 << 10, 4 << 10, 16 << 10, 64 << 10, 256 << 10, 1 << 20};
+    const int buffers[] = {0, 64 << 10, 256 << 10, 1 << 20};    // 0 keeps the default
+    const size_t MAX_COUNT = 100000;
+
+    // remember the default send buffer, the kernel reports twice the size that was asked for
+    int defaultBuffer;
+    socklen_t length = sizeof(defaultBuffer);
+    if(getsockopt(conn.sock, SOL_SOCKET, SO_SNDBUF, &defaultBuffer, &length) < 0)
+    {
+        return -1;
+    }
+
+    // wait for the first ENTERCMD
+    std::string readBuffer;
+    if(recvMessage(conn, readBuffer) <= 0)
+    {
+        std::cout << "There was an error reading from the socket..." << std::endl;
+        return -1;
+    }
+
+    std::vector<char> payload(1 << 20, 'x');
+    std::cout << "Streaming over " << transportName(conn) << ", " << megabytes << " MB per size:" << std::endl;
+    std::cout << "    size    sndbuf  writes          MB/s      msgs/sec" << std::endl;
+
+    for(size_t size : sizes)
+    {
+        if(size > conn.maxMessage)
+        {
+            break;
+        }
+        size_t count = std::max<size_t>(1, std::min(megabytes * 1000000 / size, MAX_COUNT));
+
+        for(int buffer : buffers)
+        {
+            int value = buffer > 0 ? buffer : defaultBuffer / 2;
+            setsockopt(conn.sock, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value));
+
+            for(int batched = 0; batched < 2; batched++)
+            {
+                double seconds = timeStream(conn, payload.data(), size, count, batched);
+                if(seconds < 0)
+                {
+                    std::cout << "There was an error during the benchmark..." << std::endl;
+                    return -1;
+                }
+
+                char line[128];
+                snprintf(line, sizeof(line), "%8zu  %8s  %-6s  %12.1f  %12.0f", size, buffer > 0 ? std::to_string(buffer).c_str() : "default",
+                         batched ? "writev" : "single", size * count / 1000000.0 / seconds, count / seconds);
+                std::cout << line << std::endl;
+            }
+        }
+    }
+
+    // tell the server the benchmark is over
+    sendMessage(conn, std::string("quit"));
+    return 0;
+}
+
+
+
+/*
+ * Function: timeStream
+ * Parameters: a reference to the connection, the payload, the message size, the number of messages, true to batch the writes
+ * Return: the seconds until the server asked for the next command, -1 on error
+ * Description: This function streams the messages after a binary stream command, one sendMessage each or P2P_BATCH per
+ *              sendMessages, and waits for the following ENTERCMD.
+*/
+double timeStream(P2PConnection& conn, const char* payload, size_t size, size_t count, bool batched)
+{
+    std::string readBuffer;
+    struct iovec messages[P2P_BATCH];
+    for(int i = 0; i < P2P_BATCH; i++)
+    {
+        messages[i].iov_base = (void*)payload;
+        messages[i].iov_len = size;
+    }
+
+    std::string stream;
+    char varint[P2P_MAX_VARINT];
+    P2PField field = numberField(varint, count);
+    encodeCommand(stream, P2P_OP_STREAM, &field, 1);
+
+    auto start = std::chrono::steady_clock::now();
+    if(sendMessage(conn, stream) <= 0)
+    {
+        return -1;
+    }
+    for(size_t sent = 0; sent < count;)
+    {
+        int batch = batched ? std::min<size_t>(count - sent, P2P_BATCH) : 1;
+        ssize_t bytes = batched ? sendMessages(conn, messages, batch) : sendMessage(conn, payload, size);
+        if(bytes <= 0)
+        {
+            return -1;
+        }
+        sent += batch;
+    }
+    if(recvMessage(conn, readBuffer) <= 0)
+    {
+        return -1;
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
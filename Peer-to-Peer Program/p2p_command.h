@@ -0,0 +1,223 @@
+/*
+* Author: Robert Blaine Wilson
+* Date: 6/19/2023
+* Synopsis: This file holds the binary command format of the Peer-to-Peer programs. A binary command is one message that starts
+*           with a 0 byte, which no text command starts with, followed by a one byte opcode and up to P2P_MAX_FIELDS fields. Each
+*           field is its length as a varint (7 bits per byte, low bits first, the high bit set on every byte but the last)
+*           followed by its bytes. Numbers are carried as a varint inside their field.
+*           Decoding never copies or allocates, the fields point into the message, so a command costs the same to parse however
+*           busy the server is. The server still takes the text commands, see p2p_server.cpp.
+*/
+
+#ifndef P2P_COMMAND_H
+#define P2P_COMMAND_H
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+
+
+/* The first byte of a binary command */
+const char P2P_BINARY = '\0';
+/* The most fields a command can carry */
+const int P2P_MAX_FIELDS = 8;
+/* The most bytes of a varint */
+const int P2P_MAX_VARINT = 10;
+
+
+/* The opcodes of the commands, 0 marks a command that could not be decoded */
+enum P2POpcode
+{
+    P2P_OP_INVALID = 0,
+    P2P_OP_SAY,         // text to print
+    P2P_OP_QUIT,        // end the session
+    P2P_OP_ECHO,        // send the whole command back
+    P2P_OP_SEND,        // size, name: a file follows
+    P2P_OP_GET,         // path: send the file back
+    P2P_OP_SINK,        // size: bytes to throw away follow
+    P2P_OP_FDS,         // count, optional "read": descriptors follow
+    P2P_OP_STREAM       // count: this many messages follow and are dropped
+};
+
+
+/* One field of a command, it points into the message */
+struct P2PField
+{
+    const char* data;
+    size_t size;
+};
+
+
+/* A decoded command */
+struct P2PCommand
+{
+    uint8_t opcode;
+    bool binary;                        // false if it came from a text command
+    int count;                          // the number of fields
+    P2PField fields[P2P_MAX_FIELDS];
+    const std::string* message;         // the message the fields point into
+};
+
+
+
+/*
+ * Function: putVarint
+ * Parameters: a buffer of at least P2P_MAX_VARINT bytes, the value
+ * Return: the number of bytes written
+ * Description: This function encodes a value as a varint.
+*/
+inline int putVarint(char* buffer, uint64_t value)
+{
+    int length = 0;
+    while(value >= 0x80)
+    {
+        buffer[length++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    buffer[length++] = (char)value;
+    return length;
+}
+
+
+
+/*
+ * Function: getVarint
+ * Parameters: a reference to the read position, the end of the bytes, a reference to store the value
+ * Return: true if a whole varint was read, false if it is cut short or too long
+ * Description: This function decodes a varint and moves the read position past it.
+*/
+inline bool getVarint(const char*& position, const char* end, uint64_t& value)
+{
+    value = 0;
+    for(int shift = 0; position < end && shift < P2P_MAX_VARINT * 7; shift += 7)
+    {
+        uint8_t byte = (uint8_t)*position++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+
+/*
+ * Function: encodeCommand
+ * Parameters: a reference to the string to store the command, the opcode, the fields, the number of fields
+ * Return: None
+ * Description: This function builds a binary command. The string is overwritten, reusing it keeps its memory.
+*/
+inline void encodeCommand(std::string& out, uint8_t opcode, const P2PField* fields, int count)
+{
+    char varint[P2P_MAX_VARINT];
+
+    out.assign(1, P2P_BINARY);
+    out.push_back((char)opcode);
+    for(int i = 0; i < count; i++)
+    {
+        out.append(varint, putVarint(varint, fields[i].size));
+        out.append(fields[i].data, fields[i].size);
+    }
+}
+
+
+
+/*
+ * Function: numberField
+ * Parameters: a buffer of at least P2P_MAX_VARINT bytes, the number
+ * Return: the field, pointing into the buffer
+ * Description: This function encodes a number as a field of a binary command.
+*/
+inline P2PField numberField(char* buffer, uint64_t value)
+{
+    return {buffer, (size_t)putVarint(buffer, value)};
+}
+
+
+
+/*
+ * Function: decodeCommand
+ * Parameters: a reference to the message, a reference to the command to fill
+ * Return: false if the message is not a binary command, true otherwise
+ * Description: This function splits a binary command into its fields. A command that is cut short, has a field running past its
+ *              end or has too many fields gets the opcode P2P_OP_INVALID.
+*/
+inline bool decodeCommand(const std::string& message, P2PCommand& command)
+{
+    if(message.size() < 2 || message[0] != P2P_BINARY)
+    {
+        return false;
+    }
+
+    const char* position = message.data() + 2;
+    const char* end = message.data() + message.size();
+    command.opcode = (uint8_t)message[1];
+    command.binary = true;
+    command.count = 0;
+    command.message = &message;
+
+    while(position < end)
+    {
+        uint64_t size;
+        if(command.count == P2P_MAX_FIELDS || !getVarint(position, end, size) || size > (uint64_t)(end - position))
+        {
+            command.opcode = P2P_OP_INVALID;
+            return true;
+        }
+        command.fields[command.count++] = {position, (size_t)size};
+        position += size;
+    }
+    return true;
+}
+
+
+
+/*
+ * Function: fieldNumber
+ * Parameters: a reference to the command, the index of the field, a reference to store the number
+ * Return: true if the field holds a number
+ * Description: This function reads a number from a field, a varint in a binary command and decimal digits in a text command.
+*/
+inline bool fieldNumber(const P2PCommand& command, int index, uint64_t& value)
+{
+    if(index >= command.count)
+    {
+        return false;
+    }
+
+    const P2PField& field = command.fields[index];
+    const char* position = field.data;
+    if(command.binary)
+    {
+        return getVarint(position, field.data + field.size, value) && position == field.data + field.size;
+    }
+
+    value = 0;
+    for(size_t i = 0; i < field.size; i++)
+    {
+        if(field.data[i] < '0' || field.data[i] > '9')
+        {
+            return false;
+        }
+        value = value * 10 + (field.data[i] - '0');
+    }
+    return field.size > 0;
+}
+
+
+
+/*
+ * Function: fieldEquals
+ * Parameters: a reference to the command, the index of the field, a string
+ * Return: true if the field holds exactly the string
+ * Description: This function compares a field without copying it.
+*/
+inline bool fieldEquals(const P2PCommand& command, int index, const char* text)
+{
+    return index < command.count && command.fields[index].size == strlen(text) &&
+           memcmp(command.fields[index].data, text, command.fields[index].size) == 0;
+}
+
+#endif
@@ -0,0 +1,1353 @@
+/*
+* Author: Robert Blaine Wilson
+* Date: 6/19/2023
+* Synopsis: This file holds the message layer shared by the Peer-to-Peer client and server. Every message is sent as a 4 byte
+*           length in network byte order followed by that many bytes, so a message can be anywhere from 0 bytes up to the
+*           configured maximum. SOCK_STREAM does not keep message boundaries, one read can return part of a message or several
+*           messages at once, so received bytes are kept in a reassembly buffer until a whole message is available.
+*           Files are moved as raw bytes right after a message announcing their size. The sender hands the file to the socket
+*           with sendfile and the receiver splices the socket into a preallocated file, so the data is never copied through
+*           user space.
+*           Open file descriptors can be attached to a message (SCM_RIGHTS). Sockets are always read with recvmsg, descriptors
+*           that arrive are queued on the connection in order and claimed by the message that announces them.
+*           A connection can busy poll: reads spin on a non-blocking recvmsg instead of sleeping in the kernel, which trades a
+*           core for a shorter wake up when latency matters more than CPU time.
+*           A SOCK_SEQPACKET socket keeps message boundaries itself: every send is delivered as exactly one record, so messages go
+*           out without the length prefix and every read returns one whole message. Records are limited to P2P_MAX_RECORD bytes
+*           and cannot carry the raw bytes of a file, file transfers need SOCK_STREAM. The socket type is detected when the
+*           connection is initialized, the rest of the programs use the same calls for both.
+*           Both programs take the same kinds of addresses: a socket file path, '@name' for a Linux abstract socket (no file is
+*           created, so nothing is left behind when a process dies), or 'tcp:host:port' for TCP. TCP connections turn on
+*           TCP_NODELAY, and TCP_QUICKACK after every read, so small messages are neither held back nor waiting on delayed ACKs.
+*           Descriptor passing and SOCK_SEQPACKET need AF_UNIX.
+*           A client on an AF_UNIX socket can offer a shared memory ring in its handshake response ('SHM <bytes>', with the memfd
+*           and two eventfds attached, see p2p_ring.h). If the server answers 'SHM' over the socket, every later message goes
+*           through the ring and the socket is left for raw file bytes and to notice a peer that hangs up. A sleeping reader is
+*           woken through its eventfd, a busy polling reader spins on the ring and never enters the kernel.
+*/
+
+#ifndef P2P_PROTOCOL_H
+#define P2P_PROTOCOL_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <cstdlib>
+#include <poll.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <chrono>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "p2p_ring.h"
+
+
+const size_t P2P_HEADER_SIZE = 4;                   // size of the length prefix
+const size_t P2P_DEFAULT_MAX_MESSAGE = 16 << 20;    // largest message accepted unless configured otherwise
+const size_t P2P_READ_SIZE = 64 << 10;              // smallest read into the reassembly buffer
+const size_t P2P_SPLICE_SIZE = 1 << 20;             // bytes moved per splice when receiving a file
+const int P2P_MAX_FDS = 253;                        // descriptors the kernel accepts in one message (SCM_MAX_FD)
+const size_t P2P_MAX_RECORD = P2P_READ_SIZE;        // largest message on a SOCK_SEQPACKET socket
+const int P2P_BATCH = 256;                          // messages per batched write, two io vectors each
+const size_t P2P_MIN_SHARED = 64 << 10;             // smallest shared memory for the rings
+const int P2P_SHARED_SEALS = F_SEAL_SHRINK | F_SEAL_GROW;  // seals that keep the size of the shared memory fixed
+
+
+/* An address to bind or connect to, parsed from the command line */
+struct P2PAddress
+{
+    struct sockaddr_storage storage;    // the socket address
+    socklen_t length;                   // bytes of storage in use
+    bool socketFile;                    // the address is a path in the file system
+};
+
+
+
+/* A connected socket along with its reassembly buffer */
+struct P2PConnection
+{
+    int sock;                   // connected socket
+    size_t maxMessage;          // largest message accepted from the peer
+    std::vector<char> buffer;   // bytes read from the socket
+    size_t start;               // first byte not yet returned
+    size_t end;                 // one past the last byte read
+    std::deque<int> fds;        // descriptors received but not yet claimed
+    bool busyPoll;              // spin on reads instead of blocking
+    bool seqpacket;             // the socket keeps message boundaries, messages are not framed
+    bool tcp;                   // the socket is a TCP connection
+    bool nonBlocking;           // calls return EAGAIN instead of waiting
+    void* shared = NULL;        // shared memory holding both rings, NULL without it
+    size_t sharedSize = 0;      // size of the shared memory
+    uint64_t ringCapacity = 0;  // capacity of each ring, computed from sharedSize and never read back from the shared memory
+    P2PRing* sendRing = NULL;   // ring carrying messages to the peer, NULL while the socket carries them
+    P2PRing* recvRing = NULL;   // ring carrying messages from the peer
+    int sendEvent = -1;         // eventfd that wakes the peer
+    int recvEvent = -1;         // eventfd the peer wakes us with
+
+    // the members the destructor releases start out empty, so a connection that never reaches initConnection is safe to destroy
+    P2PConnection() = default;
+    P2PConnection(const P2PConnection&) = delete;
+    P2PConnection& operator=(const P2PConnection&) = delete;
+
+    // descriptors nobody claimed and the shared rings belong to the connection
+    ~P2PConnection()
+    {
+        for(size_t i = 0; i < fds.size(); i++)
+        {
+            close(fds[i]);
+        }
+        if(shared != NULL)
+        {
+            munmap(shared, sharedSize);
+        }
+        if(sendEvent >= 0)
+        {
+            close(sendEvent);
+        }
+        if(recvEvent >= 0)
+        {
+            close(recvEvent);
+        }
+    }
+};
+
+
+
+/*
+ * Function: initConnection
+ * Parameters: a reference to the connection, the connected socket, the largest message to accept
+ * Return: None
+ * Description: This function prepares a connection for sending and receiving messages. On a SOCK_SEQPACKET socket the largest
+ *              message is limited to P2P_MAX_RECORD. On a TCP socket Nagle's algorithm and delayed ACKs are turned off.
+*/
+inline void initConnection(P2PConnection& conn, int sock, size_t maxMessage)
+{
+    int type = SOCK_STREAM;
+    socklen_t size = sizeof(type);
+    getsockopt(sock, SOL_SOCKET, SO_TYPE, &type, &size);
+
+    struct sockaddr_storage local;
+    size = sizeof(local);
+    local.ss_family = AF_UNIX;
+    getsockname(sock, (struct sockaddr*)&local, &size);
+
+    conn.sock = sock;
+    conn.seqpacket = type == SOCK_SEQPACKET;
+    conn.tcp = local.ss_family == AF_INET || local.ss_family == AF_INET6;
+    if(conn.tcp)
+    {
+        int on = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+    }
+    conn.maxMessage = conn.seqpacket ? std::min(maxMessage, P2P_MAX_RECORD) : maxMessage;
+    conn.buffer.assign(P2P_READ_SIZE, 0);
+    conn.start = 0;
+    conn.end = 0;
+    conn.fds.clear();
+    conn.busyPoll = false;
+    conn.nonBlocking = false;
+    conn.shared = NULL;
+    conn.sharedSize = 0;
+    conn.ringCapacity = 0;
+    conn.sendRing = conn.recvRing = NULL;
+    conn.sendEvent = conn.recvEvent = -1;
+}
+
+
+
+inline void closeShared(P2PConnection&);
+
+
+
+/*
+ * Function: resolveAddress
+ * Parameters: the address text, the socket type, a reference to the address to fill in
+ * Return: 0 on success, -1 if the address cannot be used (errno is set, or EAI_* codes are printed for host names)
+ * Description: This function parses 'path', '@name' (abstract AF_UNIX socket) or 'tcp:host:port'. An empty host listens on every
+ *              interface. TCP only carries SOCK_STREAM.
+*/
+inline int resolveAddress(const char* text, int type, P2PAddress& address)
+{
+    memset(&address, 0, sizeof(address));
+
+    if(strncmp(text, "tcp:", 4) == 0)
+    {
+        const char* colon = strrchr(text + 4, ':');
+        if(colon == NULL || type != SOCK_STREAM)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        std::string host(text + 4, colon - text - 4);
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+
+        struct addrinfo* found;
+        int result = getaddrinfo(host.empty() ? NULL : host.c_str(), colon + 1, &hints, &found);
+        if(result != 0)
+        {
+            std::cout << text << ": " << gai_strerror(result) << std::endl;
+            return -1;
+        }
+        memcpy(&address.storage, found->ai_addr, found->ai_addrlen);
+        address.length = found->ai_addrlen;
+        freeaddrinfo(found);
+        return 0;
+    }
+
+    struct sockaddr_un* un = (struct sockaddr_un*)&address.storage;
+    un->sun_family = AF_UNIX;
+    if(text[0] == '@')
+    {
+        // the name follows a leading null byte and is not null terminated
+        size_t size = std::min(strlen(text + 1), sizeof(un->sun_path) - 1);
+        memcpy(un->sun_path + 1, text + 1, size);
+        address.length = offsetof(struct sockaddr_un, sun_path) + 1 + size;
+        return 0;
+    }
+
+    strncpy(un->sun_path, text, sizeof(un->sun_path) - 1);
+    address.length = sizeof(*un);
+    address.socketFile = true;
+    return 0;
+}
+
+
+
+/*
+ * Function: openSocket
+ * Parameters: a reference to the resolved address, the socket type
+ * Return: the new socket, or -1 on error
+ * Description: This function creates a socket of the address's family. A TCP socket may be bound again right after the server exits.
+*/
+inline int openSocket(const P2PAddress& address, int type)
+{
+    int sock = socket(address.storage.ss_family, type, 0);
+    if(sock >= 0 && address.storage.ss_family != AF_UNIX)
+    {
+        int on = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+    return sock;
+}
+
+
+
+/*
+ * Function: transportName
+ * Parameters: a reference to the connection
+ * Return: the name of the connection's transport
+ * Description: This function names the transport for benchmark results.
+*/
+inline const char* transportName(const P2PConnection& conn)
+{
+    if(conn.sendRing != NULL)
+    {
+        return "shared memory ring";
+    }
+    if(conn.tcp)
+    {
+        return "TCP";
+    }
+    return conn.seqpacket ? "AF_UNIX SOCK_SEQPACKET" : "AF_UNIX SOCK_STREAM";
+}
+
+
+
+/*
+ * Function: setBlocking
+ * Parameters: a reference to the connection, true to make its calls block
+ * Return: None
+ * Description: This function switches the socket between blocking and non-blocking calls. A non-blocking connection also returns
+ *              EAGAIN instead of waiting on an empty shared ring.
+*/
+inline void setBlocking(P2PConnection& conn, bool blocking)
+{
+    int flags = fcntl(conn.sock, F_GETFL);
+    fcntl(conn.sock, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+    conn.nonBlocking = !blocking;
+}
+
+
+
+/*
+ * Function: openShared
+ * Parameters: a reference to the connection, the size of the shared memory, an array to store the three descriptors to pass
+ * Return: 0 on success, -1 on error
+ * Description: This function is called by the client. It creates the memfd with both rings and an eventfd for each side, and returns
+ *              the memfd, the server's eventfd and the client's eventfd for the handshake. The rings are not used until startShared.
+ *              The caller closes the memfd once it has been passed. The memfd is sealed at its size, so neither side can shrink it
+ *              under the other's mapping and make its next access fault.
+*/
+inline int openShared(P2PConnection& conn, size_t size, int* fds)
+{
+    uint64_t capacity = ringCapacity(size);
+    int memfd = memfd_create("p2p-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(capacity == 0 || memfd < 0 || ftruncate(memfd, size) < 0 || fcntl(memfd, F_ADD_SEALS, P2P_SHARED_SEALS | F_SEAL_SEAL) < 0)
+    {
+        if(memfd >= 0)
+        {
+            close(memfd);
+        }
+        return -1;
+    }
+
+    void* shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    conn.sendEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    conn.recvEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    conn.shared = shared == MAP_FAILED ? NULL : shared;
+    conn.sharedSize = size;
+    if(conn.shared == NULL || conn.sendEvent < 0 || conn.recvEvent < 0)
+    {
+        close(memfd);
+        closeShared(conn);
+        return -1;
+    }
+
+    ringInit(ringAt(conn.shared, size, 0), capacity);
+    ringInit(ringAt(conn.shared, size, 1), capacity);
+    conn.ringCapacity = capacity;
+    fds[0] = memfd;
+    fds[1] = conn.sendEvent;
+    fds[2] = conn.recvEvent;
+    return 0;
+}
+
+
+
+/*
+ * Function: attachShared
+ * Parameters: a reference to the connection, the size of the shared memory announced by the client
+ * Return: 0 on success, -1 if the descriptors are missing or the memory does not hold the rings the client described
+ * Description: This function is called by the server. It claims the memfd and the two eventfds that came with the handshake
+ *              response and maps the memory. The rings are not used until startShared. A memfd that is not sealed at its size is
+ *              refused, the client could shrink it later and the server would fault on the mapping. The eventfds are made
+ *              non-blocking, a blocking descriptor from the client would stall ringDisarm.
+*/
+inline int attachShared(P2PConnection& conn, size_t size)
+{
+    if(conn.fds.size() < 3)
+    {
+        return -1;
+    }
+    int memfd = conn.fds[0];
+    conn.recvEvent = conn.fds[1];
+    conn.sendEvent = conn.fds[2];
+    conn.fds.erase(conn.fds.begin(), conn.fds.begin() + 3);
+
+    struct stat info;
+    uint64_t capacity = ringCapacity(size);
+    void* shared = MAP_FAILED;
+    int seals = fcntl(memfd, F_GET_SEALS);
+    bool events = fcntl(conn.recvEvent, F_SETFL, O_NONBLOCK) == 0 && fcntl(conn.sendEvent, F_SETFL, O_NONBLOCK) == 0;
+    if(capacity > 0 && events && seals >= 0 && (seals & P2P_SHARED_SEALS) == P2P_SHARED_SEALS && fstat(memfd, &info) == 0 &&
+       (size_t)info.st_size == size)
+    {
+        shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    }
+    close(memfd);
+
+    conn.shared = shared == MAP_FAILED ? NULL : shared;
+    conn.sharedSize = size;
+    if(conn.shared == NULL || ringAt(conn.shared, size, 0)->capacity != capacity || ringAt(conn.shared, size, 1)->capacity != capacity)
+    {
+        closeShared(conn);
+        return -1;
+    }
+    conn.ringCapacity = capacity;
+    return 0;
+}
+
+
+
+/*
+ * Function: startShared
+ * Parameters: a reference to the connection, true on the client
+ * Return: None
+ * Description: This function moves messages from the socket to the rings. The client sends on the first ring and the server on the
+ *              second. A message must fit in the ring along with its length.
+*/
+inline void startShared(P2PConnection& conn, bool client)
+{
+    conn.sendRing = ringAt(conn.shared, conn.sharedSize, client ? 0 : 1);
+    conn.recvRing = ringAt(conn.shared, conn.sharedSize, client ? 1 : 0);
+    conn.maxMessage = std::min<size_t>(conn.maxMessage, conn.ringCapacity - P2P_HEADER_SIZE);
+}
+
+
+
+/*
+ * Function: closeShared
+ * Parameters: a reference to the connection
+ * Return: None
+ * Description: This function unmaps the rings and closes the eventfds, messages go back to the socket.
+*/
+inline void closeShared(P2PConnection& conn)
+{
+    if(conn.shared != NULL)
+    {
+        munmap(conn.shared, conn.sharedSize);
+    }
+    if(conn.sendEvent >= 0)
+    {
+        close(conn.sendEvent);
+    }
+    if(conn.recvEvent >= 0)
+    {
+        close(conn.recvEvent);
+    }
+    conn.shared = NULL;
+    conn.ringCapacity = 0;
+    conn.sendRing = conn.recvRing = NULL;
+    conn.sendEvent = conn.recvEvent = -1;
+}
+
+
+
+/*
+ * Function: ringSignal
+ * Parameters: a reference to the connection
+ * Return: None
+ * Description: This function wakes the peer through its eventfd after a message was published, but only if the peer is sleeping.
+*/
+inline void ringSignal(P2PConnection& conn)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(conn.sendRing->waiting.load(std::memory_order_relaxed))
+    {
+        uint64_t one = 1;
+        ssize_t bytes = write(conn.sendEvent, &one, sizeof(one));
+        (void)bytes;
+    }
+}
+
+
+
+/*
+ * Function: ringArm
+ * Parameters: a reference to the connection
+ * Return: true if the ring is still empty and the caller may sleep on the eventfd, false if a message arrived meanwhile
+ * Description: This function raises the waiting flag before the consumer sleeps. Every ringArm is followed by ringDisarm.
+*/
+inline bool ringArm(P2PConnection& conn)
+{
+    conn.recvRing->waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return ringEmpty(conn.recvRing);
+}
+
+
+
+/*
+ * Function: ringDisarm
+ * Parameters: a reference to the connection
+ * Return: None
+ * Description: This function lowers the waiting flag and clears a pending wake up.
+*/
+inline void ringDisarm(P2PConnection& conn)
+{
+    conn.recvRing->waiting.store(0, std::memory_order_relaxed);
+    uint64_t count;
+    ssize_t bytes = read(conn.recvEvent, &count, sizeof(count));
+    (void)bytes;
+}
+
+
+
+/*
+ * Function: ringWait
+ * Parameters: a reference to the connection, the number of milliseconds to wait (-1 waits forever)
+ * Return: 1 if a message is in the ring, 2 if the socket is readable (the peer may have hung up), 0 if the time ran out, -1 on error
+ * Description: This function waits for the next message in the ring. It sleeps on the eventfd and the socket at once, so a peer that
+ *              dies is noticed. A busy polling connection spins on the ring instead, and looks at the socket now and then.
+*/
+inline int ringWait(P2PConnection& conn, int timeout)
+{
+    struct pollfd pfd[2];
+    pfd[0].fd = conn.sock;
+    pfd[0].events = POLLIN | POLLRDHUP;
+    pfd[1].fd = conn.recvEvent;
+    pfd[1].events = POLLIN;
+
+    if(conn.busyPoll)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        for(uint64_t i = 1; ; i++)
+        {
+            if(!ringEmpty(conn.recvRing))
+            {
+                return 1;
+            }
+            if(i % 4096 == 0)
+            {
+                if(poll(pfd, 1, 0) > 0)
+                {
+                    return 2;
+                }
+                if(timeout >= 0 && std::chrono::steady_clock::now() >= deadline)
+                {
+                    return 0;
+                }
+            }
+        }
+    }
+
+    for(;;)
+    {
+        if(!ringArm(conn))
+        {
+            ringDisarm(conn);
+            return 1;
+        }
+        int result = poll(pfd, 2, timeout);
+        ringDisarm(conn);
+        if(result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(result <= 0)
+        {
+            return result;
+        }
+        return pfd[0].revents != 0 && ringEmpty(conn.recvRing) ? 2 : 1;
+    }
+}
+
+
+
+/*
+ * Function: ringSend
+ * Parameters: a reference to the connection, a pointer to the message, the size of the message
+ * Return: 1 when the message was published, 0 if the peer hung up while the ring was full, -1 if the message cannot fit
+ * Description: This function publishes a message on the shared ring and wakes the peer if it sleeps. A full ring is waited out,
+ *              yielding the CPU and checking that the peer is still connected.
+*/
+inline ssize_t ringSend(P2PConnection& conn, const void* data, size_t size)
+{
+    if(size + P2P_HEADER_SIZE > conn.ringCapacity)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    for(uint64_t i = 1; !ringPush(conn.sendRing, conn.ringCapacity, data, size); i++)
+    {
+        if(i % 1024 != 0)
+        {
+            sched_yield();
+            continue;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = conn.sock;
+        pfd.events = POLLRDHUP;
+        if(poll(&pfd, 1, 1) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)))
+        {
+            return 0;
+        }
+    }
+
+    ringSignal(conn);
+    return 1;
+}
+
+
+
+/*
+ * Function: ringReceive
+ * Parameters: a reference to the connection, a reference to a string to store the message
+ * Return: 1 when a message was received, 0 if the peer closed the socket, -1 on error (EAGAIN on a non-blocking connection)
+ * Description: This function takes the next message from the shared ring, waiting for one unless the connection is non-blocking.
+ *              Nothing but a close is expected on the socket, so a readable socket with an empty ring is checked for a hang up.
+ *              A ring the peer has corrupted is an error that sets errno to EPROTO, the caller ends the session.
+*/
+inline ssize_t ringReceive(P2PConnection& conn, std::string& message)
+{
+    for(;;)
+    {
+        int popped = ringPop(conn.recvRing, conn.ringCapacity, message);
+        if(popped != 0)
+        {
+            errno = popped < 0 ? EPROTO : errno;
+            return popped;
+        }
+
+        int result = conn.nonBlocking ? 2 : ringWait(conn, -1);
+        if(result < 0)
+        {
+            return -1;
+        }
+        if(result == 2)
+        {
+            char byte;
+            if(recv(conn.sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+            {
+                return 0;
+            }
+            if(conn.nonBlocking && ringEmpty(conn.recvRing))
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+    }
+}
+
+
+
+/*
+ * Function: advanceIov
+ * Parameters: a reference to a pointer to io vectors, a reference to the number of io vectors, the number of bytes written
+ * Return: None
+ * Description: This function skips the vectors that were written completely and trims the one that was written partially.
+*/
+inline void advanceIov(struct iovec*& iov, int& count, size_t bytes)
+{
+    while(count > 0 && bytes >= iov->iov_len)
+    {
+        bytes -= iov->iov_len;
+        iov++;
+        count--;
+    }
+    if(count > 0)
+    {
+        iov->iov_base = (char*)iov->iov_base + bytes;
+        iov->iov_len -= bytes;
+    }
+}
+
+
+
+/*
+ * Function: writeAll
+ * Parameters: a socket, an array of io vectors, the number of io vectors
+ * Return: 1 when every byte was written, 0 if the peer closed the socket, -1 on error
+ * Description: This function writes every byte described by the io vectors. sendmsg can write less than asked for, so the vectors
+ *              are advanced past the written bytes and the write is repeated. The vectors are modified. MSG_NOSIGNAL turns a
+ *              write to a closed peer into an EPIPE error instead of a SIGPIPE that would kill the process.
+*/
+inline ssize_t writeAll(int sock, struct iovec* iov, int count)
+{
+    while(count > 0)
+    {
+        struct msghdr header = {};
+        header.msg_iov = iov;
+        header.msg_iovlen = count;
+
+        ssize_t bytes = sendmsg(sock, &header, MSG_NOSIGNAL);
+        if(bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(bytes <= 0)
+        {
+            return bytes;
+        }
+
+        advanceIov(iov, count, bytes);
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Function: sendMessage
+ * Parameters: a reference to the connection, a pointer to the message, the size of the message
+ * Return: 1 when the message was sent, 0 if the peer closed the socket, -1 on error
+ * Description: This function sends the length prefix and the message with one gathering sendmsg. On a SOCK_SEQPACKET socket the message is
+ *              sent alone as one record, and with a shared ring it goes through the ring.
+*/
+inline ssize_t sendMessage(P2PConnection& conn, const void* data, size_t size)
+{
+    if(conn.sendRing != NULL)
+    {
+        return ringSend(conn, data, size);
+    }
+    if(conn.seqpacket)
+    {
+        if(size > P2P_MAX_RECORD)
+        {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        ssize_t bytes;
+        do
+        {
+            bytes = send(conn.sock, data, size, MSG_NOSIGNAL);
+        } while(bytes < 0 && errno == EINTR);
+        if(bytes < 0)
+        {
+            return errno == EPIPE || errno == ECONNRESET ? 0 : -1;
+        }
+        return 1;
+    }
+
+    uint32_t header = htonl((uint32_t)size);
+
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = P2P_HEADER_SIZE;
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = size;
+
+    return writeAll(conn.sock, iov, size > 0 ? 2 : 1);
+}
+
+inline ssize_t sendMessage(P2PConnection& conn, const std::string& message)
+{
+    return sendMessage(conn, message.data(), message.size());
+}
+
+
+
+/*
+ * Function: frameMessage
+ * Parameters: a reference to the connection, the message
+ * Return: the bytes that carry the message on the connection
+ * Description: This function prepends the length prefix, for callers that queue messages and write them later. A SOCK_SEQPACKET
+ *              message is sent as it is.
+*/
+inline std::string frameMessage(const P2PConnection& conn, const std::string& message)
+{
+    if(conn.seqpacket || conn.sendRing != NULL)
+    {
+        return message;
+    }
+
+    uint32_t header = htonl((uint32_t)message.size());
+    std::string framed((const char*)&header, P2P_HEADER_SIZE);
+    framed += message;
+    return framed;
+}
+
+
+
+/*
+ * Function: sendMessages
+ * Parameters: a reference to the connection, an array of io vectors with one message each, the number of messages
+ * Return: 1 when every message was sent, 0 if the peer closed the socket, -1 on error
+ * Description: This function sends many messages with few system calls. Up to P2P_BATCH messages are framed into one gathering sendmsg, or on a
+ *              SOCK_SEQPACKET socket sent as separate records with one sendmmsg. A shared ring takes them one after another.
+*/
+inline ssize_t sendMessages(P2PConnection& conn, const struct iovec* messages, int count)
+{
+    uint32_t headers[P2P_BATCH];
+    struct iovec iov[2 * P2P_BATCH];
+    struct mmsghdr records[P2P_BATCH];
+
+    for(int done = 0; done < count && conn.sendRing != NULL; done++)
+    {
+        ssize_t result = ringSend(conn, messages[done].iov_base, messages[done].iov_len);
+        if(result <= 0)
+        {
+            return result;
+        }
+    }
+
+    for(int done = 0; done < count && conn.sendRing == NULL;)
+    {
+        int batch = std::min(count - done, P2P_BATCH);
+
+        if(conn.seqpacket)
+        {
+            memset(records, 0, sizeof(records[0]) * batch);
+            for(int i = 0; i < batch; i++)
+            {
+                if(messages[done + i].iov_len > P2P_MAX_RECORD)
+                {
+                    errno = EMSGSIZE;
+                    return -1;
+                }
+                records[i].msg_hdr.msg_iov = (struct iovec*)&messages[done + i];
+                records[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            int sent = sendmmsg(conn.sock, records, batch, MSG_NOSIGNAL);
+            if(sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(sent < 0)
+            {
+                return errno == EPIPE || errno == ECONNRESET ? 0 : -1;
+            }
+            done += sent;
+            continue;
+        }
+
+        int vectors = 0;
+        for(int i = 0; i < batch; i++)
+        {
+            headers[i] = htonl((uint32_t)messages[done + i].iov_len);
+            iov[vectors].iov_base = &headers[i];
+            iov[vectors++].iov_len = P2P_HEADER_SIZE;
+            if(messages[done + i].iov_len > 0)
+            {
+                iov[vectors++] = messages[done + i];
+            }
+        }
+
+        ssize_t result = writeAll(conn.sock, iov, vectors);
+        if(result <= 0)
+        {
+            return result;
+        }
+        done += batch;
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Function: sendMessage
+ * Parameters: a reference to the connection, the message, an array of open descriptors, the number of descriptors (at most P2P_MAX_FDS)
+ * Return: 1 when the message was sent, 0 if the peer closed the socket, -1 on error
+ * Description: This function sends a message with descriptors attached. The descriptors travel with the first byte sent, any bytes the
+ *              first sendmsg did not take are written afterwards. The caller still owns its copies of the descriptors.
+*/
+inline ssize_t sendMessage(P2PConnection& conn, const std::string& message, const int* fds, int count)
+{
+    if(count <= 0)
+    {
+        return sendMessage(conn, message);
+    }
+    if(conn.sendRing != NULL)
+    {
+        // the ring cannot carry descriptors
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if(conn.seqpacket && message.size() > P2P_MAX_RECORD)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    uint32_t header = htonl((uint32_t)message.size());
+
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = P2P_HEADER_SIZE;
+    iov[1].iov_base = (void*)message.data();
+    iov[1].iov_len = message.size();
+    struct iovec* next = conn.seqpacket ? iov + 1 : iov;
+    int vectors = conn.seqpacket ? 1 : (message.empty() ? 1 : 2);
+
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int) * P2P_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = next;
+    msg.msg_iovlen = vectors;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+    ssize_t bytes;
+    do
+    {
+        bytes = sendmsg(conn.sock, &msg, MSG_NOSIGNAL);
+    } while(bytes < 0 && errno == EINTR);
+    if(bytes < 0 || (bytes == 0 && !conn.seqpacket))
+    {
+        return bytes < 0 && errno != EPIPE && errno != ECONNRESET ? -1 : 0;
+    }
+    if(conn.seqpacket)
+    {
+        return 1;
+    }
+
+    advanceIov(next, vectors, bytes);
+    return writeAll(conn.sock, next, vectors);
+}
+
+
+
+/*
+ * Function: readSocket
+ * Parameters: a reference to the connection, a buffer, the size of the buffer
+ * Return: the result of recvmsg
+ * Description: This function reads bytes from the socket and queues any descriptors that came with them. A busy polling connection
+ *              retries a non-blocking read until bytes arrive. A record that did not fit in the buffer is an error (EMSGSIZE). TCP
+ *              falls back to delayed ACKs after a read, so TCP_QUICKACK is turned on again.
+*/
+inline ssize_t readSocket(P2PConnection& conn, char* data, size_t size)
+{
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = size;
+
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int) * P2P_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    int flags = MSG_CMSG_CLOEXEC | (conn.busyPoll ? MSG_DONTWAIT : 0);
+    ssize_t bytes;
+    do
+    {
+        bytes = recvmsg(conn.sock, &msg, flags);
+    } while(bytes < 0 && conn.busyPoll && (errno == EAGAIN || errno == EWOULDBLOCK));
+    if(bytes < 0)
+    {
+        return bytes;
+    }
+
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int* received = (int*)CMSG_DATA(cmsg);
+            for(int i = 0; i < count; i++)
+            {
+                conn.fds.push_back(received[i]);
+            }
+        }
+    }
+
+    if(msg.msg_flags & MSG_TRUNC)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if(conn.tcp)
+    {
+        int on = 1;
+        setsockopt(conn.sock, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+    }
+    return bytes;
+}
+
+
+
+/*
+ * Function: recvRecord
+ * Parameters: a reference to the connection, a reference to a string to store the message
+ * Return: 1 when a message was received, 0 if the peer closed the socket, -1 on error
+ * Description: This function reads one record from a SOCK_SEQPACKET socket, which is one whole message. An empty record reads the
+ *              same as a closed socket, so a read of 0 bytes is only taken as a close when the socket has hung up.
+*/
+inline ssize_t recvRecord(P2PConnection& conn, std::string& message)
+{
+    ssize_t bytes;
+    do
+    {
+        bytes = readSocket(conn, conn.buffer.data(), conn.maxMessage);
+    } while(bytes < 0 && errno == EINTR);
+    if(bytes < 0)
+    {
+        return bytes;
+    }
+
+    if(bytes == 0)
+    {
+        struct pollfd pfd;
+        pfd.fd = conn.sock;
+        pfd.events = POLLRDHUP;
+        if(poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP)))
+        {
+            return 0;
+        }
+    }
+
+    message.assign(conn.buffer.data(), bytes);
+    return 1;
+}
+
+
+
+/*
+ * Function: recvMessage
+ * Parameters: a reference to the connection, a reference to a string to store the message
+ * Return: 1 when a message was received, 0 if the peer closed the socket, -1 on error
+ * Description: This function returns the next message from the reassembly buffer, reading from the socket only when the buffer does
+ *              not hold a whole message. A message larger than the connection's maximum is an error and sets errno to EMSGSIZE.
+*/
+inline ssize_t recvMessage(P2PConnection& conn, std::string& message)
+{
+    if(conn.recvRing != NULL)
+    {
+        return ringReceive(conn, message);
+    }
+    if(conn.seqpacket)
+    {
+        return recvRecord(conn, message);
+    }
+
+    for(;;)
+    {
+        size_t available = conn.end - conn.start;
+        size_t needed = P2P_HEADER_SIZE;
+
+        if(available >= P2P_HEADER_SIZE)
+        {
+            uint32_t header;
+            memcpy(&header, conn.buffer.data() + conn.start, P2P_HEADER_SIZE);
+            size_t size = ntohl(header);
+            if(size > conn.maxMessage)
+            {
+                errno = EMSGSIZE;
+                return -1;
+            }
+
+            // a whole message is buffered
+            needed = P2P_HEADER_SIZE + size;
+            if(available >= needed)
+            {
+                message.assign(conn.buffer.data() + conn.start + P2P_HEADER_SIZE, size);
+                conn.start += needed;
+                if(conn.start == conn.end)
+                {
+                    conn.start = conn.end = 0;
+                }
+                return 1;
+            }
+        }
+
+        // make room for the rest of the message, moving the partial message to the front of the buffer
+        if(conn.buffer.size() - conn.start < needed || conn.end == conn.buffer.size())
+        {
+            memmove(conn.buffer.data(), conn.buffer.data() + conn.start, available);
+            conn.start = 0;
+            conn.end = available;
+            if(conn.buffer.size() < needed + P2P_READ_SIZE)
+            {
+                conn.buffer.resize(needed + P2P_READ_SIZE);
+            }
+        }
+
+        ssize_t bytes = readSocket(conn, conn.buffer.data() + conn.end, conn.buffer.size() - conn.end);
+        if(bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(bytes <= 0)
+        {
+            return bytes;
+        }
+        conn.end += bytes;
+    }
+}
+
+
+
+/*
+ * Function: messageBuffered
+ * Parameters: a reference to the connection
+ * Return: true if the reassembly buffer already holds a whole message
+ * Description: This function tells whether recvMessage can return without reading from the socket.
+*/
+inline bool messageBuffered(P2PConnection& conn)
+{
+    size_t available = conn.end - conn.start;
+    if(available < P2P_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    uint32_t header;
+    memcpy(&header, conn.buffer.data() + conn.start, P2P_HEADER_SIZE);
+    return available >= P2P_HEADER_SIZE + ntohl(header);
+}
+
+
+
+/*
+ * Function: waitMessage
+ * Parameters: a reference to the connection, the number of milliseconds to wait (-1 waits forever, 0 does not wait)
+ * Return: 1 if a message is buffered or the socket is readable, 0 if the time ran out, -1 on error
+ * Description: This function waits until recvMessage has something to work with. A readable socket may still hold only part of a
+ *              message, in which case recvMessage blocks for the rest.
+*/
+inline int waitMessage(P2PConnection& conn, int timeout)
+{
+    if(conn.recvRing != NULL)
+    {
+        int result = ringEmpty(conn.recvRing) ? ringWait(conn, timeout) : 1;
+        return result > 0 ? 1 : result;
+    }
+    if(messageBuffered(conn))
+    {
+        return 1;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = conn.sock;
+    pfd.events = POLLIN;
+    for(;;)
+    {
+        int result = poll(&pfd, 1, timeout);
+        if(result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        return result;
+    }
+}
+
+
+
+/*
+ * Function: sendFile
+ * Parameters: a reference to the connection, an open file, the number of bytes to send from the start of the file
+ * Return: 1 when every byte was sent, 0 if the peer closed the socket, -1 on error
+ * Description: This function sends the file with sendfile, which copies from the page cache to the socket inside the kernel.
+*/
+inline ssize_t sendFile(P2PConnection& conn, int fd, off_t size)
+{
+    off_t offset = 0;
+    while(offset < size)
+    {
+        ssize_t bytes = sendfile(conn.sock, fd, &offset, size - offset);
+        if(bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(bytes < 0)
+        {
+            return errno == EPIPE || errno == ECONNRESET ? 0 : -1;
+        }
+        if(bytes == 0)
+        {
+            // the file is shorter than announced
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Function: recvFile
+ * Parameters: a reference to the connection, a file open for writing, the number of bytes to receive
+ * Return: 1 when every byte was received, 0 if the peer closed the socket, -1 on error
+ * Description: This function receives the raw bytes of a file into the given file. The file is preallocated to its final size. Bytes
+ *              that arrived along with the announcing message are still in the reassembly buffer and are written first, the rest is
+ *              spliced from the socket through a pipe into the file.
+*/
+inline ssize_t recvFile(P2PConnection& conn, int fd, off_t size)
+{
+    // preallocate, falling back to setting the size on file systems without fallocate
+    if(size > 0 && fallocate(fd, 0, 0, size) < 0 && ftruncate(fd, size) < 0)
+    {
+        return -1;
+    }
+
+    // write the bytes that are already buffered
+    loff_t offset = std::min<off_t>(conn.end - conn.start, size);
+    for(loff_t done = 0; done < offset;)
+    {
+        ssize_t bytes = pwrite(fd, conn.buffer.data() + conn.start + done, offset - done, done);
+        if(bytes <= 0)
+        {
+            return -1;
+        }
+        done += bytes;
+    }
+    conn.start += offset;
+    if(conn.start == conn.end)
+    {
+        conn.start = conn.end = 0;
+    }
+    if(offset == size)
+    {
+        return 1;
+    }
+
+    int pipefd[2];
+    if(pipe(pipefd) < 0)
+    {
+        return -1;
+    }
+
+    // a larger pipe means fewer splices, the default size still works if this fails
+    fcntl(pipefd[1], F_SETPIPE_SZ, P2P_SPLICE_SIZE);
+
+    ssize_t result = 1;
+    while(offset < size && result == 1)
+    {
+        ssize_t in = splice(conn.sock, NULL, pipefd[1], NULL, std::min<off_t>(size - offset, P2P_SPLICE_SIZE), SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(in < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(in <= 0)
+        {
+            result = in;
+            break;
+        }
+
+        while(in > 0 && result == 1)
+        {
+            ssize_t out = splice(pipefd[0], NULL, fd, &offset, in, SPLICE_F_MOVE);
+            if(out < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(out <= 0)
+            {
+                result = -1;
+            }
+            else
+            {
+                in -= out;
+            }
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return result;
+}
+
+
+
+/*
+ * Function: skipBytes
+ * Parameters: a reference to the connection, the number of bytes to drop
+ * Return: 1 when the bytes were dropped, 0 if the peer closed the socket, -1 on error
+ * Description: This function reads and drops the raw bytes of a file that cannot be stored, so the next message can be read.
+*/
+inline ssize_t skipBytes(P2PConnection& conn, off_t size)
+{
+    off_t buffered = std::min<off_t>(conn.end - conn.start, size);
+    conn.start += buffered;
+    if(conn.start == conn.end)
+    {
+        conn.start = conn.end = 0;
+    }
+    size -= buffered;
+
+    std::vector<char> discard(P2P_READ_SIZE);
+    while(size > 0)
+    {
+        ssize_t bytes = readSocket(conn, discard.data(), std::min<off_t>(size, discard.size()));
+        if(bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(bytes <= 0)
+        {
+            return bytes;
+        }
+        size -= bytes;
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Function: baseName
+ * Parameters: a file path
+ * Return: the last component of the path
+ * Description: This function strips the directories from a path so a received file is always stored in the working directory.
+*/
+inline std::string baseName(const std::string& path)
+{
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+
+
+/*
+ * Function: printTransfer
+ * Parameters: what was done, the file name, the number of bytes moved, the seconds taken
+ * Return: None
+ * Description: This function prints the size and throughput of a file transfer.
+*/
+inline void printTransfer(const std::string& action, const std::string& name, off_t bytes, double seconds)
+{
+    std::cout << action << " " << name << ": " << bytes << " byte(s) in " << seconds << " seconds (";
+    std::cout << bytes / 1000000.0 / std::max(seconds, 1e-9) << " MB/s)" << std::endl;
+}
+
+
+
+/*
+ * Function: pinCpu
+ * Parameters: a command line value naming a CPU
+ * Return: 0 on success, -1 if the value is not a CPU number or the CPU cannot be used
+ * Description: This function pins the calling thread, and the threads it starts afterwards, to one CPU.
+*/
+inline int pinCpu(const char* text)
+{
+    char* end;
+    long cpu = strtol(text, &end, 10);
+    if(*end != '\0' || end == text || cpu < 0 || cpu >= CPU_SETSIZE)
+    {
+        return -1;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+
+
+/*
+ * Function: parseSize
+ * Parameters: a command line value
+ * Return: the value as a size, or 0 if it is not a positive number
+ * Description: This function converts a command line number such as a maximum message size.
+*/
+inline size_t parseSize(const char* text)
+{
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if(*end != '\0' || text[0] == '-')
+    {
+        return 0;
+    }
+    return value;
+}
+
+#endif
@@ -0,0 +1,190 @@
+/*
+* Author: Robert Blaine Wilson
+* Date: 6/19/2023
+* Synopsis: This file holds the shared memory ring used by the Peer-to-Peer programs once the handshake has set one up. The client
+*           creates a memfd holding two rings, one for each direction, and passes it to the server over the socket. Each ring has
+*           a single producer and a single consumer: the producer copies a 4 byte length and the message in and then publishes the
+*           new tail, the consumer copies the message out and then publishes the new head. Head and tail only grow, the position
+*           in the data is taken modulo the capacity, which is a power of two. The ring holds no pointers, both processes map it
+*           at different addresses. The peer can write anything into the shared memory, so each side computes the capacity from
+*           the size of the memory instead of trusting the header, and the consumer checks head, tail and length before copying.
+*           A consumer that is about to sleep raises its waiting flag and checks the ring once more, a producer that published a
+*           message checks the flag afterwards. Both sides put a full fence between the two steps, so either the consumer sees
+*           the message or the producer sees the flag and wakes the consumer through its eventfd.
+*/
+
+#ifndef P2P_RING_H
+#define P2P_RING_H
+
+#include <atomic>
+#include <new>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+
+/* The header of one direction of the ring, its data follows right after it */
+struct P2PRing
+{
+    alignas(64) std::atomic<uint64_t> head;     // bytes consumed, only the consumer writes it
+    alignas(64) std::atomic<uint64_t> tail;     // bytes produced, only the producer writes it
+    alignas(64) std::atomic<uint32_t> waiting;  // the consumer sleeps on its eventfd until it is woken
+    uint64_t capacity;                          // bytes of data, a power of two, only checked once when the server attaches
+};
+
+
+
+/*
+ * Function: ringCapacity
+ * Parameters: the size of the shared memory holding both rings
+ * Return: the capacity of each ring, 0 if the memory is too small
+ * Description: This function splits the memory in two halves and returns the largest power of two that fits in a half after the
+ *              ring header. Both processes compute it from the size of the memory.
+*/
+inline uint64_t ringCapacity(size_t size)
+{
+    size_t half = size / 2 / alignof(P2PRing) * alignof(P2PRing);
+    if(half <= sizeof(P2PRing))
+    {
+        return 0;
+    }
+
+    uint64_t capacity = 1;
+    while(capacity * 2 <= half - sizeof(P2PRing))
+    {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+
+
+/*
+ * Function: ringAt
+ * Parameters: the start of the shared memory, the size of the shared memory, 0 for the client's ring and 1 for the server's ring
+ * Return: a pointer to the ring
+ * Description: This function locates one of the two rings. The client's ring carries messages to the server.
+*/
+inline P2PRing* ringAt(void* base, size_t size, int which)
+{
+    size_t half = size / 2 / alignof(P2PRing) * alignof(P2PRing);
+    return (P2PRing*)((char*)base + which * half);
+}
+
+
+
+/*
+ * Function: ringInit
+ * Parameters: a pointer to the ring, the capacity
+ * Return: None
+ * Description: This function constructs an empty ring in freshly mapped memory.
+*/
+inline void ringInit(P2PRing* ring, uint64_t capacity)
+{
+    new (ring) P2PRing();
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+    ring->waiting.store(0, std::memory_order_relaxed);
+    ring->capacity = capacity;
+}
+
+
+
+/*
+ * Function: ringCopy
+ * Parameters: a pointer to the ring, the capacity, a position in the ring, a buffer, the number of bytes, true to copy into the ring
+ * Return: None
+ * Description: This function copies bytes into or out of the ring, wrapping around the end of the data. The size must not exceed
+ *              the capacity.
+*/
+inline void ringCopy(P2PRing* ring, uint64_t capacity, uint64_t position, void* buffer, size_t size, bool into)
+{
+    char* data = (char*)(ring + 1);
+    size_t offset = position & (capacity - 1);
+    size_t first = std::min<size_t>(size, capacity - offset);
+
+    if(into)
+    {
+        memcpy(data + offset, buffer, first);
+        memcpy(data, (char*)buffer + first, size - first);
+    }
+    else
+    {
+        memcpy(buffer, data + offset, first);
+        memcpy((char*)buffer + first, data, size - first);
+    }
+}
+
+
+
+/*
+ * Function: ringEmpty
+ * Parameters: a pointer to the ring
+ * Return: true if the ring holds no message
+ * Description: This function is called by the consumer.
+*/
+inline bool ringEmpty(P2PRing* ring)
+{
+    return ring->tail.load(std::memory_order_acquire) == ring->head.load(std::memory_order_relaxed);
+}
+
+
+
+/*
+ * Function: ringPush
+ * Parameters: a pointer to the ring, the capacity, a pointer to the message, the size of the message
+ * Return: true if the message was published, false if the ring does not have room for it yet
+ * Description: This function is called by the producer. The message must fit in the ring with its length.
+*/
+inline bool ringPush(P2PRing* ring, uint64_t capacity, const void* data, uint32_t size)
+{
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    if(tail + sizeof(size) + size - ring->head.load(std::memory_order_acquire) > capacity)
+    {
+        return false;
+    }
+
+    ringCopy(ring, capacity, tail, &size, sizeof(size), true);
+    ringCopy(ring, capacity, tail + sizeof(size), (void*)data, size, true);
+    ring->tail.store(tail + sizeof(size) + size, std::memory_order_release);
+    return true;
+}
+
+
+
+/*
+ * Function: ringPop
+ * Parameters: a pointer to the ring, the capacity, a reference to a string to store the message
+ * Return: 1 if a message was taken, 0 if the ring is empty, -1 if the ring holds more than its capacity or a length beyond the
+ *         published bytes
+ * Description: This function is called by the consumer. The space is handed back to the producer once the message is copied out.
+ *              Head and tail are read once, a broken ring is left as it is for the caller to close the connection.
+*/
+inline int ringPop(P2PRing* ring, uint64_t capacity, std::string& message)
+{
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    if(tail == head)
+    {
+        return 0;
+    }
+    if(tail - head > capacity || tail - head < sizeof(uint32_t))
+    {
+        return -1;
+    }
+
+    uint32_t size;
+    ringCopy(ring, capacity, head, &size, sizeof(size), false);
+    if(size > tail - head - sizeof(size))
+    {
+        return -1;
+    }
+
+    message.resize(size);
+    ringCopy(ring, capacity, head + sizeof(size), &message[0], size, false);
+    ring->head.store(head + sizeof(size) + size, std::memory_order_release);
+    return 1;
+}
+
+#endif
@@ -2,34 +2,242 @@
 * Author: Robert Blaine Wilson
 * Date: 6/19/2023
 * Synopsis: This file is the server for the Peer-to-Peer program. It used the AF_UNIX address family and accepts one
-*           command line argument, which is the socket file to create. Then this file initializes a socket and listens
+*           command line argument, which is the socket file to create. '@name' creates an abstract socket instead, which leaves no
+*           file behind, and 'tcp:host:port' listens on TCP ('tcp::port' on every interface). Then this file initializes a socket and listens
 *           for incoming connections. After a handshake with the client, the socket reads commands sent from the client 
 *           until the command 'quit' has been sent. After this, the server closes the socket, unlinks the socket file,
 *           and ends the program.
+*           Messages are framed with a length prefix (see p2p_protocol.h), so they can be any size up to the maximum message size
+*           and partial or coalesced reads are reassembled into whole messages.
+*           A client may ask for the pipelined mode in its handshake response ('THANKS PIPELINE n'). The server then stops sending
+*           ENTERCMD and instead acknowledges commands cumulatively with 'ACK <count>' after every n commands, or once the client
+*           has paused for ACK_INTERVAL milliseconds. --quiet stops the server from printing the handshake and every command.
+*           With --persistent the server keeps accepting clients instead of exiting after the first one. The accept loop hands
+*           every connection to a pool of worker threads (--workers, one per core by default), and each worker runs the same
+*           handshake and command loop for its client. 'quit' then ends only that client's session. The listen backlog is set
+*           with --backlog (5 by default). The server runs until it is interrupted, then closes and unlinks the socket file.
+*           A worker is never held by a client that went quiet: a client that has not answered HELLO within --handshake-timeout
+*           seconds (10 by default), or that leaves the session waiting for --idle-timeout seconds (60 by default with --persistent,
+*           no limit otherwise), is closed. The same limit applies to a message that stops arriving half way. When the server runs
+*           out of descriptors it accepts and closes the waiting client with a descriptor it keeps in reserve, rather than retrying
+*           the accept in a loop.
+*           'send <size> <name>' is followed by the raw bytes of a file, which is stored under its name in the working directory.
+*           'get <name>' is answered with 'FILE <size>' and the raw bytes of the file, or 'ERROR <reason>'. Only files of the
+*           working directory are served: the directories are stripped from the name and symbolic links are not followed. Files are sent with
+*           sendfile and received by splicing into a preallocated file, and the throughput of each transfer is printed.
+*           The binary sink command (P2P_OP_SINK, a size) is followed by raw bytes that are read and dropped. 'fds <count> [read]' comes with open descriptors
+*           attached (SCM_RIGHTS). With 'read' the server reads every regular file through its descriptor, the file data never
+*           crosses the connection. The descriptors are closed afterwards.
+*           'echo <text>' is sent straight back. In the classic mode the echo takes the place of the next ENTERCMD, so a latency
+*           benchmark sees exactly one message each way. --busy-poll spins on reads instead of blocking and --cpu n pins the server
+*           to one CPU.
+*           --seqpacket listens with SOCK_SEQPACKET instead of SOCK_STREAM. Every message is then one record without a length
+*           prefix, up to 64 KB. Commands that carry raw file bytes ('send', 'get', 'sink') need the stream transport and end the
+*           session.
+*           The binary stream command (P2P_OP_STREAM, a count) is followed by count messages that are received and dropped, the
+*           next ENTERCMD tells the client they have all arrived. The client uses it to measure throughput. Both benchmark commands
+*           have no text keyword, so a typed 'sink' or 'stream' line is only printed like any other text.
+*           A handshake response ending in 'SHM <bytes>' offers a shared memory ring, its memfd and eventfds come attached. The
+*           server answers 'SHM' and from then on exchanges every message through the ring, or 'NOSHM' and keeps the socket.
+*           Every command may also be sent in the binary format of p2p_command.h: an opcode and length prefixed fields. Both
+*           formats are decoded into the same command and dispatched through a table indexed by the opcode, where every command
+*           is registered with its text keyword, its handler, and how many fields it takes. A text command is looked up by its
+*           first word and split on spaces, its last field takes the rest of the line. Text that matches no command is printed.
 * Help: While writting this file, I followed along the material provided in Module 2.
 * Compilation: g++ -c p2p_server.cpp
-*              g++ -o p2p_server p2p_server.o
+*              g++ -pthread -o p2p_server p2p_server.o
+* Usage: ./p2p_server <socket file> [--max-message bytes] [--quiet] [--persistent] [--backlog n] [--workers n] [--busy-poll] [--cpu n]
+*                                    [--seqpacket] [--handshake-timeout seconds] [--idle-timeout seconds]
 */
 
 #include <iostream>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <csignal>
+#include <chrono>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
+#include "p2p_protocol.h"
+#include "p2p_command.h"
+
+
+const int ACK_INTERVAL = 10;    // milliseconds a pipelined client may pause before its commands are acknowledged
+const int SHED_BACKOFF = 10;    // milliseconds to wait when no descriptor could be freed to turn a client away
+const int MAX_TIMEOUT = 86400;  // seconds, the longest handshake or idle timeout
+
+
+/* Globals */
+int serverSock;                 // listening socket
+char* socketFile;               // socket file to unlink on exit, NULL for abstract and TCP addresses
+
+struct serverOptions
+{
+    size_t maxMessage;          // largest message accepted from a client
+    bool quiet;                 // do not print every command
+    bool busyPoll;              // spin on reads instead of blocking
+    int handshakeTimeout;       // milliseconds to answer HELLO, 0 for no limit
+    int idleTimeout;            // milliseconds a client may leave the session waiting, 0 for no limit
+};
+
+struct connectionQueue
+{
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<int> sockets;    // accepted sockets waiting for a worker
+};
+
+struct sessionState
+{
+    const serverOptions* options;
+    bool pipelined;             // commands are acknowledged in batches instead of answered with ENTERCMD
+    uint64_t commands;          // commands received
+    uint64_t acked;             // commands acknowledged
+    bool echoed;                // an echo reply already asked for the next command
+};
+
+// A handler returns 1 to read the next command, 0 to end the session, -1 after it printed an error that ends the session
+typedef int (*commandHandler)(P2PConnection&, const P2PCommand&, sessionState&);
+
+struct commandEntry
+{
+    const char* name;           // text keyword, NULL if the command is binary only
+    commandHandler handler;     // NULL if the opcode is not registered
+    int minFields;
+    int maxFields;
+    bool rawBytes;              // raw bytes follow the command, which needs the stream transport
+};
+
+commandEntry commandTable[256];         // registered commands by opcode, filled before any client is served
+std::vector<uint8_t> textCommands;      // opcodes that have a text keyword
+
+
+/* Function Prototypes */
+int serveClient(int, const serverOptions&);
+int acceptLoop(const serverOptions&, int);
+void workerLoop(connectionQueue*, const serverOptions*);
+void shedConnection(int&, const serverOptions&);
+void setReceiveTimeout(int, int);
+void signalHandler(int);
+void removeSocketFile();
+ssize_t sendAck(P2PConnection&, uint64_t);
+void registerCommand(uint8_t, const char*, commandHandler, int, int, bool);
+void registerCommands();
+void parseText(const std::string&, P2PCommand&);
+int dispatchCommand(P2PConnection&, const P2PCommand&, sessionState&);
+int handleSay(P2PConnection&, const P2PCommand&, sessionState&);
+int handleQuit(P2PConnection&, const P2PCommand&, sessionState&);
+int handleEcho(P2PConnection&, const P2PCommand&, sessionState&);
+int handleSend(P2PConnection&, const P2PCommand&, sessionState&);
+int handleGet(P2PConnection&, const P2PCommand&, sessionState&);
+int handleSink(P2PConnection&, const P2PCommand&, sessionState&);
+int handleDescriptors(P2PConnection&, const P2PCommand&, sessionState&);
+int handleStream(P2PConnection&, const P2PCommand&, sessionState&);
 
 
 int main(int argc, char* argv[])
 {
     // Validate the socket file command line argument to ensure the OS can later bind the socket.
-    if(argc != 2)
+    if(argc < 2)
     {
         std::cout << "Expecting a single command line argument, which is the socket file to create." << std::endl;
-        std::cout << "i.e: ./p2p_server socketFile.sock" << std::endl;
+        std::cout << "i.e: ./p2p_server socketFile.sock [--max-message bytes] [--quiet] [--persistent] [--backlog n] [--workers n] [--busy-poll] [--cpu n]" << std::endl;
+        std::cout << "                                  [--seqpacket] [--handshake-timeout seconds] [--idle-timeout seconds]" << std::endl;
+        return -1;
+    }
+
+
+    // Validate the options.
+    serverOptions options;
+    options.maxMessage = P2P_DEFAULT_MAX_MESSAGE;
+    options.quiet = false;
+    options.busyPoll = false;
+    options.handshakeTimeout = 10000;
+    options.idleTimeout = -1;
+    bool persistent = false;
+    int backlog = 5;
+    int workers = std::max(1u, std::thread::hardware_concurrency());
+    int type = SOCK_STREAM;
+    for(int i = 2; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--max-message") == 0 && i + 1 < argc && parseSize(argv[i+1]) > 0)
+        {
+            options.maxMessage = parseSize(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--quiet") == 0)
+        {
+            options.quiet = true;
+        }
+        else if(strcmp(argv[i], "--persistent") == 0)
+        {
+            persistent = true;
+        }
+        else if(strcmp(argv[i], "--backlog") == 0 && i + 1 < argc && parseSize(argv[i+1]) > 0)
+        {
+            backlog = parseSize(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--workers") == 0 && i + 1 < argc && parseSize(argv[i+1]) > 0)
+        {
+            workers = parseSize(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--busy-poll") == 0)
+        {
+            options.busyPoll = true;
+        }
+        else if(strcmp(argv[i], "--seqpacket") == 0)
+        {
+            type = SOCK_SEQPACKET;
+        }
+        else if(strcmp(argv[i], "--handshake-timeout") == 0 && i + 1 < argc && (parseSize(argv[i+1]) > 0 || strcmp(argv[i+1], "0") == 0))
+        {
+            options.handshakeTimeout = std::min<size_t>(parseSize(argv[++i]), MAX_TIMEOUT) * 1000;
+        }
+        else if(strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc && (parseSize(argv[i+1]) > 0 || strcmp(argv[i+1], "0") == 0))
+        {
+            options.idleTimeout = std::min<size_t>(parseSize(argv[++i]), MAX_TIMEOUT) * 1000;
+        }
+        else if(strcmp(argv[i], "--cpu") == 0 && i + 1 < argc)
+        {
+            if(pinCpu(argv[++i]) < 0)
+            {
+                std::cout << "Could not pin the server to CPU " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else
+        {
+            std::cout << "Unknown or incomplete option " << argv[i] << std::endl;
+            return -1;
+        }
+    }
+
+
+    // a persistent server limits idle sessions unless told otherwise, each one holds a worker
+    if(options.idleTimeout < 0)
+    {
+        options.idleTimeout = persistent ? 60000 : 0;
+    }
+
+
+    registerCommands();
+
+
+    // Initialize the address structure from the socket file, abstract name, or TCP address. This decorates the socket to be later bound by the OS.
+    P2PAddress address;
+    if(resolveAddress(argv[1], type, address) < 0)
+    {
+        std::cout << "Invalid address " << argv[1] << ", TCP addresses are tcp:host:port and carry SOCK_STREAM only..." << std::endl;
         return -1;
     }
 
 
     // Initialize a new socket to be used by the server, if the return value is negative then there are errors.
-    int serverSock = socket(AF_UNIX, SOCK_STREAM, 0);
+    serverSock = openSocket(address, type);
     if(serverSock < 0)
     {
         std::cout << "Could not initialize server socket..." << std::endl;
@@ -37,14 +245,9 @@ int main(int argc, char* argv[])
     }
 
 
-    // Initialize the un sockaddress structure. This decorates the AF_UNIX socket to be later bound by the OS.
-    struct sockaddr_un un;
-    un.sun_family = AF_UNIX;
-    strncpy(un.sun_path, argv[1], sizeof(un.sun_path) - 1);
-
-
     // Bind the socket to the OS. A negative return value indicates an error.
-    int result = bind(serverSock, (const sockaddr*)&un, sizeof(un));
+    socketFile = address.socketFile ? argv[1] : NULL;
+    int result = bind(serverSock, (const sockaddr*)&address.storage, address.length);
     if(result < 0)
     {
         std::cout << "Error binding the socket to the Operating System..." << std::endl;
@@ -54,47 +257,94 @@ int main(int argc, char* argv[])
 
 
     // Listen for incoming connections on the bound socket. A negative return value indicates an error.
-    result = listen(serverSock, 5);
+    result = listen(serverSock, backlog);
     if(result < 0)
     {
         std::cout << "Error listening on the socket for incoming connections..." << std::endl;
         close(serverSock);
-        unlink(argv[1]);
+        removeSocketFile();
         return -1;
     }
 
 
+    // A client that hangs up mid reply must only end its own session. sendfile has no MSG_NOSIGNAL, so SIGPIPE is ignored in every mode
+    signal(SIGPIPE, SIG_IGN);
+
+
+    // In the persistent mode the server keeps accepting until it is interrupted.
+    if(persistent)
+    {
+        signal(SIGINT, signalHandler);
+        int status = acceptLoop(options, workers);
+        close(serverSock);
+        removeSocketFile();
+        return status;
+    }
+
+
     // Accept an incoming connection on the server socket. When a client has connected, a new dedicated socket is used for the connection
-    struct sockaddr_un clientAddr;
-    socklen_t csize;
+    struct sockaddr_storage clientAddr;
+    socklen_t csize = sizeof(clientAddr);
     int clientSock = accept(serverSock, (struct sockaddr*)&clientAddr, &csize);
+    int status = clientSock < 0 ? -1 : serveClient(clientSock, options);
 
 
+    // close the server socket
+    close(serverSock);
+    // close the client socket
+    close(clientSock);
+    // unlink the bound socket file
+    removeSocketFile();
+
+    return status;
+}
+
 
+
+/*
+ * Function: sendAck
+ * Parameters: a reference to the connection, the number of commands received so far
+ * Return: the result of sendMessage
+ * Description: This function acknowledges every pipelined command received so far with 'ACK <count>'.
+*/
+ssize_t sendAck(P2PConnection& conn, uint64_t commands)
+{
+    std::string ack = "ACK " + std::to_string(commands);
+    return sendMessage(conn, ack);
+}
+
+
+
+/*
+ * Function: serveClient
+ * Parameters: a connected client socket, the server options
+ * Return: 0 when the session ended normally, -1 on error
+ * Description: This function runs one client session: the HELLO/THANKS handshake followed by the command loop, in the classic
+ *              or the pipelined mode, until the client quits or closes the socket. The caller closes the socket.
+*/
+int serveClient(int clientSock, const serverOptions& options)
+{
     /* HANDSHAKE PROTOCOL */
-    char writeBuffer[100];      // write buffer to be used
-    char readBuffer[100];       // read buffer to be used
+    P2PConnection conn;         // framed connection to the client
+    std::string writeBuffer;    // message to send
+    std::string readBuffer;     // message received
     ssize_t bytes;
+    initConnection(conn, clientSock, options.maxMessage);
+    conn.busyPoll = options.busyPoll;
 
     // send initial response to the client show they have successfully connected. 
     // -- 0 bytes returned indicates the client has closed the connection.
     // -- negative bytes returned indicates there was an error sending data to the client
-    strcpy(writeBuffer, "HELLO");
-    bytes = write(clientSock, writeBuffer, sizeof(writeBuffer));
+    writeBuffer = "HELLO";
+    bytes = sendMessage(conn, writeBuffer);
     if(bytes == 0)
     {
         std::cout << "The socket has been closed by the client..." << std::endl;
-        close(serverSock);
-        close(clientSock);
-        unlink(argv[1]);
         return 0;
     }
     else if(bytes < 0)
     {
         std::cout << "There was an error writting bytes to the socket..." << std::endl;
-        close(clientSock);
-        close(serverSock);
-        unlink(argv[1]);
         return -1;
     }
     
@@ -102,37 +352,83 @@ int main(int argc, char* argv[])
     // read handshake response from the client
     // -- 0 bytes returned indicates the client has closed the connection.
     // -- negative bytes returned indicates there was an error reading from the client.
-    bytes = read(clientSock, readBuffer, sizeof(readBuffer));
+    setReceiveTimeout(clientSock, options.handshakeTimeout);
+    if(options.handshakeTimeout > 0 && waitMessage(conn, options.handshakeTimeout) == 0)
+    {
+        std::cout << "The client did not answer the handshake in time..." << std::endl;
+        return -1;
+    }
+    bytes = recvMessage(conn, readBuffer);
     if(bytes == 0)
     {
         std::cout << "The socket has been closed by the client..." << std::endl;
-        close(clientSock);
-        close(serverSock);
-        unlink(argv[1]);
         return 0;
     }
     else if(bytes < 0)
     {
         std::cout << "There was an error reading bytes from the socket..." << std::endl;
-        close(clientSock);
-        close(serverSock);
-        unlink(argv[1]);
         return -1;
     }
-    else
+    else if(!options.quiet)
     {
-        readBuffer[bytes] = '\0';
         std::cout << "Client says '";
         std::cout << readBuffer;
         std::cout << "'" << std::endl;
     }
 
 
+    // The handshake response selects the pipelined mode and how many commands to acknowledge at once.
+    size_t ackEvery = 0;
+    size_t found = readBuffer.find(" PIPELINE ");
+    if(readBuffer.compare(0, 6, "THANKS") == 0 && found != std::string::npos)
+    {
+        ackEvery = strtoull(readBuffer.c_str() + found + 10, NULL, 10);
+    }
+
+    // It may also offer a shared memory ring, which is answered over the socket before messages move to the ring.
+    found = readBuffer.find(" SHM ");
+    if(readBuffer.compare(0, 6, "THANKS") == 0 && found != std::string::npos)
+    {
+        bool attached = attachShared(conn, strtoull(readBuffer.c_str() + found + 5, NULL, 10)) == 0;
+        if(sendMessage(conn, std::string(attached ? "SHM" : "NOSHM")) <= 0)
+        {
+            std::cout << "There was an error writting bytes to the socket..." << std::endl;
+            return -1;
+        }
+        if(attached)
+        {
+            startShared(conn, false);
+        }
+    }
+    sessionState session;
+    session.options = &options;
+    session.pipelined = ackEvery > 0;
+    session.commands = 0;
+    session.acked = 0;
+    session.echoed = false;
+    P2PCommand command;
+
+
     // handshake protocol is now validated. Loop to accept commands from client can now be started.
-    strcpy(writeBuffer, "ENTERCMD");
+    setReceiveTimeout(clientSock, options.idleTimeout);
+    writeBuffer = "ENTERCMD";
     while(true){
-        // tell the client to enter a command
-        bytes = write(clientSock, writeBuffer, sizeof(writeBuffer));
+        // tell the client to enter a command, or in the pipelined mode acknowledge the outstanding commands once the client pauses
+        bytes = 1;
+        if(!session.pipelined)
+        {
+            if(!session.echoed)
+            {
+                bytes = sendMessage(conn, writeBuffer);
+            }
+        }
+        else if(session.commands > session.acked && waitMessage(conn, ACK_INTERVAL) == 0)
+        {
+            bytes = sendAck(conn, session.commands);
+            session.acked = session.commands;
+        }
+        session.echoed = false;
+
         if(bytes == 0)
         {
             std::cout << "The socket has been closed by the client..." << std::endl;
@@ -145,7 +441,12 @@ int main(int argc, char* argv[])
         }
 
         // read command from the client
-        bytes = read(clientSock, readBuffer, sizeof(readBuffer));
+        if(options.idleTimeout > 0 && waitMessage(conn, options.idleTimeout) == 0)
+        {
+            std::cout << "The client was idle for too long..." << std::endl;
+            break;
+        }
+        bytes = recvMessage(conn, readBuffer);
         if(bytes == 0)
         {
             std::cout << "The socket was closed by the client..." << std::endl;
@@ -153,33 +454,581 @@ int main(int argc, char* argv[])
         }
         else if(bytes < 0)
         {
-            std::cout << "There was an error reading from the socket..." << std::endl;
+            std::cout << "There was an error reading from the socket: " << strerror(errno) << std::endl;
             break;
         }
         else
         {
-            // If the command 'quit' has been recieved, then exit the server.
-            if(strcmp(readBuffer, "quit") == 0)
+            session.commands++;
+
+            // decode a binary command in place, or split a text command, and run its handler
+            if(!decodeCommand(readBuffer, command))
+            {
+                parseText(readBuffer, command);
+            }
+            if(dispatchCommand(conn, command, session) <= 0)
             {
-                std::cout << "Client quit, see ya" << std::endl;
                 break;
             }
-            else
+
+            // acknowledge a full batch of pipelined commands
+            if(session.pipelined && session.commands - session.acked >= ackEvery)
             {
-                readBuffer[bytes] = '\0';
-                std::cout << "Client says '";
-                std::cout << readBuffer;
-                std::cout << "'" << std::endl;
+                if(sendAck(conn, session.commands) <= 0)
+                {
+                    std::cout << "There was an error writting to the socket..." << std::endl;
+                    break;
+                }
+                session.acked = session.commands;
             }
         }
     }
 
-    // close the server socket
+    return 0;
+}
+
+
+
+/*
+ * Function: acceptLoop
+ * Parameters: the server options, the number of worker threads
+ * Return: -1 if accepting fails, otherwise it does not return
+ * Description: This function starts the worker threads and then accepts clients forever, queueing every new socket for the next
+ *              idle worker. Accepting never waits on a session, so short lived clients are taken as fast as they connect. A descriptor
+ *              is kept in reserve for turning clients away once the process runs out of them.
+*/
+int acceptLoop(const serverOptions& options, int workers)
+{
+    connectionQueue queue;
+    for(int i = 0; i < workers; i++)
+    {
+        std::thread(workerLoop, &queue, &options).detach();
+    }
+
+    int reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    for(;;)
+    {
+        int clientSock = accept(serverSock, NULL, NULL);
+        if(clientSock < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if(errno == EMFILE || errno == ENFILE)
+            {
+                shedConnection(reserve, options);
+                continue;
+            }
+            std::cout << "Error accepting a connection: " << strerror(errno) << std::endl;
+            return -1;
+        }
+
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.sockets.push_back(clientSock);
+        queue.ready.notify_one();
+    }
+}
+
+
+
+/*
+ * Function: workerLoop
+ * Parameters: a pointer to the connection queue, a pointer to the server options
+ * Return: None
+ * Description: This function runs on each worker thread. It takes the next accepted socket, serves the client, and closes the socket.
+*/
+void workerLoop(connectionQueue* queue, const serverOptions* options)
+{
+    for(;;)
+    {
+        int clientSock;
+        {
+            std::unique_lock<std::mutex> guard(queue->lock);
+            queue->ready.wait(guard, [queue] { return !queue->sockets.empty(); });
+            clientSock = queue->sockets.front();
+            queue->sockets.pop_front();
+        }
+
+        serveClient(clientSock, *options);
+        close(clientSock);
+    }
+}
+
+
+
+/*
+ * Function: shedConnection
+ * Parameters: a reference to the reserve descriptor, the server options
+ * Return: None
+ * Description: This function turns away the client waiting on the listening socket when the process is out of descriptors. The
+ *              reserve descriptor is closed to make room for the accept, the client is closed at once, and the reserve is opened
+ *              again. The listening socket stays readable while clients wait, so without this the accept loop would spin. If
+ *              nothing could be freed the loop waits SHED_BACKOFF milliseconds for a session to end.
+*/
+void shedConnection(int& reserve, const serverOptions& options)
+{
+    if(reserve >= 0)
+    {
+        close(reserve);
+    }
+
+    int clientSock = accept(serverSock, NULL, NULL);
+    if(clientSock >= 0)
+    {
+        close(clientSock);
+        if(!options.quiet)
+        {
+            std::cout << "Out of file descriptors, a client was turned away..." << std::endl;
+        }
+    }
+
+    reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if(clientSock < 0 || reserve < 0)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(SHED_BACKOFF));
+    }
+}
+
+
+
+/*
+ * Function: setReceiveTimeout
+ * Parameters: a socket, the number of milliseconds, 0 for no limit
+ * Return: None
+ * Description: This function limits how long a read of the socket may block (SO_RCVTIMEO). A read that runs out of time fails with
+ *              EAGAIN, which ends the session, so a client that stops in the middle of a message cannot hold its worker.
+*/
+void setReceiveTimeout(int sock, int timeout)
+{
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = timeout % 1000 * 1000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+
+
+/*
+ *  Function: signalHandler
+ *  Parameters: integer representing an interrupt signal
+ *  Return: None
+ *  Description: This function closes the server socket and unlinks the socket file before a persistent server terminates.
+*/
+void signalHandler(int signal)
+{
+    // clear signal
+    (void)signal;
+
     close(serverSock);
-    // close the client socket
-    close(clientSock);
-    // unlink the bound socket file
-    unlink(argv[1]);
+    removeSocketFile();
+    _exit(EXIT_SUCCESS);
+}
+
+
+
+/*
+ *  Function: removeSocketFile
+ *  Parameters: None
+ *  Return: None
+ *  Description: This function unlinks the socket file. Abstract and TCP addresses have no file to remove.
+*/
+void removeSocketFile()
+{
+    if(socketFile != NULL)
+    {
+        unlink(socketFile);
+    }
+}
+
+
+
+/*
+ * Function: registerCommand
+ * Parameters: the opcode, the text keyword (NULL for a binary only command), the handler, the fewest and the most fields,
+ *             true if raw bytes follow the command
+ * Return: None
+ * Description: This function adds a command to the dispatch table. It must be called before any client is served, the workers
+ *              only read the table.
+*/
+void registerCommand(uint8_t opcode, const char* name, commandHandler handler, int minFields, int maxFields, bool rawBytes)
+{
+    commandTable[opcode] = {name, handler, minFields, std::min(maxFields, P2P_MAX_FIELDS), rawBytes};
+    if(name != NULL)
+    {
+        textCommands.push_back(opcode);
+    }
+}
+
+
+
+/*
+ * Function: registerCommands
+ * Parameters: None
+ * Return: None
+ * Description: This function registers the commands of the server.
+*/
+void registerCommands()
+{
+    registerCommand(P2P_OP_SAY, NULL, handleSay, 1, 1, false);
+    registerCommand(P2P_OP_QUIT, "quit", handleQuit, 0, 0, false);
+    registerCommand(P2P_OP_ECHO, "echo", handleEcho, 0, P2P_MAX_FIELDS, false);
+    registerCommand(P2P_OP_SEND, "send", handleSend, 2, 2, true);
+    registerCommand(P2P_OP_GET, "get", handleGet, 1, 1, true);
+    registerCommand(P2P_OP_SINK, NULL, handleSink, 1, 1, true);
+    registerCommand(P2P_OP_FDS, "fds", handleDescriptors, 1, 2, false);
+    registerCommand(P2P_OP_STREAM, NULL, handleStream, 1, 1, false);
+}
+
+
+
+/*
+ * Function: parseText
+ * Parameters: a reference to the text command, a reference to the command to fill
+ * Return: None
+ * Description: This function looks up the first word of a text command among the registered keywords and splits the rest on
+ *              spaces, the last field taking whatever is left. A line that matches no command, or has too few or too many
+ *              fields for it, becomes a P2P_OP_SAY command holding the whole line. The fields point into the text.
+*/
+void parseText(const std::string& message, P2PCommand& command)
+{
+    size_t space = message.find(' ');
+    size_t length = space == std::string::npos ? message.size() : space;
+    command.binary = false;
+    command.message = &message;
+
+    for(uint8_t opcode : textCommands)
+    {
+        const commandEntry& entry = commandTable[opcode];
+        if(strlen(entry.name) != length || message.compare(0, length, entry.name) != 0)
+        {
+            continue;
+        }
+
+        command.opcode = opcode;
+        command.count = 0;
+        size_t start = length + 1;
+        while(start < message.size() && command.count < entry.maxFields)
+        {
+            size_t end = command.count + 1 == entry.maxFields ? std::string::npos : message.find(' ', start);
+            if(end == std::string::npos)
+            {
+                end = message.size();
+            }
+            command.fields[command.count++] = {message.data() + start, end - start};
+            start = end + 1;
+        }
+        if(start >= message.size() && command.count >= entry.minFields)
+        {
+            return;
+        }
+        break;
+    }
+
+    command.opcode = P2P_OP_SAY;
+    command.count = 1;
+    command.fields[0] = {message.data(), message.size()};
+}
+
+
 
+/*
+ * Function: dispatchCommand
+ * Parameters: a reference to the connection, a reference to the decoded command, a reference to the session state
+ * Return: the result of the handler, 1 if the command is unknown
+ * Description: This function runs the handler registered for the opcode. Unknown opcodes and binary commands with a wrong number
+ *              of fields are reported and skipped, commands that carry raw bytes end a SOCK_SEQPACKET session.
+*/
+int dispatchCommand(P2PConnection& conn, const P2PCommand& command, sessionState& session)
+{
+    const commandEntry& entry = commandTable[command.opcode];
+    if(entry.handler == NULL || command.count < entry.minFields || command.count > entry.maxFields)
+    {
+        if(!session.options->quiet)
+        {
+            std::cout << "Client sent an invalid command (opcode " << (int)command.opcode << ", " << command.count << " field(s))" << std::endl;
+        }
+        return 1;
+    }
+
+    if(entry.rawBytes && conn.seqpacket)
+    {
+        std::cout << "File transfers need the stream transport..." << std::endl;
+        return -1;
+    }
+    return entry.handler(conn, command, session);
+}
+
+
+
+/*
+ * Function: handleSay
+ * Parameters: a reference to the connection, the command holding one field of text, a reference to the session state
+ * Return: 1
+ * Description: This function prints what the client said.
+*/
+int handleSay(P2PConnection& conn, const P2PCommand& command, sessionState& session)
+{
+    (void)conn;
+    if(!session.options->quiet)
+    {
+        std::cout << "Client says '";
+        std::cout.write(command.fields[0].data, command.fields[0].size);
+        std::cout << "'" << std::endl;
+    }
+    return 1;
+}
+
+
+
+/*
+ * Function: handleQuit
+ * Parameters: a reference to the connection, the command, a reference to the session state
+ * Return: 0
+ * Description: This function ends the session. A pipelined client gets its last commands acknowledged first.
+*/
+int handleQuit(P2PConnection& conn, const P2PCommand& command, sessionState& session)
+{
+    (void)command;
+    if(session.pipelined)
+    {
+        sendAck(conn, session.commands);
+    }
+    if(!session.options->quiet)
+    {
+        std::cout << "Client quit, see ya" << std::endl;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+
+
+/*
+ * Function: handleEcho
+ * Parameters: a reference to the connection, the command, a reference to the session state
+ * Return: 1 when the command was sent back, -1 on error
+ * Description: This function sends the whole command back in the format it came in. In the classic mode the reply takes the
+ *              place of the next ENTERCMD.
+*/
+int handleEcho(P2PConnection& conn, const P2PCommand& command, sessionState& session)
+{
+    if(sendMessage(conn, *command.message) <= 0)
+    {
+        std::cout << "There was an error writting to the socket..." << std::endl;
+        return -1;
+    }
+    session.echoed = true;
+    return 1;
+}
+
+
+
+/*
+ * Function: handleSend
+ * Parameters: a reference to the connection, the command holding the size and the name of the file, a reference to the session state
+ * Return: 1 when the file was read off the socket (even if it could not be stored), -1 otherwise
+ * Description: This function stores an uploaded file under its base name in the working directory. A file that cannot be stored
+ *              is still read off the socket. As with a download, a symbolic link is refused, and so is anything but a regular file:
+ *              the file is only truncated once fstat has shown it is one, and O_NONBLOCK keeps a FIFO without a reader from
+ *              blocking the open.
+*/
+int handleSend(P2PConnection& conn, const P2PCommand& command, sessionState& session)
+{
+    auto start = std::chrono::steady_clock::now();
+    uint64_t size;
+    std::string name = baseName(std::string(command.fields[1].data, command.fields[1].size));
+    if(!fieldNumber(command, 0, size) || (off_t)size < 0)
+    {
+        std::cout << "Client announced a file of an invalid size..." << std::endl;
+        return -1;
+    }
+
+    ssize_t bytes;
+    bool allowed = !name.empty() && name != "." && name != "..";
+    int fd = allowed ? open(name.c_str(), O_WRONLY | O_CREAT | O_NOFOLLOW | O_NONBLOCK, 0644) : -1;
+    struct stat info;
+    if(fd >= 0 && (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) || ftruncate(fd, 0) < 0))
+    {
+        close(fd);
+        fd = -1;
+    }
+    if(fd < 0)
+    {
+        std::cout << "Cannot store '" << name << "'" << std::endl;
+        bytes = skipBytes(conn, size);
+    }
+    else
+    {
+        bytes = recvFile(conn, fd, size);
+        close(fd);
+        if(bytes > 0 && !session.options->quiet)
+        {
+            printTransfer("Received", name, size, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+    }
+
+    if(bytes <= 0)
+    {
+        std::cout << "There was an error transferring a file over the socket..." << std::endl;
+        return -1;
+    }
+    return 1;
+}
+
+
+
+/*
+ * Function: handleGet
+ * Parameters: a reference to the connection, the command holding the name of the file, a reference to the session state
+ * Return: 1 when the file or an error was sent, -1 otherwise
+ * Description: This function answers with 'FILE <size>' and the raw bytes of the file, or with 'ERROR <reason>' if the file
+ *              cannot be opened. Like an upload, the file is looked up under its base name in the working directory, and a
+ *              symbolic link is refused, so a client cannot read anything outside of it.
+*/
+int handleGet(P2PConnection& conn, const P2PCommand& command, sessionState& session)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::string path = baseName(std::string(command.fields[0].data, command.fields[0].size));
+    bool allowed = !path.empty() && path != "." && path != "..";
+    ssize_t bytes;
+
+    int fd = allowed ? open(path.c_str(), O_RDONLY | O_NOFOLLOW) : -1;
+    if(!allowed)
+    {
+        errno = EACCES;
+    }
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) < 0 || !S_ISREG(info.st_mode))
+    {
+        std::string reply = "ERROR " + path + ": " + (fd < 0 ? strerror(errno) : "not a regular file");
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        bytes = sendMessage(conn, reply);
+    }
+    else
+    {
+        std::string reply = "FILE " + std::to_string(info.st_size);
+        bytes = sendMessage(conn, reply);
+        if(bytes > 0)
+        {
+            bytes = sendFile(conn, fd, info.st_size);
+        }
+        close(fd);
+
+        if(bytes > 0 && !session.options->quiet)
+        {
+            printTransfer("Sent", path, info.st_size, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+    }
+
+    if(bytes <= 0)
+    {
+        std::cout << "There was an error transferring a file over the socket..." << std::endl;
+        return -1;
+    }
+    return 1;
+}
+
+
+
+/*
+ * Function: handleSink
+ * Parameters: a reference to the connection, the command holding the number of bytes, a reference to the session state
+ * Return: 1 when the bytes were read and dropped, -1 otherwise
+ * Description: This function reads the raw bytes that follow the command and throws them away.
+*/
+int handleSink(P2PConnection& conn, const P2PCommand& command, sessionState& session)
+{
+    (void)session;
+    uint64_t size;
+    if(!fieldNumber(command, 0, size) || skipBytes(conn, size) <= 0)
+    {
+        std::cout << "There was an error transferring a file over the socket..." << std::endl;
+        return -1;
+    }
+    return 1;
+}
+
+
+
+/*
+ * Function: handleDescriptors
+ * Parameters: a reference to the connection, the command holding the count and an optional 'read', a reference to the session state
+ * Return: 1 when the descriptors were handled, -1 if fewer descriptors arrived than announced
+ * Description: This function claims the descriptors that came with the command. With 'read' every regular file is read to the end
+ *              through its descriptor and the throughput is printed. Every descriptor is closed.
+*/
+int handleDescriptors(P2PConnection& conn, const P2PCommand& command, sessionState& session)
+{
+    uint64_t count;
+    bool readFiles = fieldEquals(command, 1, "read");
+    if(!fieldNumber(command, 0, count) || conn.fds.size() < count)
+    {
+        std::cout << "The client did not pass the descriptors it announced..." << std::endl;
+        return -1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<char> buffer(readFiles ? P2P_SPLICE_SIZE : 0);
+    off_t total = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        int fd = conn.fds.front();
+        conn.fds.pop_front();
+
+        struct stat info;
+        if(readFiles && fstat(fd, &info) == 0 && S_ISREG(info.st_mode))
+        {
+            ssize_t bytes;
+            for(off_t offset = 0; (bytes = pread(fd, buffer.data(), buffer.size(), offset)) > 0; offset += bytes)
+            {
+                total += bytes;
+            }
+        }
+        close(fd);
+    }
+
+    if(readFiles && !session.options->quiet)
+    {
+        printTransfer("Read", std::to_string(count) + " passed descriptor(s)", total, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return 1;
+}
+
+
+
+/*
+ * Function: handleStream
+ * Parameters: a reference to the connection, the command holding the number of messages, a reference to the session state
+ * Return: 1 when every message was received, -1 otherwise
+ * Description: This function receives and drops the announced number of messages and prints the throughput.
+*/
+int handleStream(P2PConnection& conn, const P2PCommand& command, sessionState& session)
+{
+    uint64_t count;
+    uint64_t total = 0;
+    std::string message;
+    if(!fieldNumber(command, 0, count))
+    {
+        count = 0;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for(uint64_t i = 0; i < count; i++)
+    {
+        if(recvMessage(conn, message) <= 0)
+        {
+            std::cout << "There was an error reading a stream of messages..." << std::endl;
+            return -1;
+        }
+        total += message.size();
+    }
+
+    if(!session.options->quiet)
+    {
+        printTransfer("Received", std::to_string(count) + " message(s)", total, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return 1;
+}
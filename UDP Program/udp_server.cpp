@@ -8,13 +8,25 @@
  *               a maximum number of 1500 bytes. The server prints the source port, destination port, length, and checksum recieved from the UDP packet.
  *               The server also verifies the checksum to ensure the data is not corrupt. Finally, the server prints the data in hexadecimal in 8 octets 
  *               per line.
+ *
+ *               With --capture, every packet received is also written to encrypted capture files in the given directory. The receive
+ *               loop only copies the packet into a ring buffer, a writer thread frames each packet with its 2 byte length, encrypts
+ *               the stream with the block cipher of the Cipher Program, and writes it out. The capture is cut into segments and each
+ *               segment starts from the freshly expanded key of its own key value, the capture key with the segment number mixed in,
+ *               so no two segments share a keystream. Any segment can still be decrypted on its own (and segments in parallel) with
+ *               --decode, or with ./cipher and the segment key the server prints when it starts the segment. Packets are dropped and counted rather than stalling the receive loop if the writer
+ *               ever falls a full ring behind. The writer sleeps on an eventfd while the ring is empty and the receive loop wakes it.
+ *               A segment is the encrypted stream of frames, each frame a 2 byte packet length in network byte order followed by the
+ *               packet. --decode decrypts one segment and prints its packets the same way the server prints the packets it receives,
+ *               it takes the segment number from the capture-NNNNNN.bin file name.
  *  
  *  Help:        While writting this file, I followed along with the material provided in module 5.
  * 
- *  Compilation: g++ -c udp_server.cpp
- *               g++ -o udp_server udp_server.o
+ *  Compilation: g++ -O2 -c udp_server.cpp
+ *               g++ -pthread -o udp_server udp_server.o
  * 
- *  Usage:       ./udp_server <socket file>
+ *  Usage:       ./udp_server <socket file> [--capture <directory> <key> [segment megabytes]]
+ *               ./udp_server --decode <capture file> <key>
 */
 
 #include <iostream>
@@ -23,6 +35,13 @@
 #include <sys/signal.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include "../Cipher Program/cipher.h"
 
 using namespace std;
 
@@ -30,6 +49,7 @@ using namespace std;
 /* Globals */
 int serverSocket;
 char* socketFile;
+volatile sig_atomic_t interrupted = 0;     // set by signalHandler, the receive loop returns once it sees it
 
 struct UDPHeader
 {
@@ -40,24 +60,106 @@ struct UDPHeader
 };
 
 
+/* Capture */
+const int CAPTURE_SLOTS = 4096;             // packets buffered between the receive loop and the writer thread
+const int CAPTURE_BLOCK = 32;               // cipher block size of the capture files
+const size_t CAPTURE_FLUSH = 1 << 16;       // bytes encrypted and written at a time, a multiple of the block size
+const int CAPTURE_KEYS = 1 << 15;           // segments before a keystream repeats, the number of distinct keystreams expandKey makes
+
+struct capturePacket
+{
+    uint16_t length;
+    uint8_t data[1500];
+};
+
+struct captureState
+{
+    bool enabled = false;
+    string directory;                       // directory holding the segment files
+    uint32_t kv;                            // key value
+    off_t segmentBytes;                     // size at which a new segment is started
+    vector<capturePacket> slots;            // ring buffer, filled by the receive loop and drained by the writer
+    atomic<uint64_t> head{0};               // packets pushed by the receive loop
+    atomic<uint64_t> tail{0};               // packets taken by the writer
+    atomic<uint64_t> dropped{0};            // packets lost to a full ring
+    atomic<bool> stop{false};               // tells the writer to drain and exit
+    atomic<uint32_t> waiting{0};            // the writer sleeps on the eventfd until it is woken
+    int wake = -1;                          // eventfd that wakes the writer
+    thread writer;
+};
+captureState capture;
+
+struct captureSegment
+{
+    int file = -1;                          // segment file descriptor
+    int index = 0;                          // number of the next segment
+    off_t bytes = 0;                        // bytes written to the segment
+    uint8_t key[CAPTURE_BLOCK];             // key for the next block of the segment
+    vector<uint8_t> pending;                // framed packets not yet encrypted
+};
+
+
 /* Function Prototypes */
 void cleanup();
 void signalHandler(int);
 uint16_t calculateChecksum(UDPHeader&, uint8_t*);
 void printData(uint8_t*, uint16_t);
+void decodePacket(uint8_t*, ssize_t);
+int decodeCapture(char*, char*);
+void capturePush(uint8_t*, ssize_t);
+void captureWakeup();
+void captureWriter();
+bool openSegment(captureSegment&);
+uint32_t segmentKey(uint32_t, int);
+bool flushSegment(captureSegment&, bool);
 
 
 int main(int argc, char* argv[])
 {
+    // decode a capture segment instead of serving
+    if(argc == 4 && !strcmp(argv[1], "--decode"))
+    {
+        return decodeCapture(argv[2], argv[3]);
+    }
+
     // validate command line arguments
-    if(argc != 2)
+    if((argc != 2 && argc != 5 && argc != 6) || (argc > 2 && strcmp(argv[2], "--capture")))
     {
-        cout << "Usage: " << argv[0] << " <socket file>" << endl;
+        cout << "Usage: " << argv[0] << " <socket file> [--capture <directory> <key> [segment megabytes]]" << endl;
+        cout << "       " << argv[0] << " --decode <capture file> <key>" << endl;
         return -1;
     }
     socketFile = argv[1];
 
 
+    // validate capture options
+    if(argc > 2)
+    {
+        if(!stringToHex((string)argv[4], capture.kv))
+        {
+            return -1;
+        }
+
+        int megabytes = argc == 6 ? atoi(argv[5]) : 64;
+        if(megabytes <= 0)
+        {
+            cout << argv[5] << ": segment size must be a positive number of megabytes." << endl;
+            return -1;
+        }
+
+        capture.enabled = true;
+        capture.directory = argv[3];
+        capture.segmentBytes = (off_t)megabytes << 20;
+        capture.slots.resize(CAPTURE_SLOTS);
+        capture.wake = eventfd(0, EFD_CLOEXEC);
+        if(capture.wake < 0)
+        {
+            perror("Capture eventfd");
+            return -1;
+        }
+    }
+
+
     // create server socket
     serverSocket = socket(AF_UNIX, SOCK_RAW, 0);
     if(serverSocket < 0)
@@ -86,14 +188,23 @@ int main(int argc, char* argv[])
     atexit(cleanup);
 
 
-    // register signal interrupt function
-    signal(SIGINT, signalHandler);
+    // register signal interrupt function, without SA_RESTART so a blocked read returns and the loop sees the interrupt
+    struct sigaction action = {};
+    action.sa_handler = signalHandler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+
+
+    // start the capture writer
+    if(capture.enabled)
+    {
+        capture.writer = thread(captureWriter);
+    }
 
 
     /* UDP Server */
     int MTU = 1500;         // Maximum Transmission Unit
     uint8_t buffer[MTU];    // buffer to read the UDP data
-    UDPHeader udpHeader;    // struct to store UDP header data
     
     for(;;)
     {
@@ -101,6 +212,15 @@ int main(int argc, char* argv[])
         
         // read the UDP packet on the server socket
         ssize_t bytes = read(serverSocket, &buffer, sizeof(buffer));
+        if(interrupted)
+        {
+            // leave through exit() so cleanup runs on this thread, not in the signal handler
+            return 0;
+        }
+        if(bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
         if(bytes <= 0)
         {
             cout << "There was an error reading UDP data on the server socket..." << endl;
@@ -108,54 +228,13 @@ int main(int argc, char* argv[])
         }
         else
         {
-            cout << bytes << " byte(s) of data recieved." << endl;
-            cout << "Decoding UDP" << endl;
-            cout << "------------" << endl;
-
-
-            // copy UDP header portion to the UDP header structure
-            memcpy(&udpHeader, buffer, sizeof(udpHeader));
-
-
-            // calculate the size of the data
-            uint16_t dataLength = ntohs(udpHeader.length) - sizeof(udpHeader);
-
-
-            // copy the UDP data portion into the UDP data array
-            uint8_t data[dataLength];
-            memcpy(data, buffer + sizeof(udpHeader), dataLength);
-
-
-            // convert UDP header to host byte order
-            udpHeader.sourcePort = ntohs(udpHeader.sourcePort);
-            udpHeader.destinationPort = ntohs(udpHeader.destinationPort);
-            udpHeader.length = ntohs(udpHeader.length);
-            udpHeader.checksum = ntohs(udpHeader.checksum);
-
-
-            // print UDP packet details
-            cout << "SPORT: " << udpHeader.sourcePort << endl;
-            cout << "DPORT: " << udpHeader.destinationPort << endl;
-            cout << "LENGTH: " << udpHeader.length << endl;
-            cout << "CKSUM: 0x" << hex << udpHeader.checksum;
-            cout << dec;
-
-
-            // verify checksum
-            uint16_t checksum = calculateChecksum(udpHeader, data);
-            if(checksum == udpHeader.checksum)
-            {
-                cout << "...OK." << endl;
-            }
-            else
+            // hand the raw packet to the capture writer
+            if(capture.enabled)
             {
-                cout << "...CORRUPT...0x" << hex << checksum << endl;
+                capturePush(buffer, bytes);
             }
-            
-            cout << dec;
-            cout << dataLength << " byte(s) of data follows." << endl << endl;
-            printData(data, dataLength);
-            cout << endl;
+
+            decodePacket(buffer, bytes);
         }
     }
 
@@ -172,6 +251,15 @@ int main(int argc, char* argv[])
 */
 void cleanup()
 {
+    // let the capture writer drain the ring and close the last segment
+    if(capture.writer.joinable())
+    {
+        capture.stop = true;
+        captureWakeup();
+        capture.writer.join();
+        cout << "Capture: " << capture.tail << " packet(s) written, " << capture.dropped << " dropped." << endl;
+    }
+
     // close server socket
     close(serverSocket);
 
@@ -185,15 +273,15 @@ void cleanup()
  *  Function: signalHandler
  *  Parameters: integer representing an interrupt signal
  *  Return: None
- *  Description: This function handles an interrupt signal before termination. It clears the interrupt and gracefully exits the application
+ *  Description: This function handles an interrupt signal before termination. It only records the interrupt: cleanup joins the capture
+ *               writer and prints, which is not safe in a signal handler, so the receive loop returns from main and exits from there.
 */
 void signalHandler(int signal)
 {
     // clear signal
     (void)signal;
 
-    // exit
-    exit(EXIT_SUCCESS);
+    interrupted = 1;
 }
 
 
@@ -251,4 +339,348 @@ void printData(uint8_t* data, uint16_t dataLength)
     // reset the output stream to decimal
     cout << dec;
     cout << endl;
-}
\ No newline at end of file
+}
+
+
+
+/* Function: decodePacket
+ * Parameters: a pointer to a UDP packet, the number of bytes in the packet
+ * Return: None
+ * Description: This function prints the header of the packet, verifies its checksum, and prints its data.
+*/
+void decodePacket(uint8_t* buffer, ssize_t bytes)
+{
+    UDPHeader udpHeader;    // struct to store UDP header data
+
+    cout << bytes << " byte(s) of data recieved." << endl;
+    cout << "Decoding UDP" << endl;
+    cout << "------------" << endl;
+
+
+    // copy UDP header portion to the UDP header structure
+    memcpy(&udpHeader, buffer, sizeof(udpHeader));
+
+
+    // calculate the size of the data
+    uint16_t dataLength = ntohs(udpHeader.length) - sizeof(udpHeader);
+
+
+    // copy the UDP data portion into the UDP data array
+    uint8_t data[dataLength];
+    memcpy(data, buffer + sizeof(udpHeader), dataLength);
+
+
+    // convert UDP header to host byte order
+    udpHeader.sourcePort = ntohs(udpHeader.sourcePort);
+    udpHeader.destinationPort = ntohs(udpHeader.destinationPort);
+    udpHeader.length = ntohs(udpHeader.length);
+    udpHeader.checksum = ntohs(udpHeader.checksum);
+
+
+    // print UDP packet details
+    cout << "SPORT: " << udpHeader.sourcePort << endl;
+    cout << "DPORT: " << udpHeader.destinationPort << endl;
+    cout << "LENGTH: " << udpHeader.length << endl;
+    cout << "CKSUM: 0x" << hex << udpHeader.checksum;
+    cout << dec;
+
+
+    // verify checksum
+    uint16_t checksum = calculateChecksum(udpHeader, data);
+    if(checksum == udpHeader.checksum)
+    {
+        cout << "...OK." << endl;
+    }
+    else
+    {
+        cout << "...CORRUPT...0x" << hex << checksum << endl;
+    }
+    
+    cout << dec;
+    cout << dataLength << " byte(s) of data follows." << endl << endl;
+    printData(data, dataLength);
+    cout << endl;
+}
+
+
+
+/* Function: decodeCapture
+ * Parameters: the path of a capture segment, the key in hexadecimal
+ * Return: 0 on success, -1 if the segment cannot be read or holds a cut off frame
+ * Description: This function decrypts a whole segment with the freshly expanded segment key, the way openSegment started it, and walks
+ *              the frames. Every packet is copied into an MTU sized buffer like the receive loop's and printed with decodePacket.
+*/
+int decodeCapture(char* path, char* keyText)
+{
+    uint32_t kv;
+    if(!stringToHex((string)keyText, kv))
+    {
+        return -1;
+    }
+
+    int file = open(path, O_RDONLY);
+    if(file < 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    // the segment number picks the key value, see openSegment
+    int index;
+    const char* name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    char rest;
+    if(sscanf(name, "capture-%d.bi%c", &index, &rest) != 2 || rest != 'n' || index < 0)
+    {
+        cout << path << ": not a capture-NNNNNN.bin segment, cannot tell its key." << endl;
+        close(file);
+        return -1;
+    }
+
+    // read and decrypt the whole segment
+    vector<uint8_t> stream;
+    uint8_t chunk[CAPTURE_FLUSH];
+    ssize_t bytes;
+    while((bytes = read(file, chunk, sizeof(chunk))) > 0)
+    {
+        stream.insert(stream.end(), chunk, chunk + bytes);
+    }
+    close(file);
+    if(bytes < 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    uint8_t key[CAPTURE_BLOCK];
+    expandKey(key, CAPTURE_BLOCK, segmentKey(kv, index));
+    cipherBuffer<CAPTURE_BLOCK>(key, stream.data(), stream.size());
+
+    // walk the frames
+    uint8_t buffer[sizeof(capturePacket::data)];
+    size_t position = 0;
+    int packets = 0;
+    while(position + sizeof(uint16_t) <= stream.size())
+    {
+        uint16_t length;
+        memcpy(&length, stream.data() + position, sizeof(length));
+        length = ntohs(length);
+        position += sizeof(length);
+        if(length > sizeof(buffer) || position + length > stream.size())
+        {
+            cout << path << ": frame " << packets << " is cut off or too long, wrong key?" << endl;
+            return -1;
+        }
+
+        memcpy(buffer, stream.data() + position, length);
+        position += length;
+        packets++;
+        decodePacket(buffer, length);
+    }
+
+    cout << packets << " packet(s) decoded." << endl;
+    return position == stream.size() ? 0 : -1;
+}
+
+
+
+/* Function: capturePush
+ * Parameters: a pointer to the packet read from the server socket, the number of bytes read
+ * Return: None
+ * Description: This function copies the packet into the capture ring for the writer thread. The receive loop is the only producer
+ *              and the writer the only consumer, so the ring needs no lock. If the ring is full the packet is dropped and counted.
+*/
+void capturePush(uint8_t* packet, ssize_t bytes)
+{
+    uint64_t head = capture.head.load(memory_order_relaxed);
+    if(head - capture.tail.load(memory_order_acquire) >= CAPTURE_SLOTS)
+    {
+        capture.dropped++;
+        return;
+    }
+
+    capturePacket& slot = capture.slots[head % CAPTURE_SLOTS];
+    slot.length = bytes;
+    memcpy(slot.data, packet, bytes);
+    capture.head.store(head + 1, memory_order_release);
+
+    // the writer raises its flag before checking the ring once more, so either it sees the packet or we see the flag
+    atomic_thread_fence(memory_order_seq_cst);
+    if(capture.waiting.load(memory_order_relaxed))
+    {
+        captureWakeup();
+    }
+}
+
+
+
+/* Function: captureWakeup
+ * Parameters: None
+ * Return: None
+ * Description: This function wakes the writer thread from its eventfd.
+*/
+void captureWakeup()
+{
+    uint64_t one = 1;
+    if(write(capture.wake, &one, sizeof(one)) < 0)
+    {
+        perror("Capture eventfd");
+    }
+}
+
+
+
+/* Function: captureWriter
+ * Parameters: None
+ * Return: None
+ * Description: This function runs on the writer thread. It takes packets from the capture ring, frames each one with its length in
+ *              network byte order, and encrypts and writes the framed stream CAPTURE_FLUSH bytes at a time. A new segment is started
+ *              once the current one reaches the segment size. An empty ring is slept out on the eventfd. When told to stop it drains the
+ *              ring and closes the last segment.
+*/
+void captureWriter()
+{
+    captureSegment segment;
+    segment.pending.reserve(CAPTURE_FLUSH + sizeof(capturePacket));
+
+    for(;;)
+    {
+        uint64_t tail = capture.tail.load(memory_order_relaxed);
+        if(tail == capture.head.load(memory_order_acquire))
+        {
+            if(capture.stop)
+            {
+                break;
+            }
+
+            // nothing to write, sleep until capturePush or cleanup wakes us
+            capture.waiting.store(1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            if(tail == capture.head.load(memory_order_acquire) && !capture.stop)
+            {
+                uint64_t count;
+                if(read(capture.wake, &count, sizeof(count)) < 0 && errno != EINTR)
+                {
+                    perror("Capture eventfd");
+                }
+            }
+            capture.waiting.store(0, memory_order_relaxed);
+            continue;
+        }
+
+        capturePacket& packet = capture.slots[tail % CAPTURE_SLOTS];
+
+        // start a new segment on a packet boundary
+        if(segment.file < 0 || segment.bytes + (off_t)segment.pending.size() >= capture.segmentBytes)
+        {
+            if(segment.file >= 0)
+            {
+                flushSegment(segment, true);
+                close(segment.file);
+            }
+            if(!openSegment(segment))
+            {
+                return;
+            }
+        }
+
+        // frame the packet
+        uint16_t length = htons(packet.length);
+        uint8_t* frame = (uint8_t*)&length;
+        segment.pending.insert(segment.pending.end(), frame, frame + sizeof(length));
+        segment.pending.insert(segment.pending.end(), packet.data, packet.data + packet.length);
+        capture.tail.store(tail + 1, memory_order_release);
+
+        if(segment.pending.size() >= CAPTURE_FLUSH && !flushSegment(segment, false))
+        {
+            return;
+        }
+    }
+
+    if(segment.file >= 0)
+    {
+        flushSegment(segment, true);
+        close(segment.file);
+    }
+}
+
+
+
+/* Function: openSegment
+ * Parameters: a reference to the capture segment
+ * Return: false if the segment file could not be created
+ * Description: This function creates the next segment file and expands the key for it. Every segment starts from a fresh key, which
+ *              is what lets a segment be decrypted without the segments before it, but from the key value of its own segment number.
+ *              Continuing the keystream of the segment before would not help: the key stops changing after two rotations.
+*/
+bool openSegment(captureSegment& segment)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/capture-%06d.bin", segment.index++);
+    string path = capture.directory + name;
+
+    segment.file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(segment.file < 0)
+    {
+        perror(path.c_str());
+        return false;
+    }
+
+    segment.bytes = 0;
+    uint32_t kv = segmentKey(capture.kv, segment.index - 1);
+    expandKey(segment.key, CAPTURE_BLOCK, kv);
+
+    char key[16];
+    snprintf(key, sizeof(key), "0x%08x", kv);
+    cout << "Capture: " << path << " encrypted with key " << key << endl;
+    return true;
+}
+
+
+
+/* Function: segmentKey
+ * Parameters: the capture key value, the segment number
+ * Return: the key value of the segment
+ * Description: This function mixes the segment number into the capture key value. expandKey only keeps the sums A - B + C + D and
+ *              A + B - C + D of the key bytes A to D, so the low 8 bits of the number are added to D and the next 7 bits to C. Each
+ *              pair of those changes the two sums differently, which gives CAPTURE_KEYS segments in a row distinct keystreams.
+*/
+uint32_t segmentKey(uint32_t kv, int index)
+{
+    uint8_t d = kv + index;
+    uint8_t c = (kv >> 8) + ((index >> 8) & (CAPTURE_KEYS / 256 - 1));
+    return (kv & 0xffff0000) | (uint32_t)c << 8 | d;
+}
+
+
+
+/* Function: flushSegment
+ * Parameters: a reference to the capture segment, true if this is the end of the segment
+ * Return: false if the segment could not be written
+ * Description: This function encrypts and writes the pending bytes. Only whole blocks are written until the end of the segment, the
+ *              remainder waits for the next packets so the key rotation matches a full read of the file by ./cipher.
+*/
+bool flushSegment(captureSegment& segment, bool final)
+{
+    size_t count = segment.pending.size();
+    if(!final)
+    {
+        count -= count % CAPTURE_BLOCK;
+    }
+
+    cipherBuffer<CAPTURE_BLOCK>(segment.key, segment.pending.data(), count);
+
+    for(size_t done = 0; done < count;)
+    {
+        ssize_t bytes = write(segment.file, segment.pending.data() + done, count - done);
+        if(bytes <= 0)
+        {
+            perror("capture");
+            return false;
+        }
+        done += bytes;
+    }
+
+    segment.bytes += count;
+    segment.pending.erase(segment.pending.begin(), segment.pending.begin() + count);
+    return true;
+}